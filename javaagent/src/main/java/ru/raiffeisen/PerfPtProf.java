@@ -1,7 +1,117 @@
 package ru.raiffeisen;
 
+import java.util.Arrays;
+import java.util.regex.Pattern;
+
+/**
+ * The instrumented code keeps each trigger's countdown in {@link #countdowns}
+ * and checks it inline, so an invocation only calls into libperf.so once the
+ * countdown is over and, while its capture runs, on the way out.
+ */
 public class PerfPtProf {
-    public static native void init(int cd);
-    public static native void start();
-    public static native void stop();
+    // same as in profiler.cpp
+    public static final int MAX_TRIGGERS = 256;
+
+    // invocations left before libperf.so is asked for a capture, 0 once it was started
+    public static final int[] countdowns = new int[MAX_TRIGGERS];
+    // a capture started by this trigger is running
+    public static final boolean[] armed = new boolean[MAX_TRIGGERS];
+    // compiled once for the '~' trigger predicates, copied on write
+    private static volatile Pattern[] patterns = new Pattern[0];
+
+    /**
+     * @policy is the capture policy, see profiler-policy.hpp, null for one
+     * capture after @countdown invocations.
+     */
+    public static void addTrigger(int id, String label, int countdown, String policy) {
+        countdowns[id] = countdown;
+        armed[id] = false;
+        registerTrigger(id, label, countdown, policy);
+    }
+
+    /**
+     * A trigger that captures once the JIT is done with @method of
+     * @class_name, see profiler-warmup.hpp. Null @descriptor for any overload.
+     */
+    public static void addWarmupTrigger(int id, String label, String policy, String class_name, String method, String descriptor) {
+        watchWarmup(id, class_name, method, descriptor);
+        addTrigger(id, label, 1, policy);
+    }
+
+    // start() returns this or the countdown to the next fire(), 0 once the trigger is done
+    private static final int STARTED = -1;
+    // stop() returns this or the countdown to the next fire()
+    private static final int NOT_STOPPED = -1;
+
+    // called by the invocation that took the countdown to 0
+    public static void fire(int id) {
+        int countdown = start(id);
+        if (countdown == STARTED) {
+            armed[id] = true;
+        } else {
+            // warming up, not wanted by the policy or another capture is running
+            countdowns[id] = countdown;
+        }
+    }
+
+    public static void disarm(int id) {
+        int countdown = stop(id);
+        if (countdown != NOT_STOPPED) {
+            armed[id] = false;
+            // 0 once the trigger has taken all of its captures
+            countdowns[id] = countdown;
+        }
+    }
+
+    // the captured invocation is leaving with @thrown, which is rethrown after
+    public static void disarmThrown(Throwable thrown, int id) {
+        int countdown = stopThrown(id, thrown.getClass().getName());
+        if (countdown != NOT_STOPPED) {
+            armed[id] = false;
+            countdowns[id] = countdown;
+        }
+    }
+
+    public static synchronized int addPattern(String regex) {
+        Pattern[] grown = Arrays.copyOf(patterns, patterns.length + 1);
+        grown[patterns.length] = Pattern.compile(regex);
+        patterns = grown;
+        return patterns.length - 1;
+    }
+
+    public static boolean matches(int pattern, String s) {
+        return s != null && patterns[pattern].matcher(s).matches();
+    }
+
+    private static native void registerTrigger(int id, String label, int countdown, String policy);
+    private static native void watchWarmup(int id, String class_name, String method, String descriptor);
+    private static native int start(int id);
+    private static native int stop(int id);
+    private static native int stopThrown(int id, String exception);
+
+    /**
+     * Marks the start of phase @id of the captured invocation, reports then
+     * split its time by phase. A PTWRITE where the CPU has it, a few cycles
+     * otherwise, and nothing at all outside of captures.
+     */
+    public static native void mark(long id);
+    // the name of phase @id in the reports
+    public static native void nameMarker(long id, String name);
+
+    /**
+     * Takes a capture of a trigger with the carry policy along with work
+     * handed to another thread: carry() where the task is handed over, once
+     * per task, and pass the token with it; join(token) on the thread that
+     * runs the task and leave(token) once it's done. The capture then covers
+     * that thread in between, and ends once the capturing invocation is over
+     * and every token has been left. Tokens are 0 outside of captures, where
+     * join() and leave() do nothing.
+     */
+    public static native long carry();
+    public static native void join(long token);
+    public static native void leave(long token);
+
+    // blocks until every trigger has its report out, attached agents only
+    public static native void awaitCaptures();
+    public static native void detach();
 }
@@ -4,7 +4,9 @@ import org.objectweb.asm.*;
 
 import java.io.IOException;
 import java.util.ArrayList;
+import java.util.HashMap;
 import java.util.List;
+import java.util.Map;
 import java.util.function.Function;
 
 /**
@@ -12,25 +14,34 @@ import java.util.function.Function;
  */
 class ClassInstrumenter extends ClassVisitor {
 
+    private final static String PROFILER_CLASS = "ru/raiffeisen/PerfPtProf";
     private final static boolean OUTPUT_PROCESSED_CLASSES = System.getProperty("OUTPUT_INSTRUMENTED_CLASSES") != null;
 
     private List<MethodToGenerateInfo> methods_to_generate = new ArrayList<>();
     private String class_name;
-    private final String triggerClass;
-    private final String triggerMethod;
-    private final String triggerMethodSignature;
+    // for the predicates on fields, ClassReader visits them before the methods
+    private final Map<String, TriggerPredicate.Field> fields = new HashMap<>();
+    private final List<TriggerSpec> triggers;
+    // retransformation can't add methods, so the trigger gets its calls inline
+    private final boolean in_place;
 
     public ClassInstrumenter(
             int i,
             ClassVisitor classVisitor,
-            String triggerClass_,
-            String triggerMethod_,
-            String triggerMethodSignature_)
+            List<TriggerSpec> triggers_)
+    {
+        this(i, classVisitor, triggers_, false);
+    }
+
+    public ClassInstrumenter(
+            int i,
+            ClassVisitor classVisitor,
+            List<TriggerSpec> triggers_,
+            boolean in_place_)
     {
         super(i, classVisitor);
-        triggerClass = triggerClass_;
-        triggerMethod = triggerMethod_;
-        triggerMethodSignature = triggerMethodSignature_;
+        triggers = triggers_;
+        in_place = in_place_;
     }
 
     public void visit(int version, int access, String name, String signature,
@@ -39,35 +50,68 @@ class ClassInstrumenter extends ClassVisitor {
         super.visit(version, access, name, signature, superName, interfaces);
     }
 
+    @Override
+    public FieldVisitor visitField(int access, String name, String desc, String signature, Object value) {
+        fields.put(name, new TriggerPredicate.Field(desc, (access & Opcodes.ACC_STATIC) != 0));
+        return super.visitField(access, name, desc, signature, value);
+    }
+
+    private TriggerSpec find_trigger(int access, String name, String desc) {
+        for (TriggerSpec trigger : triggers) {
+            if (trigger.matches(class_name, name, desc) && predicates_apply(trigger, access, desc)) {
+                return trigger;
+            }
+        }
+        return null;
+    }
+
+    private boolean predicates_apply(TriggerSpec trigger, int access, String desc) {
+        for (TriggerPredicate predicate : trigger.predicates) {
+            String error = predicate.check(access, desc, fields);
+            if (error != null) {
+                System.out.println("Trigger " + trigger.label + ": " + predicate + " doesn't fit "
+                        + class_name + "::" + trigger.method_name + desc + ", " + error);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // the original body of a trigger method, behind the generated one
+    static String impl_name(String class_name, String name) {
+        return "__$$" + class_name + "$$" + name + "$$IMPL$$__";
+    }
+
     @Override
     public MethodVisitor visitMethod(int access, String name, String desc, String signature, String[] exceptions) {
         if ((access & Opcodes.ACC_ABSTRACT) == 0) {
             if (!name.equals("<init>")) {
                 if (!name.equals("<clinit>")) {
-		    if (class_name.equals(triggerClass)) {
-			if (name.equals(triggerMethod)) {
-			    if (OUTPUT_PROCESSED_CLASSES) {
-				System.out.println("Processing: " + class_name + "::" + name + "/" + signature);
-				String wrapped_name = "__$$" + class_name + "$$" + name + "$$IMPL$$__";
-
-				MethodVisitor mv;
+		    TriggerSpec trigger = find_trigger(access, name, desc);
+		    if (trigger != null) {
+			if (OUTPUT_PROCESSED_CLASSES) {
+			    System.out.println("Processing: " + class_name + "::" + name + desc + " as trigger " + trigger.label);
+			}
+			if (in_place) {
+			    return new InPlaceTriggerAdapter(api, cv.visitMethod(access, name, desc, signature, exceptions), trigger, access, desc);
+			}
+			String wrapped_name = impl_name(class_name, name);
 
-				mv = cv.visitMethod(access, wrapped_name, desc, signature, exceptions);
+			MethodVisitor mv;
 
-				methods_to_generate.add(new MethodToGenerateInfo(access,
-										 name,
-										 desc,
-										 signature,
-										 exceptions,
-										 wrapped_name,
-										 class_name));
+			mv = cv.visitMethod(access, wrapped_name, desc, signature, exceptions);
 
-				return mv;
+			methods_to_generate.add(new MethodToGenerateInfo(access,
+									 name,
+									 desc,
+									 signature,
+									 exceptions,
+									 wrapped_name,
+									 class_name,
+									 trigger));
 
-			    }
-			}
+			return mv;
 		    }
-
 		}
 	    }
 	}
@@ -102,7 +146,7 @@ class ClassInstrumenter extends ClassVisitor {
         Label try_end = new Label();
         mv.visitLabel(try_end);
 
-        emit_tracer_end(mv, "stop");
+        emit_tracer_end(mv, info.trigger.id);
         local_head_top = emit_normal_return(mv, info, local_head_top);
 
 
@@ -111,7 +155,9 @@ class ClassInstrumenter extends ClassVisitor {
 
         local_head_top = emit_exception_handler(mv, local_head_top, (heap_top) -> {
             int top = heap_top;
-            emit_tracer_end(mv, "stop");
+            mv.visitVarInsn(Opcodes.ALOAD, heap_top);
+            emit_tracer_end_thrown(mv, info.trigger.id);
+            mv.visitInsn(Opcodes.POP);
             return top;
         });
 
@@ -158,10 +204,82 @@ class ClassInstrumenter extends ClassVisitor {
         return local_heap_top;
     }
 
-    private void emit_tracer_end(MethodVisitor mv,
-                                 String method_name)
-    {
-        mv.visitMethodInsn(Opcodes.INVOKESTATIC, "ru/raiffeisen/PerfPtProf", method_name, "()V", false);
+    /*
+     * if (countdowns[id] > 0 && predicates && --countdowns[id] == 0) PerfPtProf.fire(id);
+     *
+     * The decrement races with other threads, it's only a countdown: whatever
+     * invocation gets to 0 asks libperf.so for the capture. Once the
+     * countdown is over the fast path is a load and a compare, the predicates
+     * only run while it is on. Must be emitted before the method's locals are
+     * touched.
+     */
+    private void emit_tracer_start(MethodVisitor mv, TriggerSpec trigger, int access, String desc) {
+        int trigger_id = trigger.id;
+        Label done = new Label();
+
+        mv.visitFieldInsn(Opcodes.GETSTATIC, PROFILER_CLASS, "countdowns", "[I");
+        emit_push_int(mv, trigger_id);
+        mv.visitInsn(Opcodes.IALOAD);
+        mv.visitJumpInsn(Opcodes.IFLE, done);
+
+        for (TriggerPredicate predicate : trigger.predicates) {
+            predicate.emit(mv, class_name, access, desc, fields, done);
+        }
+
+        mv.visitFieldInsn(Opcodes.GETSTATIC, PROFILER_CLASS, "countdowns", "[I");
+        emit_push_int(mv, trigger_id);
+        mv.visitInsn(Opcodes.DUP2);
+        mv.visitInsn(Opcodes.IALOAD);
+        mv.visitInsn(Opcodes.ICONST_1);
+        mv.visitInsn(Opcodes.ISUB);
+        mv.visitInsn(Opcodes.DUP_X2);
+        mv.visitInsn(Opcodes.IASTORE);
+        mv.visitJumpInsn(Opcodes.IFNE, done);
+        emit_push_int(mv, trigger_id);
+        mv.visitMethodInsn(Opcodes.INVOKESTATIC, PROFILER_CLASS, "fire", "(I)V", false);
+        mv.visitLabel(done);
+    }
+
+    // if (armed[id]) PerfPtProf.disarm(id);
+    private static void emit_tracer_end(MethodVisitor mv, int trigger_id) {
+        Label done = new Label();
+
+        mv.visitFieldInsn(Opcodes.GETSTATIC, PROFILER_CLASS, "armed", "[Z");
+        emit_push_int(mv, trigger_id);
+        mv.visitInsn(Opcodes.BALOAD);
+        mv.visitJumpInsn(Opcodes.IFEQ, done);
+        emit_push_int(mv, trigger_id);
+        mv.visitMethodInsn(Opcodes.INVOKESTATIC, PROFILER_CLASS, "disarm", "(I)V", false);
+        mv.visitLabel(done);
+    }
+
+    /*
+     * The same with the exception on the stack, which is left there:
+     * if (armed[id]) PerfPtProf.disarmThrown(exception, id);
+     */
+    private static void emit_tracer_end_thrown(MethodVisitor mv, int trigger_id) {
+        Label done = new Label();
+
+        mv.visitFieldInsn(Opcodes.GETSTATIC, PROFILER_CLASS, "armed", "[Z");
+        emit_push_int(mv, trigger_id);
+        mv.visitInsn(Opcodes.BALOAD);
+        mv.visitJumpInsn(Opcodes.IFEQ, done);
+        mv.visitInsn(Opcodes.DUP);
+        emit_push_int(mv, trigger_id);
+        mv.visitMethodInsn(Opcodes.INVOKESTATIC, PROFILER_CLASS, "disarmThrown", "(Ljava/lang/Throwable;I)V", false);
+        mv.visitLabel(done);
+    }
+
+    private static void emit_push_int(MethodVisitor mv, int value) {
+        if (value >= -1 && value <= 5) {
+            mv.visitInsn(Opcodes.ICONST_0 + value);
+        } else if (value >= Byte.MIN_VALUE && value <= Byte.MAX_VALUE) {
+            mv.visitIntInsn(Opcodes.BIPUSH, value);
+        } else if (value >= Short.MIN_VALUE && value <= Short.MAX_VALUE) {
+            mv.visitIntInsn(Opcodes.SIPUSH, value);
+        } else {
+            mv.visitLdcInsn(value);
+        }
     }
 
     private int emit_impl_call(MethodVisitor mv, MethodToGenerateInfo info, Type[] signature, int local_head_top) {
@@ -184,7 +302,7 @@ class ClassInstrumenter extends ClassVisitor {
     }
 
     private int emit_tracer_start(MethodVisitor mv, MethodToGenerateInfo info, int idx) {
-        emit_tracer_end(mv, "start");
+        emit_tracer_start(mv, info.trigger, info.access, info.desc);
 
         if ((info.access & Opcodes.ACC_STATIC) == 0) {
             mv.visitVarInsn(Opcodes.ALOAD, 0);
@@ -193,6 +311,53 @@ class ClassInstrumenter extends ClassVisitor {
         return idx;
     }
 
+    /**
+     * The countdown on entry, the end of the capture before every return and
+     * in a catch-all handler around the whole body that rethrows. Frames and
+     * maxs are recomputed by the class writer.
+     */
+    private class InPlaceTriggerAdapter extends MethodVisitor {
+        private final TriggerSpec trigger;
+        private final int trigger_id;
+        private final int access;
+        private final String desc;
+        private final Label try_begin = new Label();
+        private final Label finally_begin = new Label();
+
+        InPlaceTriggerAdapter(int api, MethodVisitor mv, TriggerSpec trigger, int access, String desc) {
+            super(api, mv);
+            this.trigger = trigger;
+            this.trigger_id = trigger.id;
+            this.access = access;
+            this.desc = desc;
+        }
+
+        @Override
+        public void visitCode() {
+            super.visitCode();
+            emit_tracer_start(mv, trigger, access, desc);
+            mv.visitLabel(try_begin);
+        }
+
+        @Override
+        public void visitInsn(int opcode) {
+            if (opcode >= Opcodes.IRETURN && opcode <= Opcodes.RETURN) {
+                emit_tracer_end(mv, trigger_id);
+            }
+            super.visitInsn(opcode);
+        }
+
+        @Override
+        public void visitMaxs(int maxStack, int maxLocals) {
+            mv.visitLabel(finally_begin);
+            emit_tracer_end_thrown(mv, trigger_id);
+            mv.visitInsn(Opcodes.ATHROW);
+            // last in the table, so the method's own handlers come first
+            mv.visitTryCatchBlock(try_begin, finally_begin, finally_begin, null);
+            super.visitMaxs(maxStack + 5, maxLocals);
+        }
+    }
+
     private static class MethodToGenerateInfo {
         public final int access;
         public final String name;
@@ -201,6 +366,7 @@ class ClassInstrumenter extends ClassVisitor {
         public final String[] exceptions;
         public final String method_to_call;
         public final String clazz_name;
+        public final TriggerSpec trigger;
 
         private MethodToGenerateInfo(int access,
                                      String name,
@@ -208,7 +374,8 @@ class ClassInstrumenter extends ClassVisitor {
                                      String signature,
                                      String[] exceptions,
                                      String method_to_call,
-                                     String clazz_name) {
+                                     String clazz_name,
+                                     TriggerSpec trigger) {
             this.access = access;
             this.name = name;
             this.desc = desc;
@@ -216,6 +383,7 @@ class ClassInstrumenter extends ClassVisitor {
             this.exceptions = exceptions;
             this.method_to_call = method_to_call;
             this.clazz_name = clazz_name;
+            this.trigger = trigger;
         }
     }
 }
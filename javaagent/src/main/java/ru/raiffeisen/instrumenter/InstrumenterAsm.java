@@ -10,10 +10,15 @@ import org.objectweb.asm.MethodVisitor;
 import org.objectweb.asm.Opcodes;
 
 import java.io.*;
+import java.lang.instrument.ClassFileTransformer;
 import java.lang.instrument.Instrumentation;
+import java.lang.instrument.UnmodifiableClassException;
 import java.nio.file.Files;
 import java.util.ArrayList;
 import java.util.Arrays;
+import java.util.HashSet;
+import java.util.List;
+import java.util.Set;
 import java.util.regex.Matcher;
 import java.util.regex.Pattern;
 
@@ -30,7 +35,7 @@ import static org.objectweb.asm.Opcodes.V1_8;
 public class InstrumenterAsm {
 
     //private static ClassLoader agentClassLoader = new InnerJarClassLoader();
-    private static ClassInfoCache cache = new ClassInfoCache();
+    private static final boolean dump_class_files = System.getProperty("DUMP_OUT_CLASSES") != null;
 
     public static void premain(String arguments, Instrumentation instr) {
         ArrayList<Pattern> patterns_local = new ArrayList<>();
@@ -44,21 +49,27 @@ public class InstrumenterAsm {
             }
         }
         Pattern[] patterns = patterns_local.toArray(new Pattern[patterns_local.size()]);
-        Boolean dump_class_files = System.getProperty("DUMP_OUT_CLASSES") != null;
 
-        String triggerMethod = System.getProperty("TRIGGER_METHOD");
-        String triggerClass = System.getProperty("TRIGGER_CLASS");
-        String triggerMethodSignature = System.getProperty("TRIGGER_METHOD_SIGNATURE");
-	String countdownStr = System.getProperty("TRIGGER_COUNTDOWN");
-	
-	int countdown = countdownStr != null ? Integer.valueOf(countdownStr) : 1;
-	PerfPtProf.init(countdown);
+        List<TriggerSpec> triggers;
+        try {
+            triggers = TriggerSpec.load(System.getProperty("TRIGGERS"));
+        } catch (IOException e) {
+            e.printStackTrace();
+            System.exit(2);
+            return;
+        }
+        add_triggers(triggers, false);
+        if (triggers.isEmpty()) {
+            return;
+        }
 
-	System.out.println("Trigger class: " + triggerClass);
-	System.out.println("Trigger method: " + triggerMethod);
-	System.out.println("Trigger method signature: " + triggerMethodSignature);
+        // only trigger classes change, the rest is turned down by name before any parsing
+        Set<String> trigger_classes = trigger_classes(triggers);
 
         instr.addTransformer((classLoader, s, aClass, protectionDomain, bytes) -> {
+            if (s == null || !trigger_classes.contains(s)) {
+                return null;
+            }
 
             boolean should_transform = patterns.length == 0;
 
@@ -74,42 +85,133 @@ public class InstrumenterAsm {
                 return null;
             }
 
-            ClassReader cr = new ClassReader(bytes);
+            return instrument(classLoader, s, bytes, triggers, false);
+        });
+    }
+
+    /**
+     * Attaches to a running JVM, after libperf.so was loaded with
+     * Agent_OnAttach. The argument is the triggers file. Only the trigger
+     * classes are retransformed, and once every trigger has taken its capture
+     * their original bytecode is restored and the JVMTI events are turned off.
+     */
+    public static void agentmain(String arguments, Instrumentation instr) {
+        List<TriggerSpec> triggers;
+        try {
+            triggers = TriggerSpec.load(arguments != null && !arguments.isEmpty() ? arguments : null);
+        } catch (IOException e) {
+            // never take the running application down
+            e.printStackTrace();
+            return;
+        }
+        if (triggers.isEmpty()) {
+            System.out.println("No triggers to attach");
+            return;
+        }
+        add_triggers(triggers, true);
+
+        Set<String> trigger_classes = trigger_classes(triggers);
+
+        ClassFileTransformer transformer = (classLoader, s, aClass, protectionDomain, bytes) -> {
+            if (s == null || !trigger_classes.contains(s)) {
+                return null;
+            }
+            return instrument(classLoader, s, bytes, triggers, true);
+        };
+        instr.addTransformer(transformer, true);
+        retransform(instr, trigger_classes);
+
+        Thread detacher = new Thread(() -> {
+            PerfPtProf.awaitCaptures();
+            // retransforming without us brings the original class files back
+            instr.removeTransformer(transformer);
+            retransform(instr, trigger_classes);
+            PerfPtProf.detach();
+            System.out.println("Triggers restored, profiler detached");
+        }, "rperf-detach");
+        detacher.setDaemon(true);
+        detacher.start();
+    }
+
+    private static void add_triggers(List<TriggerSpec> triggers, boolean in_place) {
+        for (TriggerSpec trigger : triggers) {
+            if (trigger.warms_up()) {
+                // the JIT compiles the original body, wherever it ends up
+                String method = in_place ? trigger.method_name : ClassInstrumenter.impl_name(trigger.class_name, trigger.method_name);
+                PerfPtProf.addWarmupTrigger(trigger.id, trigger.label, trigger.policy, trigger.class_name, method, trigger.descriptor);
+            } else {
+                PerfPtProf.addTrigger(trigger.id, trigger.label, trigger.countdown, trigger.policy);
+            }
+            System.out.println("Trigger " + trigger.id + ": " + trigger);
+        }
+    }
+
+    private static Set<String> trigger_classes(List<TriggerSpec> triggers) {
+        Set<String> class_names = new HashSet<>();
+        for (TriggerSpec trigger : triggers) {
+            class_names.add(trigger.class_name);
+        }
+        return class_names;
+    }
 
-            if ((cr.getAccess() & Opcodes.ACC_INTERFACE) != 0) {
-                return bytes;
+    private static void retransform(Instrumentation instr, Set<String> class_names) {
+        List<Class<?>> classes = new ArrayList<>();
+        for (Class<?> c : instr.getAllLoadedClasses()) {
+            if (instr.isModifiableClass(c) && class_names.contains(c.getName().replace('.', '/'))) {
+                classes.add(c);
             }
+        }
+        if (classes.isEmpty()) {
+            return;
+        }
+        try {
+            instr.retransformClasses(classes.toArray(new Class<?>[classes.size()]));
+        } catch (UnmodifiableClassException | RuntimeException e) {
+            e.printStackTrace();
+        }
+    }
 
-            ClassInfoVisitor ciVisitor = new ClassInfoVisitor();
-            cr.accept(ciVisitor, 0);
-            // update cache with information about classes
-            cache.getOrInitClassInfoMap(classLoader).put(s, ciVisitor.buildClassInfo());
-            // create FrameClassWriter using cache
+    private static byte[] instrument(ClassLoader classLoader, String s, byte[] bytes, List<TriggerSpec> triggers, boolean in_place) {
+        ClassReader cr = new ClassReader(bytes);
+
+        if ((cr.getAccess() & Opcodes.ACC_INTERFACE) != 0) {
+            return bytes;
+        }
 
-            ClassWriter cw = //new ClassWriter(COMPUTE_MAXS | COMPUTE_FRAMES);
-                    new FrameClassWriter(classLoader, cache, V1_8);
+        // one cache per class: it holds just the types this class's frames
+        // need and is dropped with it. The class goes in first, generated
+        // classes have no class file to build its info from
+        ClassInfoCache cache = new ClassInfoCache();
+        ClassInfoVisitor ciVisitor = new ClassInfoVisitor();
+        cr.accept(ciVisitor, ClassReader.SKIP_CODE | ClassReader.SKIP_FRAMES);
+        cache.getOrInitClassInfoMap(classLoader).put(s, ciVisitor.buildClassInfo());
+        // create FrameClassWriter using cache
 
-            cr.accept(new ClassInstrumenter(ASM5, cw, triggerClass, triggerMethod, triggerMethodSignature), 0);
+        ClassWriter cw = //new ClassWriter(COMPUTE_MAXS | COMPUTE_FRAMES);
+                new FrameClassWriter(classLoader, cache, V1_8);
 
-            byte[] result = cw.toByteArray();
+        cr.accept(new ClassInstrumenter(ASM5, cw, triggers, in_place), 0);
 
-            if (dump_class_files) {
-                File out_dir = new File("out");
-                out_dir.mkdir();
+        byte[] result = cw.toByteArray();
 
-                File out_file = new File("out/" + s + ".class");
-                new File(out_file.getParent()).mkdirs();
+        if (dump_class_files) {
+            File out_dir = new File("out");
+            out_dir.mkdir();
 
-                try {
-                    Files.write(out_file.toPath(), result);
-                } catch (IOException e) {
-                    e.printStackTrace();
+            File out_file = new File("out/" + s + ".class");
+            new File(out_file.getParent()).mkdirs();
+
+            try {
+                Files.write(out_file.toPath(), result);
+            } catch (IOException e) {
+                e.printStackTrace();
+                if (!in_place) {
                     System.exit(2);
                 }
             }
+        }
 
-            return result;
-        });
+        return result;
     }
 
     private static class MethodAdapter extends MethodVisitor {
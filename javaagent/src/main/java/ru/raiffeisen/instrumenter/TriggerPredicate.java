@@ -0,0 +1,272 @@
+package ru.raiffeisen.instrumenter;
+
+import org.objectweb.asm.Label;
+import org.objectweb.asm.MethodVisitor;
+import org.objectweb.asm.Opcodes;
+import org.objectweb.asm.Type;
+
+import java.util.Map;
+import java.util.regex.PatternSyntaxException;
+
+import ru.raiffeisen.PerfPtProf;
+
+/**
+ * A condition on the invocation that must hold for it to count down its
+ * trigger, compiled into the instrumented code ahead of the countdown:
+ * <pre>
+ *   arg0:com.acme.NewOrderSingle    argument 0 is an instance of the class
+ *   arg1>=1000                      numeric argument compared with a constant
+ *   arg2!=null                      reference argument is (not) null
+ *   this.venue==XLON                String field equals the value
+ *   this.qty>1000                   numeric field of the class, static or not
+ *   thread~md-.*                    current thread name matches the regex
+ * </pre>
+ * Comparisons are ==, !=, &lt;, &lt;=, &gt;, &gt;=; ':' is instanceof and '~'
+ * matches Strings against a regex. All predicates of a trigger must hold.
+ */
+class TriggerPredicate {
+    private static final String STRING = "Ljava/lang/String;";
+    // the constant of ==null and !=null
+    private static final Object NULL = new Object();
+
+    /** A field of the instrumented class, as seen by ClassInstrumenter. */
+    static class Field {
+        final String desc;
+        final boolean is_static;
+
+        Field(String desc, boolean is_static) {
+            this.desc = desc;
+            this.is_static = is_static;
+        }
+    }
+
+    private final String text;
+    private final String subject;
+    private final String op;
+    private final String value;
+    // index in PerfPtProf's patterns for '~'
+    private int pattern = -1;
+
+    private TriggerPredicate(String text, String subject, String op, String value) {
+        this.text = text;
+        this.subject = subject;
+        this.op = op;
+        this.value = value;
+    }
+
+    @Override
+    public String toString() {
+        return text;
+    }
+
+    public static TriggerPredicate parse(String text) {
+        int op_begin = 0;
+        while (op_begin < text.length() && ":~<>=!".indexOf(text.charAt(op_begin)) < 0) {
+            ++op_begin;
+        }
+        if (op_begin == 0 || op_begin == text.length()) {
+            return null;
+        }
+
+        String subject = text.substring(0, op_begin);
+        if (!subject.equals("thread")
+                && !subject.matches("arg\\d{1,3}")
+                && !(subject.startsWith("this.") && subject.length() > "this.".length())) {
+            return null;
+        }
+
+        String op = null;
+        for (String candidate : new String[] { "==", "!=", "<=", ">=", "<", ">", ":", "~" }) {
+            if (text.startsWith(candidate, op_begin)) {
+                op = candidate;
+                break;
+            }
+        }
+        if (op == null || op_begin + op.length() == text.length()) {
+            return null;
+        }
+
+        TriggerPredicate predicate = new TriggerPredicate(text, subject, op, text.substring(op_begin + op.length()));
+        if (op.equals("~")) {
+            try {
+                predicate.pattern = PerfPtProf.addPattern(predicate.value);
+            } catch (PatternSyntaxException e) {
+                return null;
+            }
+        }
+        return predicate;
+    }
+
+    /**
+     * Returns why the predicate can't be evaluated in method @desc of a class
+     * with @fields, null if it can.
+     */
+    public String check(int access, String desc, Map<String, Field> fields) {
+        String type = subject_type(access, desc, fields);
+        if (type == null) {
+            return "no " + subject + " in " + desc;
+        }
+        if (constant(type) == null) {
+            return "can't apply " + op + value + " to " + type;
+        }
+        return null;
+    }
+
+    /** Jumps to @fail unless the predicate holds, the stack is left as it was. */
+    public void emit(MethodVisitor mv, String class_name, int access, String desc, Map<String, Field> fields, Label fail) {
+        String type = subject_type(access, desc, fields);
+        Object constant = constant(type);
+
+        switch (op) {
+        case ":":
+            load_subject(mv, class_name, access, desc, fields);
+            mv.visitTypeInsn(Opcodes.INSTANCEOF, (String) constant);
+            mv.visitJumpInsn(Opcodes.IFEQ, fail);
+            return;
+        case "~":
+            mv.visitLdcInsn(pattern);
+            load_subject(mv, class_name, access, desc, fields);
+            mv.visitMethodInsn(Opcodes.INVOKESTATIC, "ru/raiffeisen/PerfPtProf", "matches", "(ILjava/lang/String;)Z", false);
+            mv.visitJumpInsn(Opcodes.IFEQ, fail);
+            return;
+        }
+
+        Type t = Type.getType(type);
+        if (t.getSort() == Type.OBJECT || t.getSort() == Type.ARRAY) {
+            if (constant == NULL) {
+                load_subject(mv, class_name, access, desc, fields);
+                mv.visitJumpInsn(op.equals("==") ? Opcodes.IFNONNULL : Opcodes.IFNULL, fail);
+            } else {
+                // the constant first, the subject may be null
+                mv.visitLdcInsn(constant);
+                load_subject(mv, class_name, access, desc, fields);
+                mv.visitMethodInsn(Opcodes.INVOKEVIRTUAL, "java/lang/String", "equals", "(Ljava/lang/Object;)Z", false);
+                mv.visitJumpInsn(op.equals("==") ? Opcodes.IFEQ : Opcodes.IFNE, fail);
+            }
+            return;
+        }
+
+        load_subject(mv, class_name, access, desc, fields);
+        mv.visitLdcInsn(constant);
+        int fail_if = fail_condition();
+        switch (t.getSort()) {
+        case Type.LONG:
+            mv.visitInsn(Opcodes.LCMP);
+            mv.visitJumpInsn(fail_if, fail);
+            break;
+        case Type.FLOAT:
+            // NaN fails every ordered comparison
+            mv.visitInsn(op.startsWith("<") ? Opcodes.FCMPG : Opcodes.FCMPL);
+            mv.visitJumpInsn(fail_if, fail);
+            break;
+        case Type.DOUBLE:
+            mv.visitInsn(op.startsWith("<") ? Opcodes.DCMPG : Opcodes.DCMPL);
+            mv.visitJumpInsn(fail_if, fail);
+            break;
+        default:
+            mv.visitJumpInsn(fail_if + (Opcodes.IF_ICMPEQ - Opcodes.IFEQ), fail);
+            break;
+        }
+    }
+
+    // what the subject is compared with, null if the comparison makes no sense
+    private Object constant(String type) {
+        switch (op) {
+        case ":":
+            return type.startsWith("L") || type.startsWith("[") ? value.replace('.', '/') : null;
+        case "~":
+            return type.equals(STRING) ? value : null;
+        }
+
+        Type t = Type.getType(type);
+        boolean equality = op.equals("==") || op.equals("!=");
+        try {
+            switch (t.getSort()) {
+            case Type.OBJECT:
+            case Type.ARRAY:
+                if (!equality) {
+                    return null;
+                }
+                if (value.equals("null")) {
+                    return NULL;
+                }
+                return type.equals(STRING) ? value : null;
+            case Type.BOOLEAN:
+                if (!equality || !(value.equals("true") || value.equals("false"))) {
+                    return null;
+                }
+                return value.equals("true") ? 1 : 0;
+            case Type.CHAR:
+            case Type.BYTE:
+            case Type.SHORT:
+            case Type.INT:
+                return Integer.valueOf(value);
+            case Type.LONG:
+                return Long.valueOf(value);
+            case Type.FLOAT:
+                return Float.valueOf(value);
+            case Type.DOUBLE:
+                return Double.valueOf(value);
+            default:
+                return null;
+            }
+        } catch (NumberFormatException e) {
+            return null;
+        }
+    }
+
+    // the IFxx that jumps when the comparison of (subject - constant) with 0 fails
+    private int fail_condition() {
+        switch (op) {
+        case "==": return Opcodes.IFNE;
+        case "!=": return Opcodes.IFEQ;
+        case "<":  return Opcodes.IFGE;
+        case "<=": return Opcodes.IFGT;
+        case ">":  return Opcodes.IFLE;
+        default:   return Opcodes.IFLT;
+        }
+    }
+
+    private String subject_type(int access, String desc, Map<String, Field> fields) {
+        if (subject.equals("thread")) {
+            return STRING;
+        }
+        if (subject.startsWith("this.")) {
+            Field field = fields.get(subject.substring("this.".length()));
+            if (field == null || (!field.is_static && (access & Opcodes.ACC_STATIC) != 0)) {
+                return null;
+            }
+            return field.desc;
+        }
+        Type[] args = Type.getArgumentTypes(desc);
+        int arg = Integer.parseInt(subject.substring("arg".length()));
+        return arg < args.length ? args[arg].getDescriptor() : null;
+    }
+
+    private void load_subject(MethodVisitor mv, String class_name, int access, String desc, Map<String, Field> fields) {
+        if (subject.equals("thread")) {
+            mv.visitMethodInsn(Opcodes.INVOKESTATIC, "java/lang/Thread", "currentThread", "()Ljava/lang/Thread;", false);
+            mv.visitMethodInsn(Opcodes.INVOKEVIRTUAL, "java/lang/Thread", "getName", "()Ljava/lang/String;", false);
+            return;
+        }
+        if (subject.startsWith("this.")) {
+            String name = subject.substring("this.".length());
+            Field field = fields.get(name);
+            if (field.is_static) {
+                mv.visitFieldInsn(Opcodes.GETSTATIC, class_name, name, field.desc);
+            } else {
+                mv.visitVarInsn(Opcodes.ALOAD, 0);
+                mv.visitFieldInsn(Opcodes.GETFIELD, class_name, name, field.desc);
+            }
+            return;
+        }
+
+        Type[] args = Type.getArgumentTypes(desc);
+        int arg = Integer.parseInt(subject.substring("arg".length()));
+        int slot = (access & Opcodes.ACC_STATIC) != 0 ? 0 : 1;
+        for (int i = 0; i < arg; ++i) {
+            slot += args[i].getSize();
+        }
+        mv.visitVarInsn(args[arg].getOpcode(Opcodes.ILOAD), slot);
+    }
+}
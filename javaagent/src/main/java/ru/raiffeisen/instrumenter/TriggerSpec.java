@@ -0,0 +1,201 @@
+package ru.raiffeisen.instrumenter;
+
+import java.io.IOException;
+import java.nio.file.Files;
+import java.nio.file.Paths;
+import java.util.ArrayList;
+import java.util.List;
+
+import ru.raiffeisen.PerfPtProf;
+
+/**
+ * A method whose invocations start and stop captures, each trigger with its own
+ * countdown and its own label on the reports.
+ *
+ * Triggers are read from the file named by -DTRIGGERS (or by the agent
+ * argument when attaching to a running JVM), one per line:
+ * <pre>
+ *   # label        class                      method      [descriptor]                  [countdown=N] [predicates]
+ *   order-entry    com/acme/OrderGateway      onNewOrder  (Lcom/acme/Order;)V           countdown=15000
+ *   market-data    com.acme.md.BookBuilder    apply                                     countdown=100000
+ *   risk           com/acme/RiskEngine        check                                     countdown=auto
+ *   fills          com/acme/FillHandler       onFill                                    poisson=10m max_cpu=0.5
+ *   nos            com/acme/OrderGateway      onMessage                                 countdown=500 arg0:com.acme.NewOrderSingle
+ * </pre>
+ * Without a descriptor every overload of the method is a trigger. With
+ * predicates (see TriggerPredicate) only invocations they hold for count
+ * down. countdown=auto captures once the method runs C2 code and the JIT
+ * has been quiet for a while, see PerfPtProf.addWarmupTrigger. A capture
+ * policy (every=, poisson=, reservoir=, captures=, max_cpu=, exit=, see
+ * profiler-policy.hpp) takes repeated captures instead of one, carry
+ * follows the captured work to other threads (PerfPtProf.carry). The
+ * TRIGGER_CLASS/TRIGGER_METHOD/TRIGGER_METHOD_SIGNATURE/TRIGGER_COUNTDOWN/
+ * TRIGGER_POLICY properties describe one more trigger, labelled
+ * Class.method.
+ */
+class TriggerSpec {
+    // the countdown of countdown=auto
+    public static final int AUTO = 0;
+    // keys of the capture policy, passed on to libperf.so as they are
+    private static final String[] POLICY_KEYS = { "every=", "poisson=", "reservoir=", "captures=", "max_cpu=", "exit=" };
+    private static final String[] POLICY_FLAGS = { "carry" };
+
+    public final int id;
+    public final String label;
+    public final String class_name;
+    public final String method_name;
+    public final String descriptor;
+    public final int countdown;
+    public final List<TriggerPredicate> predicates;
+    // null for one capture
+    public final String policy;
+
+    private TriggerSpec(int id, String label, String class_name, String method_name, String descriptor, int countdown,
+                        List<TriggerPredicate> predicates, String policy) {
+        this.id = id;
+        this.label = label;
+        this.class_name = class_name.replace('.', '/');
+        this.method_name = method_name;
+        this.descriptor = descriptor;
+        this.countdown = countdown;
+        this.predicates = predicates;
+        this.policy = policy;
+    }
+
+    public boolean matches(String class_name, String name, String desc) {
+        return this.class_name.equals(class_name)
+                && method_name.equals(name)
+                && (descriptor == null || descriptor.equals(desc));
+    }
+
+    public boolean warms_up() {
+        return countdown == AUTO;
+    }
+
+    @Override
+    public String toString() {
+        return label + ": " + class_name + "::" + method_name
+                + (descriptor != null ? descriptor : "") + ", countdown " + (warms_up() ? "auto" : countdown)
+                + (policy != null ? ", " + policy : "")
+                + (predicates.isEmpty() ? "" : ", when " + predicates);
+    }
+
+    public static List<TriggerSpec> load(String triggers_file) throws IOException {
+        List<TriggerSpec> triggers = new ArrayList<>();
+
+        if (triggers_file != null) {
+            int line_number = 0;
+            for (String line : Files.readAllLines(Paths.get(triggers_file))) {
+                ++line_number;
+                int comment = line.indexOf('#');
+                if (comment >= 0) {
+                    line = line.substring(0, comment);
+                }
+                line = line.trim();
+                if (line.isEmpty()) {
+                    continue;
+                }
+
+                if (triggers.size() == PerfPtProf.MAX_TRIGGERS) {
+                    System.out.println("Too many triggers in " + triggers_file + ", ignoring the rest");
+                    break;
+                }
+                TriggerSpec trigger = parse(triggers.size(), line);
+                if (trigger == null) {
+                    System.out.println("Bad trigger at " + triggers_file + ":" + line_number + ", skipping it: " + line);
+                    continue;
+                }
+                triggers.add(trigger);
+            }
+        }
+
+        String trigger_class = System.getProperty("TRIGGER_CLASS");
+        String trigger_method = System.getProperty("TRIGGER_METHOD");
+        if (trigger_class != null && trigger_method != null && triggers.size() < PerfPtProf.MAX_TRIGGERS) {
+            String countdown = System.getProperty("TRIGGER_COUNTDOWN");
+            triggers.add(new TriggerSpec(
+                    triggers.size(),
+                    trigger_class.replace('/', '.') + "." + trigger_method,
+                    trigger_class,
+                    trigger_method,
+                    System.getProperty("TRIGGER_METHOD_SIGNATURE"),
+                    countdown != null ? parse_countdown(countdown) : 1,
+                    new ArrayList<>(),
+                    System.getProperty("TRIGGER_POLICY")));
+        }
+        return triggers;
+    }
+
+    private static TriggerSpec parse(int id, String line) {
+        String[] fields = line.split("\\s+");
+        if (fields.length < 3) {
+            return null;
+        }
+
+        String descriptor = null;
+        int countdown = 1;
+        boolean countdown_given = false;
+        int every = 0;
+        StringBuilder policy = new StringBuilder();
+        List<TriggerPredicate> predicates = new ArrayList<>();
+        for (int i = 3; i < fields.length; ++i) {
+            if (fields[i].startsWith("countdown=")) {
+                try {
+                    countdown = parse_countdown(fields[i].substring("countdown=".length()));
+                    countdown_given = true;
+                } catch (NumberFormatException e) {
+                    return null;
+                }
+            } else if (is_policy(fields[i])) {
+                if (fields[i].startsWith("every=")) {
+                    try {
+                        every = parse_countdown(fields[i].substring("every=".length()));
+                    } catch (NumberFormatException e) {
+                        return null;
+                    }
+                }
+                // the rest is checked by libperf.so
+                policy.append(policy.length() > 0 ? " " : "").append(fields[i]);
+            } else if (fields[i].startsWith("(") && descriptor == null) {
+                descriptor = fields[i];
+            } else {
+                TriggerPredicate predicate = TriggerPredicate.parse(fields[i]);
+                if (predicate == null) {
+                    return null;
+                }
+                predicates.add(predicate);
+            }
+        }
+        if (every > 0 && !countdown_given) {
+            // every N-th, the first one included
+            countdown = every;
+        }
+        return new TriggerSpec(id, fields[0], fields[1], fields[2], descriptor, countdown, predicates,
+                               policy.length() > 0 ? policy.toString() : null);
+    }
+
+    private static boolean is_policy(String field) {
+        for (String key : POLICY_KEYS) {
+            if (field.startsWith(key)) {
+                return true;
+            }
+        }
+        for (String flag : POLICY_FLAGS) {
+            if (field.equals(flag)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    private static int parse_countdown(String countdown) {
+        if (countdown.equals("auto")) {
+            return AUTO;
+        }
+        int n = Integer.parseInt(countdown);
+        if (n < 1) {
+            throw new NumberFormatException("countdown must be positive: " + n);
+        }
+        return n;
+    }
+}
@@ -1592,12 +1592,36 @@ static struct option __record_options[] = {
 
 struct option *record_options = __record_options;
 
+/*
+ * rperf records once per capture in the same process, so every run starts
+ * from the defaults instead of what the previous one left behind.
+ */
+static void record__rearm(void)
+{
+	static struct record defaults;
+	static bool have_defaults;
+
+	if (!have_defaults) {
+		defaults = record;
+		have_defaults = true;
+	} else {
+		record = defaults;
+	}
+
+	done = 0;
+	signr = -1;
+	child_finished = 0;
+	auxtrace_record__snapshot_started = 0;
+}
+
 int cmd_record(int argc, const char **argv)
 {
 	int err;
 	struct record *rec = &record;
 	char errbuf[BUFSIZ];
 
+	record__rearm();
+
 #ifndef HAVE_LIBBPF_SUPPORT
 # define set_nobuild(s, l, c) set_option_nobuild(record_options, s, l, "NO_LIBBPF=1", c)
 	set_nobuild('\0', "clang-path", true);
@@ -1793,6 +1817,8 @@ out:
 	perf_evlist__delete(rec->evlist);
 	symbol__exit();
 	auxtrace_record__free(rec->itr);
+	/* the next capture waits for its own recording to start */
+	perf_event_aux_enabled = 0;
 	return err;
 }
 
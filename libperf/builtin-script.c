@@ -45,7 +45,7 @@
 #include "sane_ctype.h"
 
 #include "profiler.hpp"
-#include "profiler-backend.hpp"
+#include "rperf-decode.h"
 
 static char const		*script_name;
 static char const		*generate_script_lang;
@@ -1178,24 +1178,6 @@ static int perf_sample__fprintf_bts(struct perf_sample *sample,
 		printed += perf_sample__fprintf_addr(sample, thread, attr, fp);
 	}
 
-	{
-	    struct addr_location al;
-
-	    thread__resolve(thread, &al, sample);
-
-	    const char* sym_name = "unknown";
-	    const char* dso_name = "unknown";
-	    if (al.sym) {
-		if (al.sym->name) {
-		    sym_name = al.sym->name;
-		}
-	    }
-	    if (al.map && al.map->dso && al.map->dso->short_name) {
-		dso_name = al.map->dso->short_name;
-	    }
-	    visit_sample(sample->time, sym_name, dso_name);
-	}
-
 	if (print_srcline_last)
 		printed += map__fprintf_srcline(al->map, al->addr, "\n  ", fp);
 
@@ -1512,6 +1494,10 @@ static void process_event(struct perf_script *script,
 	struct perf_evsel_script *es = evsel->priv;
 	FILE *fp = es->fp;
 
+	/* phase markers count whether they are printed or not */
+	if (attr->type == PERF_TYPE_SYNTH)
+		rperf__visit_marker(script->session, sample, evsel, thread);
+
 	if (output[type].fields == 0)
 		return;
 
@@ -1536,6 +1522,7 @@ static void process_event(struct perf_script *script,
 
 	if (is_bts_event(attr)) {
 		perf_sample__fprintf_bts(sample, evsel, thread, al, machine, fp);
+		rperf__visit_branch(script->session, sample, thread, al);
 		return;
 	}
 
@@ -1956,8 +1943,11 @@ static int process_switch_event(struct perf_tool *tool,
 		return -1;
 	}
 
-	perf_sample__fprintf_start(sample, thread, evsel, stdout);
-	perf_event__fprintf(event, stdout);
+	rperf__visit_switch(session, event, sample, thread);
+	if (script->show_switch_events) {
+		perf_sample__fprintf_start(sample, thread, evsel, stdout);
+		perf_event__fprintf(event, stdout);
+	}
 	thread__put(thread);
 	return 0;
 }
@@ -2055,8 +2045,8 @@ static int __cmd_script(struct perf_script *script)
 		script->tool.mmap = process_mmap_event;
 		script->tool.mmap2 = process_mmap2_event;
 	}
-	if (script->show_switch_events)
-		script->tool.context_switch = process_switch_event;
+	/* carried captures need the switches even when they aren't shown */
+	script->tool.context_switch = process_switch_event;
 	if (script->show_namespace_events)
 		script->tool.namespaces = process_namespaces_event;
 
@@ -3323,21 +3313,13 @@ int cmd_script(int argc, const char **argv)
 		goto out_delete;
 	}
 
-	err = __cmd_script(&script);
+	err = rperf__report_begin(session);
+	if (err)
+		goto out_delete;
 
-	prepare_top();
+	err = __cmd_script(&script);
 
-	int top_len = get_top_len();
-	uint64_t total_ns = 0;
-	for (int i = 0; i < top_len; ++i) {
-	    const char* func = get_top_by_idx(i);
-	    uint64_t ns = get_counters_by_idx(i);
-	    total_ns += ns;
-	    int invoked = get_invoke_count_by_idx(i);
-	    printf("\t%d\t[%d]: %s\t->\t%'lluns\n", i+1, invoked, func, ns);
-	}
-	printf("Total for all functions: %'lldns\n", total_ns);
-	fflush(stdout);
+	rperf__report_end(session);
 
 	flush_scripting();
 
@@ -3347,6 +3329,8 @@ out_delete:
 
 	if (script_started)
 		cleanup_scripting();
+
+	rperf__report_free();
 out:
 	return err;
 }
@@ -0,0 +1,424 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "decoded-trace.hpp"
+
+namespace {
+    const char TRACE_MAGIC[8] = { 'R', 'P', 'D', 'T', 'R', 'C', '0', '1' };
+    const size_t TRAILER_SIZE = 2 * sizeof(uint64_t) + sizeof(TRACE_MAGIC);
+    const size_t OUTPUT_BUFFER_SIZE = 1 << 20;
+    // records between two indexed sync points
+    const int SYNC_INTERVAL = 4096;
+
+    // the low two bits of a record's first varint
+    enum record_type {
+	RECORD_BRANCH = 0,	/* time delta, function, offset */
+	RECORD_THREAD = 1,	/* time delta, pid, tid */
+	RECORD_SYNC = 2,	/* absolute time, pid, tid */
+    };
+
+    void put_varint(std::string& out, uint64_t value) {
+	while (value >= 0x80) {
+	    out += (char) (value | 0x80);
+	    value >>= 7;
+	}
+	out += (char) value;
+    }
+
+    void put_u64(std::string& out, uint64_t value) {
+	for (int i = 0; i < 8; ++i) {
+	    out += (char) (value >> (8 * i));
+	}
+    }
+
+    uint64_t get_u64(const unsigned char* p) {
+	uint64_t value = 0;
+	for (int i = 0; i < 8; ++i) {
+	    value |= (uint64_t) p[i] << (8 * i);
+	}
+	return value;
+    }
+
+    struct sync_point {
+	uint64_t time;
+	uint64_t offset;
+    };
+
+    struct trace_writer {
+	FILE* file = nullptr;
+	std::string buffer;
+	uint64_t flushed = 0;
+	int error = 0;
+
+	std::unordered_map<const void*, int> function_ids;
+	std::vector<std::string> function_names;
+	std::vector<sync_point> index;
+
+	uint64_t last_time = 0;
+	int pid = -1;
+	int tid = -1;
+	int since_sync = SYNC_INTERVAL;
+
+	uint64_t offset() const {
+	    return flushed + buffer.size();
+	}
+
+	void flush() {
+	    if (!buffer.empty() && fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size()) {
+		error = -EIO;
+	    }
+	    flushed += buffer.size();
+	    buffer.clear();
+	}
+
+	void maybe_flush() {
+	    if (buffer.size() >= OUTPUT_BUFFER_SIZE) {
+		flush();
+	    }
+	}
+
+	int function_id(const void* key, const char* symbol, const char* dso) {
+	    auto it = function_ids.find(key);
+	    if (it != std::end(function_ids)) {
+		return it->second;
+	    }
+	    int id = function_names.size();
+	    function_names.emplace_back(symbol);
+	    function_names.back() += "@";
+	    function_names.back() += dso;
+	    function_ids.emplace(key, id);
+	    return id;
+	}
+
+	void sync(uint64_t time, int pid_, int tid_) {
+	    // seeks binary search the index, out of order syncs are only decoded
+	    if (index.empty() || time >= index.back().time) {
+		index.push_back({ time, offset() });
+	    }
+	    put_varint(buffer, RECORD_SYNC);
+	    put_varint(buffer, time);
+	    put_varint(buffer, pid_);
+	    put_varint(buffer, tid_);
+	    last_time = time;
+	    pid = pid_;
+	    tid = tid_;
+	    since_sync = 0;
+	}
+
+	void branch(uint64_t time, int pid_, int tid_, int function, uint64_t offset_) {
+	    // out of order samples restart the deltas
+	    if (since_sync >= SYNC_INTERVAL || time < last_time) {
+		sync(time, pid_, tid_);
+	    } else if (pid_ != pid || tid_ != tid) {
+		put_varint(buffer, (time - last_time) << 2 | RECORD_THREAD);
+		put_varint(buffer, pid_);
+		put_varint(buffer, tid_);
+		last_time = time;
+		pid = pid_;
+		tid = tid_;
+	    }
+
+	    put_varint(buffer, (time - last_time) << 2 | RECORD_BRANCH);
+	    put_varint(buffer, function);
+	    put_varint(buffer, offset_);
+	    last_time = time;
+	    ++since_sync;
+	    maybe_flush();
+	}
+
+	int close() {
+	    uint64_t strings_offset = offset();
+	    put_varint(buffer, function_names.size());
+	    for (auto& name : function_names) {
+		put_varint(buffer, name.size());
+		buffer += name;
+		maybe_flush();
+	    }
+
+	    uint64_t index_offset = offset();
+	    put_varint(buffer, index.size());
+	    for (auto& point : index) {
+		put_varint(buffer, point.time);
+		put_varint(buffer, point.offset);
+		maybe_flush();
+	    }
+
+	    put_u64(buffer, strings_offset);
+	    put_u64(buffer, index_offset);
+	    buffer.append(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	    flush();
+
+	    if (fclose(file) && !error) {
+		error = -errno;
+	    }
+	    file = nullptr;
+	    return error;
+	}
+    };
+
+    trace_writer writer;
+
+    class varint_reader {
+	const unsigned char* pos;
+	const unsigned char* end;
+
+    public:
+	bool failed = false;
+
+	varint_reader(const unsigned char* pos_, const unsigned char* end_): pos(pos_), end(end_) {}
+
+	const unsigned char* position() const {
+	    return pos;
+	}
+
+	bool at_end() const {
+	    return pos >= end;
+	}
+
+	uint64_t varint() {
+	    uint64_t value = 0;
+	    for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+		unsigned char c = *pos++;
+		value |= (uint64_t) (c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+		    return value;
+		}
+	    }
+	    failed = true;
+	    pos = end;
+	    return 0;
+	}
+
+	std::string string() {
+	    uint64_t len = varint();
+	    if (len > (uint64_t) (end - pos)) {
+		failed = true;
+		pos = end;
+		return std::string();
+	    }
+	    pos += len;
+	    return std::string((const char*) pos - len, len);
+	}
+    };
+}
+
+struct decoded_trace {
+    const unsigned char* data;
+    size_t size;
+    const unsigned char* records_end;
+    std::vector<std::string> function_names;
+    std::vector<sync_point> index;
+
+    // cursor
+    const unsigned char* pos;
+    uint64_t time;
+    int pid;
+    int tid;
+
+    decoded_trace(): data(nullptr), size(0), records_end(nullptr), pos(nullptr), time(0), pid(-1), tid(-1) {}
+
+    ~decoded_trace() {
+	if (data) {
+	    munmap((void*) data, size);
+	}
+    }
+
+    bool load_tables() {
+	if (size < sizeof(TRACE_MAGIC) + TRAILER_SIZE ||
+	    memcmp(data, TRACE_MAGIC, sizeof(TRACE_MAGIC)) ||
+	    memcmp(data + size - sizeof(TRACE_MAGIC), TRACE_MAGIC, sizeof(TRACE_MAGIC))) {
+	    return false;
+	}
+
+	const unsigned char* trailer = data + size - TRAILER_SIZE;
+	uint64_t strings_offset = get_u64(trailer);
+	uint64_t index_offset = get_u64(trailer + sizeof(uint64_t));
+	if (strings_offset < sizeof(TRACE_MAGIC) || strings_offset > index_offset ||
+	    index_offset > size - TRAILER_SIZE) {
+	    return false;
+	}
+
+	varint_reader strings(data + strings_offset, data + index_offset);
+	for (uint64_t n = strings.varint(); n && !strings.failed; --n) {
+	    function_names.push_back(strings.string());
+	}
+
+	varint_reader points(data + index_offset, trailer);
+	for (uint64_t n = points.varint(); n && !points.failed; --n) {
+	    uint64_t point_time = points.varint();
+	    uint64_t point_offset = points.varint();
+	    if (index.empty() || point_time >= index.back().time) {
+		index.push_back({ point_time, point_offset });
+	    }
+	}
+
+	records_end = data + strings_offset;
+	pos = data + sizeof(TRACE_MAGIC);
+	return !strings.failed && !points.failed;
+    }
+
+    // decodes one record, returns true for branches
+    bool decode(varint_reader& in, decoded_branch* branch) {
+	uint64_t head = in.varint();
+	switch (head & 3) {
+	case RECORD_SYNC:
+	    time = in.varint();
+	    pid = in.varint();
+	    tid = in.varint();
+	    return false;
+	case RECORD_THREAD:
+	    time += head >> 2;
+	    pid = in.varint();
+	    tid = in.varint();
+	    return false;
+	case RECORD_BRANCH: {
+	    time += head >> 2;
+	    uint64_t function = in.varint();
+	    uint64_t offset = in.varint();
+	    if (function >= function_names.size()) {
+		in.failed = true;
+		return false;
+	    }
+	    branch->time = time;
+	    branch->pid = pid;
+	    branch->tid = tid;
+	    branch->function = function;
+	    branch->function_name = function_names[function].c_str();
+	    branch->offset = offset;
+	    return true;
+	}
+	default:
+	    in.failed = true;
+	    return false;
+	}
+    }
+};
+
+int decoded_trace_open(const char* path) {
+    writer = trace_writer();
+    writer.file = fopen(path, "w");
+    if (!writer.file) {
+	return -errno;
+    }
+    writer.buffer.reserve(OUTPUT_BUFFER_SIZE + 64);
+    writer.buffer.append(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    return 0;
+}
+
+void decoded_trace_write_branch(uint64_t time, int pid, int tid, const void* key, const char* symbol_name, const char* dso, uint64_t offset) {
+    if (!writer.file) {
+	return;
+    }
+    writer.branch(time, pid, tid, writer.function_id(key, symbol_name, dso), offset);
+}
+
+int decoded_trace_close() {
+    if (!writer.file) {
+	return 0;
+    }
+    return writer.close();
+}
+
+decoded_trace* decoded_trace_reader_open(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+	return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return nullptr;
+    }
+
+    auto trace = new decoded_trace();
+    trace->size = st.st_size;
+    void* map = trace->size ? mmap(nullptr, trace->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+	int err = trace->size ? errno : EINVAL;
+	delete trace;
+	errno = err;
+	return nullptr;
+    }
+    trace->data = (const unsigned char*) map;
+    madvise(map, trace->size, MADV_SEQUENTIAL);
+
+    if (!trace->load_tables()) {
+	delete trace;
+	errno = EINVAL;
+	return nullptr;
+    }
+    return trace;
+}
+
+void decoded_trace_reader_close(decoded_trace* trace) {
+    delete trace;
+}
+
+int decoded_trace_function_count(const decoded_trace* trace) {
+    return trace->function_names.size();
+}
+
+const char* decoded_trace_function_name(const decoded_trace* trace, int function) {
+    return trace->function_names[function].c_str();
+}
+
+void decoded_trace_seek(decoded_trace* trace, uint64_t time) {
+    // start from the last sync point before @time, every chunk begins with one
+    auto it = std::upper_bound(
+	std::begin(trace->index),
+	std::end(trace->index),
+	time,
+	[] (uint64_t t, const sync_point& point) {
+	    return t < point.time;
+	});
+    trace->pos = it == std::begin(trace->index) ? trace->data + sizeof(TRACE_MAGIC) : trace->data + (it - 1)->offset;
+
+    varint_reader in(trace->pos, trace->records_end);
+    decoded_branch branch;
+    while (!in.at_end()) {
+	auto record = in.position();
+	uint64_t record_time = trace->time;
+	int record_pid = trace->pid;
+	int record_tid = trace->tid;
+	if (trace->decode(in, &branch) && branch.time >= time) {
+	    // leave the branch for decoded_trace_next()
+	    trace->pos = record;
+	    trace->time = record_time;
+	    trace->pid = record_pid;
+	    trace->tid = record_tid;
+	    return;
+	}
+	if (in.failed) {
+	    break;
+	}
+    }
+    trace->pos = trace->records_end;
+}
+
+int decoded_trace_next(decoded_trace* trace, decoded_branch* branch) {
+    varint_reader in(trace->pos, trace->records_end);
+    while (!in.at_end()) {
+	bool is_branch = trace->decode(in, branch);
+	if (in.failed) {
+	    break;
+	}
+	if (is_branch) {
+	    trace->pos = in.position();
+	    return 1;
+	}
+    }
+    trace->pos = trace->records_end;
+    return 0;
+}
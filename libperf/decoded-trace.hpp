@@ -0,0 +1,53 @@
+#if !defined(__DECODED_TRACE_H__)
+#define __DECODED_TRACE_H__
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+#define __API__ extern "C"
+#else
+#define __API__
+#endif
+
+/*
+ * Compact binary form of the decoded branch stream, so later analyses do
+ * not have to run the PT decoder again.
+ *
+ * Records are varint encoded: the time as a delta to the previous record,
+ * the branch target as a function id plus the offset into that function.
+ * A sync record with absolute time and thread is emitted every few thousand
+ * records and indexed, so readers can seek to any timestamp. The function
+ * name table and the time index are written at the end of the file.
+ */
+
+struct decoded_branch {
+    uint64_t time;
+    int pid;
+    int tid;
+    int function;		/* index into the function name table */
+    const char* function_name;	/* "symbol@dso", valid while the reader is open */
+    uint64_t offset;		/* target address relative to the function start */
+};
+
+/* Writer, there is one per process. Return 0 or a negative errno. */
+__API__ int decoded_trace_open(const char* path);
+/* @key identifies the function as in visit_sample(); names are read once per key. */
+__API__ void decoded_trace_write_branch(uint64_t time, int pid, int tid, const void* key,
+					const char* symbol_name, const char* dso, uint64_t offset);
+__API__ int decoded_trace_close(void);
+
+struct decoded_trace;
+
+/* Maps @path, returns NULL and sets errno on failure. */
+__API__ struct decoded_trace* decoded_trace_reader_open(const char* path);
+__API__ void decoded_trace_reader_close(struct decoded_trace* trace);
+
+__API__ int decoded_trace_function_count(const struct decoded_trace* trace);
+__API__ const char* decoded_trace_function_name(const struct decoded_trace* trace, int function);
+
+/* Positions the reader at the first branch at or after @time. */
+__API__ void decoded_trace_seek(struct decoded_trace* trace, uint64_t time);
+/* Returns 1 and fills @branch, 0 at the end of the trace. */
+__API__ int decoded_trace_next(struct decoded_trace* trace, struct decoded_branch* branch);
+
+#endif // !defined(__DECODED_TRACE_H__)
@@ -1,5 +1,366 @@
 #include "jit-methods.hpp"
 
-int foo() {
+#include <atomic>
+#include <thread>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
 
+extern "C" uint64_t rdtsc(void); // from arch/x86/util/tsc.c
+
+namespace {
+    const uint64_t TSC_INFINITY = UINT64_MAX;
+    const int MAX_READERS = 8;
+    const int EVENT_SHARDS = 16;
+    // writers fold pending events into the index once this many are queued
+    const int APPLY_THRESHOLD = 4096;
+
+    struct jit_code_blob {
+	const void* method;
+	int kind;
+	uint64_t start_addr;
+	uint64_t length;
+	uint64_t load_tsc;
+	uint64_t unload_tsc;
+	std::string name;
+	// compilation of the method this blob is, 0 for code that isn't a method's
+	int version;
+
+	jit_code_blob(const void* method_, int kind_, const char* name_, uint64_t addr, uint64_t len, uint64_t tsc):
+	    method(method_), kind(kind_), start_addr(addr), length(len), load_tsc(tsc), unload_tsc(TSC_INFINITY), name(name_),
+	    version(0) {}
+
+	bool is_live() const {
+	    return unload_tsc == TSC_INFINITY;
+	}
+
+	bool valid_at(uint64_t tsc) const {
+	    return tsc >= load_tsc && tsc < unload_tsc;
+	}
+
+	void fill(jit_code_info* info) const {
+	    info->id = method ? method : this;
+	    info->name = name.c_str();
+	    info->start_addr = start_addr;
+	    info->length = length;
+	    info->load_tsc = load_tsc;
+	    info->unload_tsc = unload_tsc;
+	    info->kind = kind;
+	}
+    };
+
+    /*
+     * Load/unload notification as queued by a JVMTI callback. Callbacks come
+     * from several compiler threads at once, so they never touch the index
+     * directly: they push onto a lock-free per-shard stack and whoever owns
+     * the index folds the stacks in TSC order.
+     */
+    struct jit_code_event {
+	enum op_t { LOAD, UNLOAD };
+
+	op_t op;
+	const void* method;
+	int kind;
+	uint64_t addr;
+	uint64_t length;
+	uint64_t tsc;
+	std::string name;
+	jit_code_event* next;
+
+	jit_code_event(op_t op_, const void* method_, int kind_, const char* name_, uint64_t addr_, uint64_t len, uint64_t tsc_):
+	    op(op_), method(method_), kind(kind_), addr(addr_), length(len), tsc(tsc_), name(name_ ? name_ : ""), next(nullptr) {}
+    };
+
+    struct alignas(64) event_shard {
+	std::atomic<jit_code_event*> head;
+    };
+
+    event_shard shards[EVENT_SHARDS];
+    std::atomic<int> pending_events(0);
+    std::atomic<int> next_shard(0);
+
+    // set while a reader or an applying writer owns the index below
+    std::atomic<bool> index_owned(false);
+
+    struct jit_sideband_event {
+	uint64_t tsc;
+	int kind;
+	int version;
+	uint64_t addr;
+	std::string name;
+
+	jit_sideband_event(uint64_t tsc_, int kind_, int version_, uint64_t addr_, const std::string& name_):
+	    tsc(tsc_), kind(kind_), version(version_), addr(addr_), name(name_) {}
+    };
+
+    typedef std::multimap<uint64_t, jit_code_blob*> blobs_t;
+
+    // every known version of every blob, keyed by start address
+    blobs_t blobs;
+    // the longest blob ever seen bounds the backward walk in lookups
+    uint64_t max_blob_length = 0;
+    // unloaded blobs in unload order, waiting for reclamation
+    std::vector<blobs_t::iterator> retired;
+    /*
+     * Compilations seen per jmethodID and how many of them are loaded. A
+     * method is forgotten once none are, so a method that is compiled again
+     * after all of its code was thrown away starts over at version 1.
+     */
+    struct method_history {
+	int versions = 0;
+	int live = 0;
+    };
+    std::map<const void*, method_history> method_versions;
+    std::vector<jit_sideband_event> sideband;
+
+    // 0 means the slot is free
+    std::atomic<uint64_t> reader_epochs[MAX_READERS];
+
+    // visits blobs intersecting [begin, end) from the highest start address down
+    template <typename F>
+    void for_each_overlapping(uint64_t begin, uint64_t end, F f) {
+	auto it = blobs.lower_bound(end);
+	while (it != std::begin(blobs)) {
+	    --it;
+	    if (it->first + max_blob_length <= begin) {
+		break;
+	    }
+	    if (it->first + it->second->length > begin) {
+		if (!f(it)) {
+		    break;
+		}
+	    }
+	}
+    }
+
+    uint64_t oldest_pinned_epoch() {
+	uint64_t watermark = TSC_INFINITY;
+	for (auto& epoch : reader_epochs) {
+	    uint64_t e = epoch.load(std::memory_order_acquire);
+	    if (e && e < watermark) {
+		watermark = e;
+	    }
+	}
+	return watermark;
+    }
+
+    void reclaim() {
+	uint64_t watermark = oldest_pinned_epoch();
+
+	auto keep = std::stable_partition(
+	    std::begin(retired),
+	    std::end(retired),
+	    [watermark] (const blobs_t::iterator& it) {
+		return it->second->unload_tsc >= watermark;
+	    });
+	for (auto it = keep; it != std::end(retired); ++it) {
+	    delete (*it)->second;
+	    blobs.erase(*it);
+	}
+	retired.erase(keep, std::end(retired));
+
+	sideband.erase(
+	    std::remove_if(
+		std::begin(sideband),
+		std::end(sideband),
+		[watermark] (const jit_sideband_event& ev) {
+		    return ev.tsc < watermark;
+		}),
+	    std::end(sideband));
+    }
+
+    void retire(blobs_t::iterator it, uint64_t tsc) {
+	jit_code_blob* blob = it->second;
+	blob->unload_tsc = std::max(tsc, blob->load_tsc);
+	retired.push_back(it);
+
+	if (blob->version) {
+	    auto history = method_versions.find(blob->method);
+	    if (history != std::end(method_versions) && --history->second.live == 0) {
+		method_versions.erase(history);
+	    }
+	}
+    }
+
+    void apply_load(const void* method, int kind, std::string& name, uint64_t addr, uint64_t len, uint64_t tsc) {
+	// the code cache never hands out live memory twice, so anything still
+	// registered over this range missed its unload event
+	std::vector<blobs_t::iterator> stale;
+	for_each_overlapping(addr, addr + len, [&stale] (blobs_t::iterator it) {
+		if (it->second->is_live()) {
+		    stale.push_back(it);
+		}
+		return true;
+	    });
+	for (auto it : stale) {
+	    retire(it, tsc);
+	}
+
+	auto blob = new jit_code_blob(method, kind, "", addr, len, tsc);
+	blob->name.swap(name);
+	blobs.emplace(addr, blob);
+	max_blob_length = std::max(max_blob_length, len);
+
+	if (kind == JIT_CODE_COMPILED && method) {
+	    method_history& history = method_versions[method];
+	    blob->version = ++history.versions;
+	    ++history.live;
+	    sideband.emplace_back(tsc, blob->version > 1 ? JIT_EVENT_RECOMPILE : JIT_EVENT_LOAD, blob->version, addr, blob->name);
+	}
+    }
+
+    void apply_unload(uint64_t addr, uint64_t tsc) {
+	auto range = blobs.equal_range(addr);
+	for (auto it = range.first; it != range.second; ++it) {
+	    if (it->second->is_live()) {
+		retire(it, tsc);
+		if (it->second->kind == JIT_CODE_COMPILED) {
+		    sideband.emplace_back(tsc, JIT_EVENT_UNLOAD, it->second->version, addr, it->second->name);
+		}
+	    }
+	}
+    }
+
+    void push_event(jit_code_event* ev) {
+	thread_local int shard_idx = next_shard.fetch_add(1, std::memory_order_relaxed) % EVENT_SHARDS;
+	auto& head = shards[shard_idx].head;
+
+	ev->next = head.load(std::memory_order_relaxed);
+	while (!head.compare_exchange_weak(ev->next, ev, std::memory_order_release, std::memory_order_relaxed)) ;
+    }
+
+    // must be called by the index owner
+    void apply_pending_events() {
+	std::vector<jit_code_event*> events;
+	for (auto& shard : shards) {
+	    auto ev = shard.head.exchange(nullptr, std::memory_order_acquire);
+	    while (ev) {
+		events.push_back(ev);
+		ev = ev->next;
+	    }
+	}
+	if (events.empty()) {
+	    return;
+	}
+	pending_events.fetch_sub(events.size(), std::memory_order_relaxed);
+
+	// stacks are LIFO and shards interleave, TSC restores the real order
+	std::stable_sort(
+	    std::begin(events),
+	    std::end(events),
+	    [] (const jit_code_event* e1, const jit_code_event* e2) {
+		return e1->tsc < e2->tsc;
+	    });
+
+	for (auto ev : events) {
+	    if (ev->op == jit_code_event::LOAD) {
+		apply_load(ev->method, ev->kind, ev->name, ev->addr, ev->length, ev->tsc);
+	    } else {
+		apply_unload(ev->addr, ev->tsc);
+	    }
+	    delete ev;
+	}
+	reclaim();
+    }
+
+    // writers never wait: if a reader holds the index, events just stay queued
+    void try_apply_from_writer() {
+	if (pending_events.fetch_add(1, std::memory_order_relaxed) + 1 < APPLY_THRESHOLD) {
+	    return;
+	}
+	if (!index_owned.exchange(true, std::memory_order_acquire)) {
+	    apply_pending_events();
+	    index_owned.store(false, std::memory_order_release);
+	}
+    }
+}
+
+uint64_t jit_registry_now() {
+    return rdtsc();
+}
+
+void jit_registry_load(const void* method, int kind, const char* name, uint64_t addr, uint64_t len, uint64_t tsc) {
+    push_event(new jit_code_event(jit_code_event::LOAD, method, kind, name, addr, len, tsc));
+    try_apply_from_writer();
+}
+
+void jit_registry_unload(uint64_t addr, uint64_t tsc) {
+    push_event(new jit_code_event(jit_code_event::UNLOAD, nullptr, 0, nullptr, addr, 0, tsc));
+    try_apply_from_writer();
+}
+
+void jit_registry_begin_read() {
+    // the only contender is a writer folding the queue; readers own the index
+    // for a whole decode, so writers fold in between to keep the queue bounded
+    while (index_owned.exchange(true, std::memory_order_acquire)) {
+	std::this_thread::yield();
+    }
+    apply_pending_events();
+}
+
+void jit_registry_end_read() {
+    index_owned.store(false, std::memory_order_release);
+}
+
+int jit_registry_lookup(uint64_t addr, uint64_t tsc, jit_code_info* info) {
+    const jit_code_blob* found = nullptr;
+    for_each_overlapping(addr, addr + 1, [tsc, &found] (blobs_t::iterator it) {
+	    if (it->second->valid_at(tsc)) {
+		found = it->second;
+		return false;
+	    }
+	    return true;
+	});
+
+    if (found) {
+	found->fill(info);
+	return 1;
+    }
+    return 0;
+}
+
+void jit_registry_for_each_live(void (*cb)(const jit_code_info* info, void* data), void* data) {
+    for (auto& entry : blobs) {
+	if (entry.second->is_live()) {
+	    jit_code_info info;
+	    entry.second->fill(&info);
+	    cb(&info, data);
+	}
+    }
+}
+
+void jit_registry_for_each_event(uint64_t from_tsc, uint64_t to_tsc, void (*cb)(const jit_event* event, void* data), void* data) {
+    // writers batch events, so the stream is only ordered within a batch
+    std::stable_sort(
+	std::begin(sideband),
+	std::end(sideband),
+	[] (const jit_sideband_event& e1, const jit_sideband_event& e2) {
+	    return e1.tsc < e2.tsc;
+	});
+
+    for (auto& ev : sideband) {
+	if (ev.tsc < from_tsc || ev.tsc >= to_tsc) {
+	    continue;
+	}
+	jit_event event = { ev.tsc, ev.kind, ev.version, ev.addr, ev.name.c_str() };
+	cb(&event, data);
+    }
+}
+
+int jit_registry_pin(uint64_t tsc) {
+    tsc = std::max<uint64_t>(tsc, 1);
+    for (int slot = 0; slot < MAX_READERS; ++slot) {
+	uint64_t expected = 0;
+	if (reader_epochs[slot].compare_exchange_strong(expected, tsc, std::memory_order_acq_rel)) {
+	    return slot;
+	}
+    }
+    return JIT_REGISTRY_NO_SLOT;
+}
+
+void jit_registry_unpin(int slot) {
+    if (slot >= 0 && slot < MAX_READERS) {
+	reader_epochs[slot].store(0, std::memory_order_release);
+    }
 }
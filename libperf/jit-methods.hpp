@@ -1,11 +1,100 @@
 #if !defined(__JIT_METHODS_H__)
 #define __JIT_METHODS_H__
 
+#include <stdint.h>
+
 #if defined(__cplusplus)
 #define __API__ extern "C"
 #else
 #define __API__
 #endif
 
+/*
+ * Time-versioned registry of JVM code blobs.
+ *
+ * Every blob reported by the JVMTI agent is kept together with the TSC
+ * interval [load_tsc, unload_tsc) it was valid for, so an address taken from
+ * the trace resolves to the method that occupied it at that moment even if
+ * the code was recompiled or swept later.
+ *
+ * Unloaded blobs are reclaimed once no reader has pinned an epoch (a TSC low
+ * watermark) that is older than their unload time.
+ *
+ * Load/unload may be called from any thread and never block. Lookups and
+ * iteration are only allowed between jit_registry_begin_read() and
+ * jit_registry_end_read(); inside that section they take no locks and
+ * execute no atomic read-modify-write operations. Entering the section is
+ * not wait-free: a writer may be folding the queued events into the index,
+ * and the reader waits for it to finish.
+ */
+
+enum jit_code_kind {
+    JIT_CODE_NONE     = -1,	/* not JVM-generated code */
+    JIT_CODE_COMPILED = 0,	/* CompiledMethodLoad */
+    JIT_CODE_DYNAMIC  = 1,	/* DynamicCodeGenerated: interpreter, stubs, adapters */
+};
+
+struct jit_code_info {
+    /* stable identity: the jmethodID for compiled code, the blob otherwise */
+    const void* id;
+    const char* name;
+    uint64_t start_addr;
+    uint64_t length;
+    uint64_t load_tsc;
+    uint64_t unload_tsc;
+    int kind;
+};
+
+/*
+ * Side-band stream of code cache changes. Only events newer than the oldest
+ * pinned epoch are kept.
+ */
+enum jit_event_kind {
+    JIT_EVENT_LOAD,		/* first compilation of a method */
+    JIT_EVENT_RECOMPILE,	/* another version of an already compiled method */
+    JIT_EVENT_UNLOAD,
+};
+
+struct jit_event {
+    uint64_t tsc;
+    int kind;
+    int version;		/* 1 for the first compilation of the method */
+    uint64_t addr;
+    const char* name;
+};
+
+#define JIT_REGISTRY_NO_SLOT (-1)
+
+__API__ uint64_t jit_registry_now(void);
+
+__API__ void jit_registry_load(const void* method, int kind, const char* name,
+			       uint64_t addr, uint64_t len, uint64_t tsc);
+__API__ void jit_registry_unload(uint64_t addr, uint64_t tsc);
+
+/*
+ * Takes exclusive ownership of the index and folds in queued events. Spins
+ * while a writer folds a batch, the events queued since the last fold.
+ */
+__API__ void jit_registry_begin_read(void);
+__API__ void jit_registry_end_read(void);
+
+/* Returns 1 and fills @info if @addr was covered by a blob at @tsc. */
+__API__ int jit_registry_lookup(uint64_t addr, uint64_t tsc, struct jit_code_info* info);
+
+/* Iterates blobs that are still loaded. */
+__API__ void jit_registry_for_each_live(void (*cb)(const struct jit_code_info* info, void* data),
+					void* data);
+
+/* Iterates side-band events with from_tsc <= tsc < to_tsc in TSC order. */
+__API__ void jit_registry_for_each_event(uint64_t from_tsc, uint64_t to_tsc,
+					 void (*cb)(const struct jit_event* event, void* data),
+					 void* data);
+
+/*
+ * Readers pin the oldest TSC they are going to query. Names returned by
+ * jit_registry_lookup() stay valid until the slot is unpinned.
+ */
+__API__ int jit_registry_pin(uint64_t tsc);
+__API__ void jit_registry_unpin(int slot);
 
-#endif __JIT_METHODS_H__
+#endif // !defined(__JIT_METHODS_H__)
@@ -1,32 +1,194 @@
 #include "profiler.hpp"
+#include "profiler-markers.hpp"
+#include "profiler-carry.hpp"
+#include "profiler-warmup.hpp"
 #include "ru_raiffeisen_PerfPtProf.h"
 
+extern "C" void quiesce_jvmti_agent(); // from jvmti-agent.cpp
+
+/*
+ * Class:     ru_raiffeisen_PerfPtProf
+ * Method:    registerTrigger
+ * Signature: (ILjava/lang/String;ILjava/lang/String;)V
+ */
+JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_registerTrigger
+(JNIEnv* env, jclass, jint id, jstring label, jint countdown, jstring policy) {
+    const char* label_chars = env->GetStringUTFChars(label, nullptr);
+    if (!label_chars) {
+	return;
+    }
+    const char* policy_chars = policy ? env->GetStringUTFChars(policy, nullptr) : nullptr;
+    if (!policy || policy_chars) {
+	// the countdown runs in the instrumented code, start() is only called when it's over
+	add_trigger(id, label_chars, countdown, policy_chars);
+    }
+    if (policy_chars) {
+	env->ReleaseStringUTFChars(policy, policy_chars);
+    }
+    env->ReleaseStringUTFChars(label, label_chars);
+}
+
 /*
  * Class:     ru_raiffeisen_PerfPtProf
- * Method:    init
- * Signature: (I)V
+ * Method:    watchWarmup
+ * Signature: (ILjava/lang/String;Ljava/lang/String;Ljava/lang/String;)V
  */
-JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_init
-(JNIEnv *, jclass, jint countdown) {
-    init(countdown);
+JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_watchWarmup
+(JNIEnv* env, jclass, jint id, jstring class_name, jstring method, jstring desc) {
+    const char* class_chars = env->GetStringUTFChars(class_name, nullptr);
+    const char* method_chars = class_chars ? env->GetStringUTFChars(method, nullptr) : nullptr;
+    const char* desc_chars = method_chars && desc ? env->GetStringUTFChars(desc, nullptr) : nullptr;
+    if (method_chars && (desc_chars || !desc)) {
+	watch_warmup(id, class_chars, method_chars, desc_chars);
+    }
+    if (desc_chars) {
+	env->ReleaseStringUTFChars(desc, desc_chars);
+    }
+    if (method_chars) {
+	env->ReleaseStringUTFChars(method, method_chars);
+    }
+    if (class_chars) {
+	env->ReleaseStringUTFChars(class_name, class_chars);
+    }
 }
 
+// what start() and stop() return to Java besides a countdown, see PerfPtProf.java
+static const jint STARTED = -1;
+static const jint NOT_STOPPED = -1;
+
 /*
  * Class:     ru_raiffeisen_PerfPtProf
  * Method:    start
+ * Signature: (I)I
+ */
+JNIEXPORT jint JNICALL Java_ru_raiffeisen_PerfPtProf_start
+(JNIEnv *, jclass, jint id) {
+    int countdown = 0;
+    int started = start(id, &countdown);
+    return started > 0 ? STARTED : started < 0 ? 0 : countdown;
+}
+
+/*
+ * Class:     ru_raiffeisen_PerfPtProf
+ * Method:    stop
+ * Signature: (I)I
+ */
+JNIEXPORT jint JNICALL Java_ru_raiffeisen_PerfPtProf_stop
+(JNIEnv *, jclass, jint id) {
+    int countdown = 0;
+    return stop(id, &countdown) ? countdown : NOT_STOPPED;
+}
+
+/*
+ * Class:     ru_raiffeisen_PerfPtProf
+ * Method:    stopThrown
+ * Signature: (ILjava/lang/String;)I
+ */
+JNIEXPORT jint JNICALL Java_ru_raiffeisen_PerfPtProf_stopThrown
+(JNIEnv* env, jclass, jint id, jstring exception) {
+    const char* exception_chars = env->GetStringUTFChars(exception, nullptr);
+    int countdown = 0;
+    jint stopped = stop_thrown(id, exception_chars, &countdown) ? countdown : NOT_STOPPED;
+    if (exception_chars) {
+	env->ReleaseStringUTFChars(exception, exception_chars);
+    }
+    return stopped;
+}
+
+/*
+ * Class:     ru_raiffeisen_PerfPtProf
+ * Method:    awaitCaptures
  * Signature: ()V
  */
-JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_start
+JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_awaitCaptures
 (JNIEnv *, jclass) {
-    start();
+    await_captures();
 }
 
 /*
  * Class:     ru_raiffeisen_PerfPtProf
- * Method:    stop
+ * Method:    detach
  * Signature: ()V
  */
-JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_stop
+JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_detach
+(JNIEnv *, jclass) {
+    detach_triggers();
+    quiesce_jvmti_agent();
+}
+
+/*
+ * Class:     ru_raiffeisen_PerfPtProf
+ * Method:    mark
+ * Signature: (J)V
+ */
+JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_mark
+(JNIEnv *, jclass, jlong id) {
+    mark(id);
+}
+
+// HotSpot calls this one from compiled code without the JNI transition
+// (-XX:+UnlockDiagnosticVMOptions -XX:+CriticalJNINatives, JDK 8-15)
+extern "C" JNIEXPORT void JNICALL JavaCritical_ru_raiffeisen_PerfPtProf_mark
+(jlong id) {
+    mark(id);
+}
+
+/*
+ * Class:     ru_raiffeisen_PerfPtProf
+ * Method:    nameMarker
+ * Signature: (JLjava/lang/String;)V
+ */
+JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_nameMarker
+(JNIEnv* env, jclass, jlong id, jstring name) {
+    const char* name_chars = env->GetStringUTFChars(name, nullptr);
+    if (!name_chars) {
+	return;
+    }
+    name_marker(id, name_chars);
+    env->ReleaseStringUTFChars(name, name_chars);
+}
+
+/*
+ * Class:     ru_raiffeisen_PerfPtProf
+ * Method:    carry
+ * Signature: ()J
+ */
+JNIEXPORT jlong JNICALL Java_ru_raiffeisen_PerfPtProf_carry
 (JNIEnv *, jclass) {
-    stop();
+    return carry_token();
+}
+
+extern "C" JNIEXPORT jlong JNICALL JavaCritical_ru_raiffeisen_PerfPtProf_carry
+() {
+    return carry_token();
+}
+
+/*
+ * Class:     ru_raiffeisen_PerfPtProf
+ * Method:    join
+ * Signature: (J)V
+ */
+JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_join
+(JNIEnv *, jclass, jlong token) {
+    carry_join(token);
+}
+
+extern "C" JNIEXPORT void JNICALL JavaCritical_ru_raiffeisen_PerfPtProf_join
+(jlong token) {
+    carry_join(token);
+}
+
+/*
+ * Class:     ru_raiffeisen_PerfPtProf
+ * Method:    leave
+ * Signature: (J)V
+ */
+JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_leave
+(JNIEnv *, jclass, jlong token) {
+    carry_leave(token);
+}
+
+extern "C" JNIEXPORT void JNICALL JavaCritical_ru_raiffeisen_PerfPtProf_leave
+(jlong token) {
+    carry_leave(token);
 }
@@ -21,6 +21,10 @@
  */
 
 #include "perf-map-file.hpp"
+#include "jit-methods.hpp"
+#include "profiler-options.hpp"
+#include "profiler.hpp"
+#include "profiler-warmup.hpp"
 
 #include <stdbool.h>
 #include <stdio.h>
@@ -46,102 +50,18 @@ FILE *method_file = NULL;
 void open_map_file();
 void close_map_file();
 
-struct compiled_method_info {
-    size_t start_addr;
-    size_t length;
-    std::string name;
-
-    compiled_method_info(std::string name_, size_t addr, size_t len): start_addr(addr), length(len), name(name_) { }
-};
-
-bool operator < (const compiled_method_info& m1, const compiled_method_info& m2) {
-    return m1.start_addr < m2.start_addr;
-}
-
-bool operator == (const compiled_method_info& m1, const compiled_method_info& m2) {
-    return m1.start_addr == m2.start_addr;
-}
-
-std::ostream& operator << (std::ostream& os, const compiled_method_info& m) {
-    return os << m.name << "@" << std::hex << m.start_addr << " for " << m.length << "bytes";
-}
-
-struct jit_compiled_method {
-    typedef std::set<compiled_method_info> inner_methods_t;
-
-    inner_methods_t inner_methods;
-
-    jmethodID method_id;
-
-    jit_compiled_method(): method_id(0) {}
-
-    jit_compiled_method(jmethodID method): method_id(method) {}
-
-    typename inner_methods_t::const_iterator begin_inner() const {
-	return std::begin(inner_methods);
-    }
-
-    typename inner_methods_t::const_iterator end_inner() const {
-	return std::end(inner_methods);
-    }
-
-    inner_methods_t::reference front() {
-	return const_cast<inner_methods_t::reference>(*inner_methods.begin());
-    }
-
-    void add_inner_info(std::string&& name, size_t addr, size_t len) {
-	inner_methods.emplace(name, addr, len);
-    }
-};
-
-bool operator < (const jit_compiled_method& m1, const jit_compiled_method& m2) {
-    return m1.method_id < m2.method_id;
-}
-
-namespace {
-    std::map<jmethodID, jit_compiled_method> methods;
-}
-
-jit_compiled_method& get_jit_info(jmethodID method) {
-    auto it = methods.find(method);
-    //return const_cast<jit_compiled_method&>(*it);
-    if (it != methods.end()) {
-	return it->second;
-    } else {
-	//jit_compiled_method jit_record(method);
-	auto& res = methods[method];
-	res.method_id = method;
-	return res;
-    }
-}
-
-void remove_jit_info(jmethodID m) {
-    auto it = methods.find(m);
-    if (it != std::end(methods)) {
-	methods.erase(it);
-    }
+static void write_live_blob(const jit_code_info* info, void* data) {
+    int* total_symbols = static_cast<int*>(data);
+    *total_symbols += 1;
+    perf_map_write_entry(method_file, (const void*)info->start_addr, info->length, info->name);
 }
 
+// must be called between jit_registry_begin_read() and jit_registry_end_read()
 extern "C" void dump_perf_file() {
     open_map_file();
 
     int total_symbols = 0;
-    auto it = methods.begin(), it_end = methods.end();
-    while (it != it_end) {
-	auto& jit_record = it->second;
-	auto item_it = jit_record.begin_inner(), item_end = jit_record.end_inner();
-	while (item_it != item_end) {
-	    //std::cout << *item_it << std::endl;
-	    total_symbols += 1;
-	    //perf_map_write_entry(method_file, code_addr, code_size, entry);
-	    
-	    perf_map_write_entry(method_file, (const void*)item_it->start_addr, item_it->length, item_it->name.c_str());
-
-	    ++item_it;
-	}
-
-	++it;
-    }
+    jit_registry_for_each_live(&write_live_blob, &total_symbols);
 
     std::cout << "Processed: " << total_symbols << " symbols" << std::endl;
     
@@ -393,6 +313,24 @@ void generate_unfolded_entries(
         generate_single_entry(jvmti, root_method, code_addr, code_size);
 }
 
+// the names to tell the trigger methods by, whatever the map file options are
+static void report_warmup_compile(jvmtiEnv *jvmti, jmethodID method) {
+    char *method_name = NULL;
+    char *msig = NULL;
+    char *csig = NULL;
+    jclass clazz;
+
+    if (!jvmti->GetMethodName(method, &method_name, &msig, NULL)) {
+        if (!jvmti->GetMethodDeclaringClass(method, &clazz) &&
+            !jvmti->GetClassSignature(clazz, &csig, NULL)) {
+            warmup_compiled(csig, method_name, msig);
+            jvmti->Deallocate((unsigned char *)csig);
+        }
+        jvmti->Deallocate((unsigned char *)method_name);
+        jvmti->Deallocate((unsigned char *)msig);
+    }
+}
+
 static void JNICALL
 cbCompiledMethodLoad(
             jvmtiEnv *jvmti,
@@ -409,13 +347,14 @@ cbCompiledMethodLoad(
         generate_single_entry(jvmti, method, code_addr, code_size);
     */
 
+    uint64_t tsc = jit_registry_now();
+    if (warmup_watching()) {
+        report_warmup_compile(jvmti, method);
+    }
     char entry[STRING_BUFFER_SIZE] = {};
     sig_string(jvmti, method, entry, sizeof(entry));
-    auto& info = get_jit_info(method);
     //printf("load: %p@%s[%p/%d]\n", method, entry, code_addr, code_size);
-    info.inner_methods.clear();
-    compiled_method_info compiled_method(entry, (size_t)code_addr, (size_t)code_size);
-    info.inner_methods.insert(compiled_method);
+    jit_registry_load(method, JIT_CODE_COMPILED, entry, (uint64_t)code_addr, (uint64_t)code_size, tsc);
 
     //dump_perf_file();
 }
@@ -424,10 +363,10 @@ static void JNICALL
 cbCompiledMethodUnLoad(
     jvmtiEnv* jvmti,
     jmethodID method,
-    const void* info) 
+    const void* code_addr) 
 {
     //printf("Unload: %d\n", method);
-    remove_jit_info(method);
+    jit_registry_unload((uint64_t)code_addr, jit_registry_now());
 }
 
 void JNICALL
@@ -435,7 +374,7 @@ cbDynamicCodeGenerated(jvmtiEnv *jvmti,
             const char* name,
             const void* address,
             jint length) {
-    perf_map_write_entry(method_file, address, length, name);
+    jit_registry_load(NULL, JIT_CODE_DYNAMIC, name, (uint64_t)address, (uint64_t)length, jit_registry_now());
 }
 
 void set_notification_mode(jvmtiEnv *jvmti, jvmtiEventMode mode) {
@@ -446,16 +385,19 @@ void set_notification_mode(jvmtiEnv *jvmti, jvmtiEventMode mode) {
     jvmti->SetEventNotificationMode(mode, JVMTI_EVENT_COMPILED_METHOD_UNLOAD, (jthread)NULL);
 }
 
-jvmtiError enable_capabilities(jvmtiEnv *jvmti) {
+jvmtiError enable_capabilities(jvmtiEnv *jvmti, bool live_phase) {
     jvmtiCapabilities capabilities;
 
     memset(&capabilities,0, sizeof(capabilities));
-    capabilities.can_generate_all_class_hook_events  = 1;
-    capabilities.can_tag_objects                     = 1;
-    capabilities.can_generate_object_free_events     = 1;
+    if (!live_phase) {
+        // not needed for the code events, and not every JVM grants them late
+        capabilities.can_generate_all_class_hook_events  = 1;
+        capabilities.can_tag_objects                     = 1;
+        capabilities.can_generate_object_free_events     = 1;
+        capabilities.can_generate_vm_object_alloc_events = 1;
+    }
     capabilities.can_get_source_file_name            = 1;
     capabilities.can_get_line_numbers                = 1;
-    capabilities.can_generate_vm_object_alloc_events = 1;
     capabilities.can_generate_compiled_method_load_events = 1;
 
     // Request these capabilities for this JVM TI environment.
@@ -472,8 +414,14 @@ jvmtiError set_callbacks(jvmtiEnv *jvmti) {
     return jvmti->SetEventCallbacks(&callbacks, (jint)sizeof(callbacks));
 }
 
-JNIEXPORT jint JNICALL
-Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
+// one environment for the life of the JVM, attached agents may come back
+static jvmtiEnv *agent_jvmti = NULL;
+
+static jint start_agent(JavaVM *vm, const char *options, bool live_phase) {
+    if (!options) {
+        options = "";
+    }
+
     open_map_file();
 
     unfold_simple = strstr(options, "unfoldsimple") != NULL;
@@ -483,16 +431,50 @@ Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
     print_source_loc = strstr(options, "sourcepos") != NULL;
     clean_class_names = strstr(options, "dottedclass") != NULL;
     debug_dump_unfold_entries = strstr(options, "debug_dump_unfold_entries") != NULL;
+    parse_profiler_options(options);
 
-    jvmtiEnv *jvmti;
-    vm->GetEnv((void **)&jvmti, JVMTI_VERSION_1);
-    enable_capabilities(jvmti);
-    set_callbacks(jvmti);
-    set_notification_mode(jvmti, JVMTI_ENABLE);
-    jvmti->GenerateEvents(JVMTI_EVENT_DYNAMIC_CODE_GENERATED);
-    jvmti->GenerateEvents(JVMTI_EVENT_COMPILED_METHOD_LOAD);
+    if (!agent_jvmti) {
+        jvmtiEnv *jvmti;
+        if (vm->GetEnv((void **)&jvmti, JVMTI_VERSION_1) != JNI_OK) {
+            return JNI_ERR;
+        }
+        if (enable_capabilities(jvmti, live_phase) != JVMTI_ERROR_NONE) {
+            printf("Can't get JVMTI capabilities for code events\n");
+            return JNI_ERR;
+        }
+        set_callbacks(jvmti);
+        agent_jvmti = jvmti;
+    }
+    set_notification_mode(agent_jvmti, JVMTI_ENABLE);
+    // replays the code cache as it is now, missed unloads are fixed up by the
+    // registry when the same range is loaded again
+    agent_jvmti->GenerateEvents(JVMTI_EVENT_DYNAMIC_CODE_GENERATED);
+    agent_jvmti->GenerateEvents(JVMTI_EVENT_COMPILED_METHOD_LOAD);
 
     return 0;
 }
 
+JNIEXPORT jint JNICALL
+Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
+    return start_agent(vm, options, false);
+}
+
+/*
+ * Loaded into a running JVM (jcmd JVMTI.agent_load, jattach): the code
+ * cache is replayed from GenerateEvents and the JVM is left running after
+ * the captures, the java agent detaches through quiesce_jvmti_agent().
+ */
+JNIEXPORT jint JNICALL
+Agent_OnAttach(JavaVM *vm, char *options, void *reserved) {
+    keep_jvm_running();
+    return start_agent(vm, options, true);
+}
+
+// stops the code events until the next attach, the registry is kept
+extern "C" void quiesce_jvmti_agent() {
+    if (agent_jvmti) {
+        set_notification_mode(agent_jvmti, JVMTI_DISABLE);
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -37,13 +37,21 @@ const char* input_name = "perf.data";
 //#include "util/bpf-loader.h"
 #include "util/debug.h"
 #include "util/event.h"
+#include "profiler.hpp"
+#include "profiler-options.hpp"
+#include "profiler-profile.hpp"
+#include "profiler-markers.hpp"
+#include "decoded-trace.hpp"
+#include "rperf-decode.h"
 #include <api/fs/fs.h>
 #include <api/fs/tracing_path.h>
 
 #include <errno.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -234,13 +242,13 @@ static void init(int i);
 static void stop();
 */
 
-int do_perf_record(pid_t tid_) {
+int do_perf_record(pid_t tid_, int whole_process) {
   	int err;
 	const char *cmd;
 	int value;
 
 	char tid[100] = {};
-	sprintf(tid, "%d", tid_);
+	sprintf(tid, "%d", whole_process ? getpid() : tid_);
 
 	char** argv = (char**)malloc(20 * sizeof(char*));
 
@@ -249,9 +257,21 @@ int do_perf_record(pid_t tid_) {
 	argv[argc++] = "perf";
 	argv[argc++] = "record";
 	argv[argc++] = "-e";
-	argv[argc++] = "intel_pt/cyc,cyc_thresh=0/u";
-	argv[argc++] = "--tid";
-	argv[argc++] = tid;
+	/* phase markers are PTWRITE packets when the hardware has them */
+	argv[argc++] = markers_use_ptwrite() ? "intel_pt/cyc,cyc_thresh=0,ptw/u" :
+					       "intel_pt/cyc,cyc_thresh=0/u";
+	if (whole_process) {
+		/*
+		 * carried captures: every thread, the decoder keeps those taking
+		 * part; per-thread records don't get switch events on their own
+		 */
+		argv[argc++] = "--pid";
+		argv[argc++] = tid;
+		argv[argc++] = "--switch-events";
+	} else {
+		argv[argc++] = "--tid";
+		argv[argc++] = tid;
+	}
 
 
 	/* The page_size is placed in util object. */
@@ -318,24 +338,27 @@ int do_perf_record(pid_t tid_) {
 	cmd_record(argc, argv);
 }
 
-int do_perf_top() {
-    char** argv = (char**)malloc(sizeof(*argv) * 20);
+int do_perf_top(const char *label, const char *exception) {
+    char** argv;
     int argc = 0;
 
+    rperf__set_capture_label(label);
+    rperf__set_capture_exit(exception);
+    if (!get_profiler_options()->text_dump)
+	return rperf__decode("perf.data");
+
+    /* same report, plus every sample formatted into perf.data.log */
+    argv = (char**)malloc(sizeof(*argv) * 20);
     argv[argc++] = "script";
     argv[argc++] = "--ns";
 
-    cmd_script(argc, argv);
+    return cmd_script(argc, argv);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////
 
-void start();
-void init(int i);
-void stop();
-
 void* __test_workload(void* w) {
     char* p = (char*)w;
     int r = 0;
@@ -351,13 +374,51 @@ void* __test_workload(void* w) {
 }
 
 
-int main() {
-    init(1);
+/* prints the branches of a decoded= trace from @from_ns on */
+static int dump_decoded_trace(const char *path, uint64_t from_ns)
+{
+    struct decoded_trace *trace = decoded_trace_reader_open(path);
+    struct decoded_branch branch;
+
+    if (!trace)
+	return -errno;
+
+    decoded_trace_seek(trace, from_ns);
+    while (decoded_trace_next(trace, &branch))
+	printf("%" PRIu64 "\t%d/%d\t%s+0x%" PRIx64 "\n", branch.time, branch.pid, branch.tid,
+	       branch.function_name, branch.offset);
+    decoded_trace_reader_close(trace);
+    return 0;
+}
+
+/*
+ * perf diff <base> <current> compares two profiles saved with the profile=
+ * agent option, perf decoded <trace> [from_ns] prints a trace saved with
+ * decoded=, anything else runs the self test below.
+ */
+int main(int argc, char** argv) {
+    if ((argc == 3 || argc == 4) && !strcmp(argv[1], "decoded")) {
+	int err = dump_decoded_trace(argv[2], argc == 4 ? strtoull(argv[3], NULL, 10) : 0);
+	if (err)
+	    fprintf(stderr, "Couldn't read decoded trace: %s\n", strerror(-err));
+	return err ? 1 : 0;
+    }
+
+    if (argc == 4 && !strcmp(argv[1], "diff")) {
+	int err = diff_profiles(argv[2], argv[3], get_profiler_options()->top);
+	if (err)
+	    fprintf(stderr, "Couldn't compare profiles: %s\n", strerror(-err));
+	return err ? 1 : 0;
+    }
+
+    int countdown;
+
+    add_trigger(0, "self-test", 1, NULL);
 
-    start();
+    start(0, &countdown);
 
     __test_workload("");
 
-    stop();
+    stop(0, &countdown);
 }
 
@@ -88,6 +88,10 @@ extern struct option *record_options;
 #define __API__
 #endif
 
-__API__ int do_perf_record(pid_t tid_);
-__API__ int do_perf_top(void);
+__API__ int do_perf_record(pid_t tid_, int whole_process);
+/*
+ * @label names the trigger the capture was taken for, may be NULL;
+ * @exception is the class the captured invocation threw, NULL if it returned
+ */
+__API__ int do_perf_top(const char *label, const char *exception);
 #endif
@@ -1,107 +1,509 @@
 #include <iostream>
-#include <unordered_set>
 #include <algorithm>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include <cstring>
 
 #include "profiler-backend.hpp"
+#include "jit-methods.hpp"
 
-struct routine {
-    std::string method_name;
-    uint64_t total_time;
-    uint64_t invoke_count;
-
-    routine(std::string& method): method_name(method), total_time(0), invoke_count(0) {}
+/*
+ * Compiled code that hit an uncommon trap or was deoptimized, together with
+ * the time spent until execution got back to compiled code.
+ */
+struct deopt_event {
+    uint64_t timestamp;
+    int victim;			// routine id
+    uint64_t slow_path_time;
 };
 
-struct hash_by_routine_name {
-    size_t operator() (const routine& r) const noexcept {
-	std::hash<std::string> string_hash;
-	return string_hash(r.method_name);
+namespace {
+    const char* category_names[CATEGORY_MAX] = {
+	"java-compiled",
+	"interpreter",
+	"stubs",
+	"gc",
+	"safepoint",
+	"jvm-runtime",
+	"native",
+	"libc",
+	"kernel",
+	"unknown",
+    };
+
+    // substrings of (mangled) libjvm.so symbol names, checked in order
+    const char* gc_families[] = {
+	"G1", "PSScavenge", "PSPromotion", "PSParallelCompact", "ParallelScavenge", "MarkSweep",
+	"CMSCollector", "ConcurrentMark", "GenCollectedHeap", "CollectedHeap", "Shenandoah",
+	"ZBarrier", "ZHeap", "CardTable", "BarrierSet", "GCTask", "WorkGang", "Universe8heap",
+    };
+    const char* safepoint_families[] = {
+	"Safepoint", "safepoint", "VMThread", "VM_Operation", "HandshakeState",
+    };
+
+    uint64_t category_time[CATEGORY_MAX];
+
+    template <size_t N>
+    bool matches_family(const char* symbol, const char* (&family)[N]) {
+	for (auto pattern : family) {
+	    if (strstr(symbol, pattern)) {
+		return true;
+	    }
+	}
+	return false;
     }
-};
 
-struct equals_by_routine_name {
-    bool operator() (const routine& r1, const routine& r2) const {
-	return r1.method_name == r2.method_name;
+    // HotSpot blobs compiled code jumps to when it gives up
+    const char* deopt_entries[] = {
+	"DeoptimizationBlob", "UncommonTrapBlob", "deopt_blob", "uncommon_trap",
+    };
+
+    bool dso_starts_with(const char* dso, const char* prefix) {
+	return !strncmp(dso, prefix, strlen(prefix));
     }
-};
 
-struct greater_by_routine_total_time {
-    bool operator() (const routine* r1, const routine* r2) {
-	return r1->total_time > r2->total_time;
+    int classify_routine(const char* symbol, const char* dso, int code_kind) {
+	if (code_kind == JIT_CODE_COMPILED) {
+	    return CATEGORY_JAVA_COMPILED;
+	}
+	if (code_kind == JIT_CODE_DYNAMIC) {
+	    if (!strcmp(symbol, "Interpreter")) {
+		return CATEGORY_INTERPRETER;
+	    }
+	    if (matches_family(symbol, safepoint_families)) {
+		return CATEGORY_SAFEPOINT;
+	    }
+	    return CATEGORY_STUBS;
+	}
+
+	// code cache addresses the registry has never seen still belong to
+	// the perf map written by the agent
+	if (dso_starts_with(dso, "perf-") || dso_starts_with(dso, "/tmp/perf-")) {
+	    return CATEGORY_JAVA_COMPILED;
+	}
+	if (dso_starts_with(dso, "[kernel") || dso_starts_with(dso, "[vdso")) {
+	    return CATEGORY_KERNEL;
+	}
+	if (dso_starts_with(dso, "libjvm")) {
+	    if (matches_family(symbol, safepoint_families)) {
+		return CATEGORY_SAFEPOINT;
+	    }
+	    if (matches_family(symbol, gc_families)) {
+		return CATEGORY_GC;
+	    }
+	    return CATEGORY_JVM_RUNTIME;
+	}
+	if (dso_starts_with(dso, "libc.") || dso_starts_with(dso, "libc-") ||
+	    dso_starts_with(dso, "libpthread") || dso_starts_with(dso, "ld-") ||
+	    dso_starts_with(dso, "libm.") || dso_starts_with(dso, "libm-") ||
+	    dso_starts_with(dso, "librt") || dso_starts_with(dso, "libdl")) {
+	    return CATEGORY_LIBC;
+	}
+	if (!strcmp(dso, "unknown")) {
+	    return CATEGORY_UNKNOWN;
+	}
+	return CATEGORY_NATIVE;
     }
-};
+}
+
+namespace {
+    const int NO_ROUTINE = -1;
+
+    /*
+     * Routines are identified by whatever the decoder resolved the target to
+     * (a symbol, a dso or a JIT method) and get a dense id the first time they
+     * are seen. Everything per routine lives in flat arrays indexed by that id,
+     * so a sample costs one pointer hash probe and no allocations.
+     */
+    struct routine_table {
+	std::vector<const void*> slot_keys;
+	std::vector<int> slot_ids;
+	size_t mask = 0;
+
+	std::vector<std::string> names;
+	std::vector<std::string> dsos;
+	std::vector<uint64_t> total_time;
+	std::vector<uint64_t> invoke_count;
+	std::vector<int> category;
+	std::vector<bool> deopt_entry;
+
+	// stands for a target nothing at all is known about
+	static const void* unknown_key() {
+	    static const char key = 0;
+	    return &key;
+	}
+
+	static size_t hash(const void* key) {
+	    uint64_t h = reinterpret_cast<uintptr_t>(key) >> 4;
+	    h *= 0x9e3779b97f4a7c15ULL;
+	    return h ^ (h >> 32);
+	}
 
-routine* last_routine = nullptr;
-uint64_t routine_start_timestamp = 0;
-std::unordered_set<routine, hash_by_routine_name, equals_by_routine_name> all_routines;
+	int size() const {
+	    return names.size();
+	}
+
+	int find(const void* key) const {
+	    if (!mask) {
+		return NO_ROUTINE;
+	    }
+	    for (size_t i = hash(key) & mask; slot_keys[i]; i = (i + 1) & mask) {
+		if (slot_keys[i] == key) {
+		    return slot_ids[i];
+		}
+	    }
+	    return NO_ROUTINE;
+	}
+
+	void insert_slot(const void* key, int id) {
+	    size_t i = hash(key) & mask;
+	    while (slot_keys[i]) {
+		i = (i + 1) & mask;
+	    }
+	    slot_keys[i] = key;
+	    slot_ids[i] = id;
+	}
 
+	void grow() {
+	    std::vector<const void*> old_keys(std::max<size_t>(1024, slot_keys.size() * 2), nullptr);
+	    std::vector<int> old_ids(old_keys.size(), NO_ROUTINE);
+	    old_keys.swap(slot_keys);
+	    old_ids.swap(slot_ids);
+	    mask = slot_keys.size() - 1;
+	    for (size_t i = 0; i < old_keys.size(); ++i) {
+		if (old_keys[i]) {
+		    insert_slot(old_keys[i], old_ids[i]);
+		}
+	    }
+	}
 
-std::vector<routine*> functions_by_self_time;
+	int add(const void* key, const char* symbol, const char* dso, int code_kind) {
+	    // keep the load factor under 1/2
+	    if ((size() + 1) * 2 > (int) slot_keys.size()) {
+		grow();
+	    }
+	    int id = size();
+	    insert_slot(key, id);
 
+	    std::string name(symbol);
+	    name += "@";
+	    name += dso;
+	    names.push_back(std::move(name));
+	    dsos.emplace_back(dso);
+	    total_time.push_back(0);
+	    invoke_count.push_back(0);
+	    category.push_back(classify_routine(symbol, dso, code_kind));
+	    deopt_entry.push_back(code_kind == JIT_CODE_DYNAMIC && matches_family(symbol, deopt_entries));
+	    return id;
+	}
 
-__API__ void visit_sample(uint64_t timestamp, const char* symbol_name, const char* dso) {
-    std::string function;
-    function += symbol_name;
-    function += "@";
-    function += dso;
+	int findnew(const void* key, const char* symbol, const char* dso, int code_kind) {
+	    if (!key) {
+		key = unknown_key();
+	    }
+	    int id = find(key);
+	    return id != NO_ROUTINE ? id : add(key, symbol, dso, code_kind);
+	}
+    };
 
+    routine_table routines;
+
+    int last_routine = NO_ROUTINE;
+    const void* last_key = nullptr;
+    uint64_t routine_start_timestamp = 0;
+
+    // where the other threads of a carried capture were, see visit_thread()
+    struct thread_position {
+	int routine;
+	const void* key;
+	int phase;
+    };
+    std::unordered_map<int, thread_position> thread_positions;
+    int current_tid = -1;
+
+    uint64_t first_timestamp = 0;
+    uint64_t last_timestamp = 0;
+    uint64_t total_time = 0;
+
+    std::vector<deopt_event> deopt_events;
+    bool in_deopt_slow_path = false;
+
+    void track_deopt(uint64_t timestamp, int from, int to) {
+	if (in_deopt_slow_path) {
+	    if (routines.category[to] == CATEGORY_JAVA_COMPILED) {
+		deopt_events.back().slow_path_time = timestamp - deopt_events.back().timestamp;
+		in_deopt_slow_path = false;
+	    }
+	} else if (routines.deopt_entry[to] && from != NO_ROUTINE && routines.category[from] == CATEGORY_JAVA_COMPILED) {
+	    deopt_events.push_back({ timestamp, from, 0 });
+	    in_deopt_slow_path = true;
+	}
+    }
+
+    // routine ids, the top of them ordered by total time
+    std::vector<int> functions_by_self_time;
+
+    // time from a marker to the next one, summed up per marker id
+    struct phase {
+	uint64_t marker;
+	uint64_t time = 0;
+	uint64_t count = 0;
+	std::unordered_map<int, uint64_t> routine_time;
+	// routine ids, the top of them ordered by time in the phase
+	std::vector<int> top;
+    };
+
+    std::vector<phase> phases;
+    std::unordered_map<uint64_t, int> phase_ids;
+    // nothing before the first marker belongs to a phase
+    int current_phase = -1;
+
+    void credit(int routine, uint64_t time) {
+	routines.total_time[routine] += time;
+	if (current_phase >= 0) {
+	    auto& p = phases[current_phase];
+	    p.time += time;
+	    p.routine_time[routine] += time;
+	}
+    }
+}
+
+__API__ void visit_sample(uint64_t timestamp, const void* key, const char* symbol_name, const char* dso, int code_kind) {
     if (!routine_start_timestamp) {
 	routine_start_timestamp = timestamp;
+	first_timestamp = timestamp;
     }
-    if ((!last_routine) || (strcmp(last_routine->method_name.c_str(), function.c_str()))) {
-	if (last_routine) {
-	    last_routine->total_time += (timestamp - routine_start_timestamp);
-	}
+    last_timestamp = timestamp;
 
-	auto it = all_routines.find(routine(function));
-	if (it == std::end(all_routines)) {
-	    auto func_it = all_routines.emplace(function).first;
-	    last_routine = const_cast<routine*>(&*func_it);
-	    last_routine->invoke_count = 1;
-	} else {
-	    const_cast<routine&>(*it).invoke_count += 1;
-	    last_routine = const_cast<routine*>(&*it);
-	}
+    // consecutive branches within the same routine are the common case
+    if (last_routine != NO_ROUTINE && key == last_key) {
+	return;
+    }
+
+    int routine = routines.findnew(key, symbol_name, dso, code_kind);
+    last_key = key;
+    if (routine == last_routine) {
+	return;
+    }
+
+    if (last_routine != NO_ROUTINE) {
+	credit(last_routine, timestamp - routine_start_timestamp);
+    }
+    routines.invoke_count[routine] += 1;
+    track_deopt(timestamp, last_routine, routine);
+    last_routine = routine;
+    routine_start_timestamp = timestamp;
+}
+
+void visit_marker(uint64_t timestamp, uint64_t marker) {
+    // the routine that ran up to the marker is split between the phases
+    if (last_routine != NO_ROUTINE && timestamp > routine_start_timestamp) {
+	credit(last_routine, timestamp - routine_start_timestamp);
 	routine_start_timestamp = timestamp;
     }
+
+    auto it = phase_ids.find(marker);
+    if (it == std::end(phase_ids)) {
+	it = phase_ids.emplace(marker, phases.size()).first;
+	phases.emplace_back();
+	phases.back().marker = marker;
+    }
+    current_phase = it->second;
+    phases[current_phase].count += 1;
 }
 
-void prepare_top() {
-    std::transform(
-	std::begin(all_routines),
-	std::end(all_routines),
-	std::back_inserter(functions_by_self_time),
-	[] (const routine& r) {
-	    return const_cast<routine*>(&r);
-	}
-	);
-    std::sort(
-	std::begin(functions_by_self_time),
-	std::end(functions_by_self_time),
-	greater_by_routine_total_time());
+void visit_thread(uint64_t timestamp, int tid) {
+    if (tid == current_tid) {
+	return;
+    }
+    if (last_routine != NO_ROUTINE && timestamp > routine_start_timestamp) {
+	credit(last_routine, timestamp - routine_start_timestamp);
+    }
+    if (current_tid != -1) {
+	thread_positions[current_tid] = { last_routine, last_key, current_phase };
+    }
+
+    // a thread's phase is its own, set by the markers on it
+    auto it = thread_positions.find(tid);
+    bool known = it != std::end(thread_positions);
+    last_routine = known ? it->second.routine : NO_ROUTINE;
+    last_key = known ? it->second.key : nullptr;
+    current_phase = known ? it->second.phase : -1;
+    if (routine_start_timestamp) {
+	routine_start_timestamp = timestamp;
+    }
+    current_tid = tid;
 }
 
-int get_top_len() {
-    return functions_by_self_time.size();
+void reset_samples() {
+    routines = routine_table();
+    last_routine = NO_ROUTINE;
+    last_key = nullptr;
+    routine_start_timestamp = 0;
+    thread_positions.clear();
+    current_tid = -1;
+    first_timestamp = 0;
+    last_timestamp = 0;
+    total_time = 0;
+    std::fill(std::begin(category_time), std::end(category_time), 0);
+    deopt_events.clear();
+    in_deopt_slow_path = false;
+    functions_by_self_time.clear();
+    phases.clear();
+    phase_ids.clear();
+    current_phase = -1;
 }
 
-const char* ppp(int idx) {
-    auto ret = functions_by_self_time[idx]->method_name.c_str();
-    return ret;
+void prepare_top(int max_len) {
+    int count = routines.size();
+
+    for (int id = 0; id < count; ++id) {
+	category_time[routines.category[id]] += routines.total_time[id];
+	total_time += routines.total_time[id];
+    }
+
+    functions_by_self_time.resize(count);
+    for (int id = 0; id < count; ++id) {
+	functions_by_self_time[id] = id;
+    }
+
+    auto by_total_time = [] (int r1, int r2) {
+	return routines.total_time[r1] > routines.total_time[r2];
+    };
+    if (max_len > 0 && max_len < count) {
+	auto top_end = std::begin(functions_by_self_time) + max_len;
+	std::nth_element(std::begin(functions_by_self_time), top_end, std::end(functions_by_self_time), by_total_time);
+	functions_by_self_time.resize(max_len);
+    }
+    std::sort(std::begin(functions_by_self_time), std::end(functions_by_self_time), by_total_time);
+
+    // the trace ended before execution got back to compiled code
+    if (in_deopt_slow_path) {
+	deopt_events.back().slow_path_time = last_timestamp - deopt_events.back().timestamp;
+	in_deopt_slow_path = false;
+    }
+}
+
+int get_top_len() {
+    return functions_by_self_time.size();
 }
 
 const char* get_top_by_idx(int idx) {
-    auto res = ppp(idx);
-    // return functions_by_self_time[idx]->method_name.c_str();
-    return res;
+    return routines.names[functions_by_self_time[idx]].c_str();
 }
 
 uint64_t get_counters_by_idx(int idx) {
-    return functions_by_self_time[idx]->total_time;
+    return routines.total_time[functions_by_self_time[idx]];
 }
 
 int get_invoke_count_by_idx(int idx) {
-    return functions_by_self_time[idx]->invoke_count;
+    return routines.invoke_count[functions_by_self_time[idx]];
+}
+
+int get_category_by_idx(int idx) {
+    return routines.category[functions_by_self_time[idx]];
+}
+
+int get_routine_count() {
+    return routines.size();
+}
+
+const char* get_routine_name(int id) {
+    return routines.names[id].c_str();
+}
+
+const char* get_routine_dso(int id) {
+    return routines.dsos[id].c_str();
+}
+
+uint64_t get_routine_time(int id) {
+    return routines.total_time[id];
+}
+
+uint64_t get_routine_invoke_count(int id) {
+    return routines.invoke_count[id];
+}
+
+int get_routine_category(int id) {
+    return routines.category[id];
+}
+
+uint64_t get_total_time() {
+    return total_time;
+}
+
+const char* get_category_name(int category) {
+    return category_names[category];
+}
+
+uint64_t get_category_time(int category) {
+    return category_time[category];
+}
+
+uint64_t get_first_timestamp() {
+    return first_timestamp;
+}
+
+uint64_t get_last_timestamp() {
+    return last_timestamp;
+}
+
+int get_deopt_count() {
+    return deopt_events.size();
+}
+
+uint64_t get_deopt_timestamp(int idx) {
+    return deopt_events[idx].timestamp;
+}
+
+const char* get_deopt_method(int idx) {
+    return routines.names[deopt_events[idx].victim].c_str();
+}
+
+uint64_t get_deopt_slow_path_time(int idx) {
+    return deopt_events[idx].slow_path_time;
+}
+
+void prepare_phases(int max_len) {
+    for (auto& p : phases) {
+	p.top.clear();
+	for (auto& entry : p.routine_time) {
+	    p.top.push_back(entry.first);
+	}
+	auto by_time = [&p] (int r1, int r2) {
+	    return p.routine_time[r1] > p.routine_time[r2];
+	};
+	size_t len = max_len > 0 ? std::min<size_t>(max_len, p.top.size()) : p.top.size();
+	std::partial_sort(std::begin(p.top), std::begin(p.top) + len, std::end(p.top), by_time);
+	p.top.resize(len);
+    }
+}
+
+int get_phase_count() {
+    return phases.size();
+}
+
+uint64_t get_phase_marker(int phase) {
+    return phases[phase].marker;
+}
+
+uint64_t get_phase_time(int phase) {
+    return phases[phase].time;
+}
+
+uint64_t get_phase_occurrences(int phase) {
+    return phases[phase].count;
+}
+
+int get_phase_top_len(int phase) {
+    return phases[phase].top.size();
+}
+
+int get_phase_top_routine(int phase, int idx) {
+    return phases[phase].top[idx];
+}
+
+uint64_t get_phase_top_time(int phase, int idx) {
+    return phases[phase].routine_time[phases[phase].top[idx]];
 }
@@ -9,11 +9,75 @@
 #define __API__
 #endif
 
-__API__ void visit_sample(uint64_t timestamp, const char* symbol_name, const char* dso);
-__API__ void prepare_top(void);
+enum routine_category {
+    CATEGORY_JAVA_COMPILED,
+    CATEGORY_INTERPRETER,
+    CATEGORY_STUBS,
+    CATEGORY_GC,
+    CATEGORY_SAFEPOINT,
+    CATEGORY_JVM_RUNTIME,
+    CATEGORY_NATIVE,
+    CATEGORY_LIBC,
+    CATEGORY_KERNEL,
+    CATEGORY_UNKNOWN,
+    CATEGORY_MAX,
+};
+
+/*
+ * @key identifies the routine (symbol, dso or JIT method); names are only
+ * read the first time a key is seen. code_kind is one of jit_code_kind from
+ * jit-methods.hpp.
+ */
+__API__ void visit_sample(uint64_t timestamp, const void* key, const char* symbol_name, const char* dso, int code_kind);
+/*
+ * The samples and markers from now on are of thread @tid, for captures of
+ * several threads: each thread picks up in the routine and phase it was in,
+ * and the wall time is split between the threads as their samples
+ * interleave.
+ */
+__API__ void visit_thread(uint64_t timestamp, int tid);
+/* forgets everything seen so far, keys are only valid for one capture */
+__API__ void reset_samples(void);
+/* keeps the @max_len routines with the most time, all of them if 0 */
+__API__ void prepare_top(int max_len);
 __API__ int get_top_len(void);
 __API__ const char* get_top_by_idx(int idx);
 __API__ uint64_t get_counters_by_idx(int idx);
 __API__ int get_invoke_count_by_idx(int idx);
+__API__ int get_category_by_idx(int idx);
+__API__ int get_routine_count(void);
+/* every routine by id, in no particular order */
+__API__ const char* get_routine_name(int id);	/* "symbol@dso" */
+__API__ const char* get_routine_dso(int id);
+__API__ uint64_t get_routine_time(int id);
+__API__ uint64_t get_routine_invoke_count(int id);
+__API__ int get_routine_category(int id);
+__API__ uint64_t get_total_time(void);
+
+__API__ const char* get_category_name(int category);
+__API__ uint64_t get_category_time(int category);
+
+__API__ uint64_t get_first_timestamp(void);
+__API__ uint64_t get_last_timestamp(void);
+
+/*
+ * Phase marker @marker seen in the trace at @timestamp: from now on time is
+ * also accounted to its phase, until the next marker.
+ */
+__API__ void visit_marker(uint64_t timestamp, uint64_t marker);
+/* keeps the @max_len routines with the most time in each phase */
+__API__ void prepare_phases(int max_len);
+__API__ int get_phase_count(void);
+__API__ uint64_t get_phase_marker(int phase);
+__API__ uint64_t get_phase_time(int phase);
+__API__ uint64_t get_phase_occurrences(int phase);
+__API__ int get_phase_top_len(int phase);
+__API__ int get_phase_top_routine(int phase, int idx);	/* routine id */
+__API__ uint64_t get_phase_top_time(int phase, int idx);
+
+__API__ int get_deopt_count(void);
+__API__ uint64_t get_deopt_timestamp(int idx);
+__API__ const char* get_deopt_method(int idx);
+__API__ uint64_t get_deopt_slow_path_time(int idx);
 
 #endif
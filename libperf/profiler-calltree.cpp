@@ -0,0 +1,212 @@
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <unordered_map>
+#include <algorithm>
+#include <map>
+#include <vector>
+#include <string>
+
+#include "profiler-calltree.hpp"
+
+struct call_node {
+    int parent;
+    std::string name;
+    uint64_t inclusive_time;
+    uint64_t children_time;
+    uint64_t calls;
+    std::vector<int> children;
+
+    call_node(int parent_): parent(parent_), inclusive_time(0), children_time(0), calls(0) {}
+
+    uint64_t exclusive_time() const {
+	// children reported without their caller's return may overlap it
+	return inclusive_time > children_time ? inclusive_time - children_time : 0;
+    }
+};
+
+struct flat_call_node {
+    int node;
+    int depth;
+};
+
+namespace {
+    std::vector<call_node> nodes;
+    std::unordered_map<const void*, int> node_by_path;
+    std::vector<flat_call_node> flat_tree;
+
+    int findnew_node(const void* path, const void* parent_path) {
+	auto it = node_by_path.find(path);
+	if (it != std::end(node_by_path)) {
+	    return it->second;
+	}
+
+	int parent = parent_path ? findnew_node(parent_path, nullptr) : -1;
+	int idx = nodes.size();
+	nodes.emplace_back(parent);
+	node_by_path.emplace(path, idx);
+	return idx;
+    }
+
+    // frame separators of the folded format must not appear inside a frame
+    void append_folded_frame(std::string& stack, const std::string& name) {
+	if (name.empty()) {
+	    stack += "[unknown];";
+	    return;
+	}
+	for (char c : name) {
+	    if (c == ';') {
+		stack += ',';
+	    } else if (c == '\n') {
+		stack += ' ';
+	    } else {
+		stack += c;
+	    }
+	}
+	stack += ';';
+    }
+
+    void fold(int idx, std::string& stack, std::map<std::string, uint64_t>& folded) {
+	auto& node = nodes[idx];
+	size_t len = stack.size();
+	append_folded_frame(stack, node.name);
+
+	uint64_t weight = node.exclusive_time();
+	if (weight) {
+	    folded[stack.substr(0, stack.size() - 1)] += weight;
+	}
+	for (int child : node.children) {
+	    fold(child, stack, folded);
+	}
+	stack.resize(len);
+    }
+
+    void flatten(int idx, int depth, uint64_t threshold) {
+	auto& node = nodes[idx];
+	if (node.inclusive_time < threshold) {
+	    return;
+	}
+
+	flat_tree.push_back({ idx, depth });
+	for (int child : node.children) {
+	    flatten(child, depth + 1, threshold);
+	}
+    }
+}
+
+void visit_call_return(const void* path, const void* parent_path, const char* name, uint64_t call_time, uint64_t return_time) {
+    int idx = findnew_node(path, parent_path);
+
+    // a placeholder created for a caller does not know its parent yet
+    if (nodes[idx].parent < 0 && parent_path) {
+	int parent = findnew_node(parent_path, nullptr);
+	nodes[idx].parent = parent;
+    }
+
+    auto& node = nodes[idx];
+    if (node.name.empty()) {
+	node.name = name;
+    }
+
+    uint64_t duration = return_time - call_time;
+    node.inclusive_time += duration;
+    node.calls += 1;
+
+    if (node.parent >= 0) {
+	nodes[node.parent].children_time += duration;
+    }
+}
+
+void reset_call_tree() {
+    nodes.clear();
+    node_by_path.clear();
+    flat_tree.clear();
+}
+
+void prepare_call_tree(double min_pct) {
+    std::vector<int> roots;
+    uint64_t total_time = 0;
+
+    // the tree may be flattened again with another threshold
+    flat_tree.clear();
+    for (auto& node : nodes) {
+	node.children.clear();
+    }
+
+    for (size_t i = 0; i < nodes.size(); ++i) {
+	int parent = nodes[i].parent;
+	if (parent >= 0) {
+	    nodes[parent].children.push_back(i);
+	} else {
+	    roots.push_back(i);
+	    total_time += nodes[i].inclusive_time;
+	}
+    }
+
+    auto by_inclusive_time = [] (int n1, int n2) {
+	return nodes[n1].inclusive_time > nodes[n2].inclusive_time;
+    };
+    std::sort(std::begin(roots), std::end(roots), by_inclusive_time);
+    for (auto& node : nodes) {
+	std::sort(std::begin(node.children), std::end(node.children), by_inclusive_time);
+    }
+
+    uint64_t threshold = total_time * min_pct / 100;
+    for (int root : roots) {
+	flatten(root, 0, threshold);
+    }
+}
+
+int get_call_tree_len() {
+    return flat_tree.size();
+}
+
+int get_call_tree_depth(int idx) {
+    return flat_tree[idx].depth;
+}
+
+const char* get_call_tree_name(int idx) {
+    return nodes[flat_tree[idx].node].name.c_str();
+}
+
+uint64_t get_call_tree_inclusive(int idx) {
+    return nodes[flat_tree[idx].node].inclusive_time;
+}
+
+uint64_t get_call_tree_exclusive(int idx) {
+    return nodes[flat_tree[idx].node].exclusive_time();
+}
+
+uint64_t get_call_tree_calls(int idx) {
+    return nodes[flat_tree[idx].node].calls;
+}
+
+int write_folded_stacks(const char* path, double weight_scale) {
+    // children lists are only filled in by prepare_call_tree()
+    prepare_call_tree(0.0);
+
+    std::map<std::string, uint64_t> folded;
+    std::string stack;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+	if (nodes[i].parent < 0) {
+	    fold(i, stack, folded);
+	}
+    }
+
+    FILE* file = fopen(path, "w");
+    if (!file) {
+	return -errno;
+    }
+    int err = 0;
+    for (auto& entry : folded) {
+	uint64_t weight = entry.second * weight_scale;
+	if (weight && fprintf(file, "%s %" PRIu64 "\n", entry.first.c_str(), weight) < 0) {
+	    err = -EIO;
+	    break;
+	}
+    }
+    if (fclose(file) && !err) {
+	err = -errno;
+    }
+    return err;
+}
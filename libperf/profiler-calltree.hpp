@@ -0,0 +1,37 @@
+#ifndef __PROFILER_CALLTREE_HEADER__
+#define __PROFILER_CALLTREE_HEADER__
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+#define __API__ extern "C"
+#else
+#define __API__
+#endif
+
+/*
+ * Calling-context tree fed from the thread-stack call/return stream.
+ * Nodes are keyed by the call_path they were reported for; parents that have
+ * not returned yet are created on demand and named when they return.
+ */
+__API__ void visit_call_return(const void* path, const void* parent_path, const char* name,
+			       uint64_t call_time, uint64_t return_time);
+__API__ void reset_call_tree(void);
+
+/* Flattens the tree depth-first, hiding subtrees below min_pct of the total. */
+__API__ void prepare_call_tree(double min_pct);
+__API__ int get_call_tree_len(void);
+__API__ int get_call_tree_depth(int idx);
+__API__ const char* get_call_tree_name(int idx);
+__API__ uint64_t get_call_tree_inclusive(int idx);
+__API__ uint64_t get_call_tree_exclusive(int idx);
+__API__ uint64_t get_call_tree_calls(int idx);
+
+/*
+ * Writes the whole tree as folded stacks ("outer;...;inner weight"), one line
+ * per distinct stack weighted by its exclusive time times @weight_scale.
+ * Returns 0 or a negative errno.
+ */
+__API__ int write_folded_stacks(const char* path, double weight_scale);
+
+#endif
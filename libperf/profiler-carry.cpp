@@ -0,0 +1,257 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "profiler-carry.hpp"
+
+namespace {
+    const uint64_t OPEN = ~0ull;
+
+    struct span {
+	int tid;
+	uint64_t begin;
+	uint64_t end;
+	int handoff;		// -1 for the origin
+	uint64_t off_cpu;
+    };
+
+    struct handoff {
+	int tid;
+	uint64_t tsc;
+    };
+
+    std::mutex carry_mutex;
+    std::condition_variable carry_left;
+    // tokens are only good for the capture they were handed out in
+    std::atomic<bool> carrying(false);
+    uint32_t capture_seq = 0;
+    bool enabled = false;
+    int outstanding = 0;
+    std::vector<span> spans;
+    std::vector<handoff> handoffs;
+
+    // built by carry_end(), for the decoder: span indexes by tid, by begin
+    std::map<int, std::vector<int>> spans_by_tid;
+    std::map<int, uint64_t> switched_out;
+
+    int current_tid() {
+	thread_local int tid = syscall(SYS_gettid);
+	return tid;
+    }
+
+    uint64_t now() {
+	return __builtin_ia32_rdtsc();
+    }
+
+    uint32_t token_seq(uint64_t token) {
+	return token >> 32;
+    }
+
+    int token_handoff(uint64_t token) {
+	return (int)(token & 0xffffffff) - 1;
+    }
+
+    span* open_span(int tid, int handoff) {
+	for (auto it = spans.rbegin(); it != spans.rend(); ++it) {
+	    if (it->tid == tid && it->end == OPEN && (handoff == -2 || it->handoff == handoff)) {
+		return &*it;
+	    }
+	}
+	return NULL;
+    }
+
+    // tokens of a past capture
+    bool stale(uint64_t token) {
+	return !carrying.load(std::memory_order_acquire) || token_seq(token) != capture_seq
+	    || token_handoff(token) < 0 || token_handoff(token) >= (int)handoffs.size();
+    }
+}
+
+void carry_begin(int origin_tid, int enable) {
+    std::lock_guard<std::mutex> lock(carry_mutex);
+    ++capture_seq;
+    enabled = enable;
+    outstanding = 0;
+    spans.clear();
+    handoffs.clear();
+    spans_by_tid.clear();
+    switched_out.clear();
+    if (enable) {
+	spans.push_back({ origin_tid, now(), OPEN, -1, 0 });
+    }
+    carrying.store(enable, std::memory_order_release);
+}
+
+uint64_t carry_token() {
+    if (!carrying.load(std::memory_order_acquire)) {
+	return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(carry_mutex);
+    int tid = current_tid();
+    if (!carrying.load(std::memory_order_relaxed) || !open_span(tid, -2)) {
+	return 0;
+    }
+    handoffs.push_back({ tid, now() });
+    ++outstanding;
+    return (uint64_t)capture_seq << 32 | handoffs.size();
+}
+
+int carry_join(uint64_t token) {
+    if (!token) {
+	return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(carry_mutex);
+    if (stale(token)) {
+	return 0;
+    }
+    spans.push_back({ current_tid(), now(), OPEN, token_handoff(token), 0 });
+    return 1;
+}
+
+void carry_leave(uint64_t token) {
+    if (!token) {
+	return;
+    }
+
+    std::lock_guard<std::mutex> lock(carry_mutex);
+    if (stale(token)) {
+	return;
+    }
+    span* s = open_span(current_tid(), token_handoff(token));
+    if (!s) {
+	return;
+    }
+    s->end = now();
+    if (--outstanding == 0) {
+	carry_left.notify_all();
+    }
+}
+
+int carry_origin_end() {
+    std::lock_guard<std::mutex> lock(carry_mutex);
+    if (!enabled) {
+	return 0;
+    }
+    if (span* s = open_span(spans.front().tid, -1)) {
+	s->end = now();
+    }
+    return outstanding;
+}
+
+int carry_wait(int timeout_ms) {
+    std::unique_lock<std::mutex> lock(carry_mutex);
+    carry_left.wait_for(lock, std::chrono::milliseconds(timeout_ms), [] { return outstanding <= 0; });
+    return std::max(outstanding, 0);
+}
+
+void carry_end() {
+    std::lock_guard<std::mutex> lock(carry_mutex);
+    carrying.store(false, std::memory_order_release);
+    uint64_t end = now();
+    for (size_t i = 0; i < spans.size(); ++i) {
+	if (spans[i].end == OPEN) {
+	    spans[i].end = end;
+	}
+	spans_by_tid[spans[i].tid].push_back(i);
+    }
+    for (auto& tid_spans : spans_by_tid) {
+	std::sort(tid_spans.second.begin(), tid_spans.second.end(),
+		  [](int a, int b) { return spans[a].begin < spans[b].begin; });
+    }
+}
+
+int carry_enabled() {
+    return enabled;
+}
+
+int carry_includes(int tid, uint64_t tsc) {
+    if (!enabled) {
+	return 1;
+    }
+    auto it = spans_by_tid.find(tid);
+    if (it == spans_by_tid.end()) {
+	return 0;
+    }
+    // spans of a thread only overlap when it carries work to itself
+    for (int idx : it->second) {
+	if (spans[idx].begin > tsc) {
+	    break;
+	}
+	if (tsc <= spans[idx].end) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+int carry_visit_switch(int tid, uint64_t tsc, int out, uint64_t* off_cpu_begin) {
+    auto it = spans_by_tid.find(tid);
+    if (!enabled || it == spans_by_tid.end()) {
+	return 0;
+    }
+    if (out) {
+	switched_out[tid] = tsc;
+	return 0;
+    }
+
+    auto was_out = switched_out.find(tid);
+    if (was_out == switched_out.end()) {
+	return 0;
+    }
+    uint64_t begin = was_out->second;
+    switched_out.erase(was_out);
+
+    bool within = false;
+    for (int idx : it->second) {
+	span& s = spans[idx];
+	uint64_t from = std::max(begin, s.begin);
+	uint64_t to = std::min(tsc, s.end);
+	if (from < to) {
+	    s.off_cpu += to - from;
+	    within = true;
+	}
+    }
+    *off_cpu_begin = begin;
+    return within;
+}
+
+int get_carry_span_count() {
+    return spans.size();
+}
+
+int get_carry_span_tid(int idx) {
+    return spans[idx].tid;
+}
+
+uint64_t get_carry_span_begin(int idx) {
+    return spans[idx].begin;
+}
+
+uint64_t get_carry_span_end(int idx) {
+    return spans[idx].end;
+}
+
+uint64_t get_carry_span_off_cpu(int idx) {
+    return spans[idx].off_cpu;
+}
+
+int get_carry_span_handoff(int idx) {
+    return spans[idx].handoff;
+}
+
+int get_carry_handoff_tid(int handoff) {
+    return handoffs[handoff].tid;
+}
+
+uint64_t get_carry_handoff_tsc(int handoff) {
+    return handoffs[handoff].tsc;
+}
@@ -0,0 +1,61 @@
+#ifndef __PROFILER_CARRY_HEADER__
+#define __PROFILER_CARRY_HEADER__
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+#define __API__ extern "C"
+#else
+#define __API__
+#endif
+
+/*
+ * Captures that follow their work across threads, for triggers with the
+ * carry policy.
+ *
+ * Such a capture records the whole process and the decoder keeps the
+ * branches of the threads that take part in it, while they do: the thread
+ * that started it until it ends, and every thread that joined it with a
+ * token, from carry_join() to carry_leave(). The token comes from
+ * carry_token() on a thread already taking part, when it hands a task over.
+ * The capture ends once the starting thread is done and every token it
+ * handed out has been left, or after carry_timeout_ms. Times are TSC.
+ */
+
+/* A capture starts on @origin_tid, @enabled if it carries. */
+__API__ void carry_begin(int origin_tid, int enabled);
+/* 0 unless the calling thread takes part in a carrying capture. */
+__API__ uint64_t carry_token(void);
+/* 1 if the calling thread joined the capture of @token */
+__API__ int carry_join(uint64_t token);
+__API__ void carry_leave(uint64_t token);
+/* The starting thread is done, returns the tokens that are still out. */
+__API__ int carry_origin_end(void);
+/* Waits for the tokens out, returns those still out after @timeout_ms. */
+__API__ int carry_wait(int timeout_ms);
+/* The record is over: later tokens are stale, spans still open end now. */
+__API__ void carry_end(void);
+
+/* For the decoder, once the capture is over. */
+__API__ int carry_enabled(void);
+/* 1 if the branch of @tid at @tsc belongs to the capture */
+__API__ int carry_includes(int tid, uint64_t tsc);
+/*
+ * A context switch of @tid at @tsc, @out if it was switched out. Returns 1
+ * at the end of an off-CPU interval within the capture, which started at
+ * *@off_cpu_begin.
+ */
+__API__ int carry_visit_switch(int tid, uint64_t tsc, int out, uint64_t* off_cpu_begin);
+
+/* the threads' stretches in the capture, the origin's first */
+__API__ int get_carry_span_count(void);
+__API__ int get_carry_span_tid(int idx);
+__API__ uint64_t get_carry_span_begin(int idx);
+__API__ uint64_t get_carry_span_end(int idx);
+__API__ uint64_t get_carry_span_off_cpu(int idx);
+/* the handoff the span was joined from, -1 for the origin */
+__API__ int get_carry_span_handoff(int idx);
+__API__ int get_carry_handoff_tid(int handoff);
+__API__ uint64_t get_carry_handoff_tsc(int handoff);
+
+#endif
@@ -0,0 +1,319 @@
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "profiler-hotpaths.hpp"
+
+namespace {
+    const int MAX_SEQUENCE_LEN = 8;
+    // the sequence table is pruned back to the leaders once it gets this big
+    const size_t MAX_SEQUENCES = 16384;
+    const size_t KEPT_SEQUENCES = 4096;
+    const int NO_NAME = -1;
+
+    struct cstr_hash {
+	size_t operator() (const char* s) const noexcept {
+	    size_t h = 14695981039346656037ULL;
+	    for (; *s; ++s) {
+		h = (h ^ (unsigned char) *s) * 1099511628211ULL;
+	    }
+	    return h;
+	}
+    };
+
+    struct cstr_equal {
+	bool operator() (const char* s1, const char* s2) const {
+	    return !strcmp(s1, s2);
+	}
+    };
+
+    std::deque<std::string> names;
+    std::unordered_map<const char*, int, cstr_hash, cstr_equal> name_ids;
+
+    int intern_name(const char* name) {
+	auto it = name_ids.find(name);
+	if (it != std::end(name_ids)) {
+	    return it->second;
+	}
+	int id = names.size();
+	names.emplace_back(name);
+	name_ids.emplace(names.back().c_str(), id);
+	return id;
+    }
+
+    const std::string& name_of(int id) {
+	static const std::string unknown("[unknown]");
+	return id == NO_NAME ? unknown : names[id];
+    }
+
+    struct path_stats {
+	const void* parent = nullptr;
+	int name = NO_NAME;
+	uint64_t inclusive_time = 0;
+	uint64_t children_time = 0;
+	uint64_t calls = 0;
+
+	uint64_t self_time() const {
+	    return inclusive_time > children_time ? inclusive_time - children_time : 0;
+	}
+    };
+
+    // keyed by call_path, which already shares prefixes between paths
+    std::unordered_map<const void*, path_stats> paths;
+
+    // calls that returned so far under one activation of a caller
+    struct call_window {
+	int len = 0;
+	int names[MAX_SEQUENCE_LEN];
+	uint64_t call_times[MAX_SEQUENCE_LEN];
+
+	void push(int name, uint64_t call_time, int max_len) {
+	    if (len == max_len) {
+		std::copy(names + 1, names + len, names);
+		std::copy(call_times + 1, call_times + len, call_times);
+		--len;
+	    }
+	    names[len] = name;
+	    call_times[len] = call_time;
+	    ++len;
+	}
+    };
+
+    // per thread, per caller path that has not returned yet
+    std::unordered_map<int, std::unordered_map<const void*, call_window>> activations;
+    int max_sequence_len = 3;
+
+    struct sequence_stats {
+	int len;
+	int names[MAX_SEQUENCE_LEN];
+	uint64_t count;
+	uint64_t time;
+    };
+
+    std::vector<sequence_stats> sequences;
+    // colliding sequences share a hash, count_sequence() tells them apart
+    std::unordered_multimap<uint64_t, int> sequence_by_hash;
+
+    uint64_t sequence_hash(const int* seq, int len) {
+	uint64_t h = 14695981039346656037ULL ^ len;
+	for (int i = 0; i < len; ++i) {
+	    h = (h ^ (uint64_t) (uint32_t) seq[i]) * 1099511628211ULL;
+	}
+	return h;
+    }
+
+    // keeps whatever leads by count or by time, the rest starts over
+    void prune_sequences() {
+	std::vector<int> by_count(sequences.size()), by_time(sequences.size());
+	for (size_t i = 0; i < sequences.size(); ++i) {
+	    by_count[i] = by_time[i] = i;
+	}
+	std::nth_element(std::begin(by_count), std::begin(by_count) + KEPT_SEQUENCES, std::end(by_count), [] (int s1, int s2) {
+		return sequences[s1].count > sequences[s2].count;
+	    });
+	std::nth_element(std::begin(by_time), std::begin(by_time) + KEPT_SEQUENCES, std::end(by_time), [] (int s1, int s2) {
+		return sequences[s1].time > sequences[s2].time;
+	    });
+
+	std::unordered_set<int> kept(std::begin(by_count), std::begin(by_count) + KEPT_SEQUENCES);
+	kept.insert(std::begin(by_time), std::begin(by_time) + KEPT_SEQUENCES);
+
+	std::vector<sequence_stats> leaders;
+	leaders.reserve(kept.size());
+	for (int idx : kept) {
+	    leaders.push_back(sequences[idx]);
+	}
+	sequences.swap(leaders);
+
+	sequence_by_hash.clear();
+	for (size_t i = 0; i < sequences.size(); ++i) {
+	    sequence_by_hash.emplace(sequence_hash(sequences[i].names, sequences[i].len), i);
+	}
+    }
+
+    void count_sequence(const int* seq, int len, uint64_t time) {
+	uint64_t h = sequence_hash(seq, len);
+	auto range = sequence_by_hash.equal_range(h);
+	for (auto it = range.first; it != range.second; ++it) {
+	    auto& s = sequences[it->second];
+	    if (s.len == len && std::equal(seq, seq + len, s.names)) {
+		s.count += 1;
+		s.time += time;
+		return;
+	    }
+	}
+
+	if (sequences.size() >= MAX_SEQUENCES) {
+	    prune_sequences();
+	}
+	sequence_stats s;
+	s.len = len;
+	std::copy(seq, seq + len, s.names);
+	s.count = 1;
+	s.time = time;
+	sequence_by_hash.emplace(h, sequences.size());
+	sequences.push_back(s);
+    }
+
+    struct hot_path {
+	std::string name;
+	uint64_t self_time;
+	uint64_t inclusive_time;
+	uint64_t calls;
+    };
+
+    struct hot_sequence {
+	std::string name;
+	uint64_t time;
+	uint64_t count;
+    };
+
+    std::vector<hot_path> hot_paths;
+    std::vector<hot_sequence> hot_sequences[2];
+
+    std::string path_name(const void* path) {
+	std::vector<int> frames;
+	for (auto it = paths.find(path); it != std::end(paths); it = paths.find(it->second.parent)) {
+	    frames.push_back(it->second.name);
+	    if (!it->second.parent) {
+		break;
+	    }
+	}
+
+	std::string name;
+	for (auto frame = frames.rbegin(); frame != frames.rend(); ++frame) {
+	    if (!name.empty()) {
+		name += " -> ";
+	    }
+	    name += name_of(*frame);
+	}
+	return name;
+    }
+
+    template <typename Less>
+    void rank_sequences(std::vector<hot_sequence>& ranked, int n, Less less) {
+	std::vector<int> order(sequences.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+	    order[i] = i;
+	}
+	size_t len = n > 0 ? std::min<size_t>(n, order.size()) : order.size();
+	std::partial_sort(std::begin(order), std::begin(order) + len, std::end(order), less);
+
+	ranked.clear();
+	for (size_t i = 0; i < len; ++i) {
+	    auto& s = sequences[order[i]];
+	    std::string name;
+	    for (int j = 0; j < s.len; ++j) {
+		if (j) {
+		    name += ", ";
+		}
+		name += name_of(s.names[j]);
+	    }
+	    ranked.push_back({ name, s.time, s.count });
+	}
+    }
+}
+
+void hot_paths_init(int max_len) {
+    max_sequence_len = std::max(2, std::min(max_len, MAX_SEQUENCE_LEN));
+    paths.clear();
+    activations.clear();
+    sequences.clear();
+    sequence_by_hash.clear();
+    hot_paths.clear();
+    hot_sequences[0].clear();
+    hot_sequences[1].clear();
+}
+
+void visit_hot_path_call(int tid, const void* path, const void* parent_path, const char* name, uint64_t call_time, uint64_t return_time) {
+    int name_id = intern_name(name);
+    uint64_t duration = return_time - call_time;
+
+    auto& stats = paths[path];
+    stats.parent = parent_path;
+    stats.name = name_id;
+    stats.inclusive_time += duration;
+    stats.calls += 1;
+    if (parent_path) {
+	paths[parent_path].children_time += duration;
+    }
+
+    auto& callers = activations[tid];
+    // whatever this call made has ended with it
+    callers.erase(path);
+    if (!parent_path) {
+	return;
+    }
+
+    auto& window = callers[parent_path];
+    window.push(name_id, call_time, max_sequence_len);
+    for (int len = 2; len <= window.len; ++len) {
+	int first = window.len - len;
+	count_sequence(window.names + first, len, return_time - window.call_times[first]);
+    }
+}
+
+void prepare_hot_paths(int n) {
+    std::vector<const void*> order;
+    order.reserve(paths.size());
+    for (auto& entry : paths) {
+	order.push_back(entry.first);
+    }
+    size_t len = n > 0 ? std::min<size_t>(n, order.size()) : order.size();
+    std::partial_sort(std::begin(order), std::begin(order) + len, std::end(order), [] (const void* p1, const void* p2) {
+	    return paths[p1].self_time() > paths[p2].self_time();
+	});
+
+    hot_paths.clear();
+    for (size_t i = 0; i < len; ++i) {
+	auto& stats = paths[order[i]];
+	hot_paths.push_back({ path_name(order[i]), stats.self_time(), stats.inclusive_time, stats.calls });
+    }
+
+    rank_sequences(hot_sequences[0], n, [] (int s1, int s2) {
+	    return sequences[s1].time > sequences[s2].time;
+	});
+    rank_sequences(hot_sequences[1], n, [] (int s1, int s2) {
+	    return sequences[s1].count > sequences[s2].count;
+	});
+}
+
+int get_hot_path_len() {
+    return hot_paths.size();
+}
+
+const char* get_hot_path_name(int idx) {
+    return hot_paths[idx].name.c_str();
+}
+
+uint64_t get_hot_path_self(int idx) {
+    return hot_paths[idx].self_time;
+}
+
+uint64_t get_hot_path_inclusive(int idx) {
+    return hot_paths[idx].inclusive_time;
+}
+
+uint64_t get_hot_path_calls(int idx) {
+    return hot_paths[idx].calls;
+}
+
+int get_hot_sequence_len(int by_count) {
+    return hot_sequences[!!by_count].size();
+}
+
+const char* get_hot_sequence_name(int by_count, int idx) {
+    return hot_sequences[!!by_count][idx].name.c_str();
+}
+
+uint64_t get_hot_sequence_time(int by_count, int idx) {
+    return hot_sequences[!!by_count][idx].time;
+}
+
+uint64_t get_hot_sequence_count(int by_count, int idx) {
+    return hot_sequences[!!by_count][idx].count;
+}
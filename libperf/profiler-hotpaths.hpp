@@ -0,0 +1,42 @@
+#ifndef __PROFILER_HOTPATHS_HEADER__
+#define __PROFILER_HOTPATHS_HEADER__
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+#define __API__ extern "C"
+#else
+#define __API__
+#endif
+
+/*
+ * Mines the call/return stream for the distinct call paths with the most
+ * self time and for call sequences that repeat under the same caller, such
+ * as serialize, copy, hash.
+ *
+ * Paths are the call_path nodes perf already deduplicates by prefix.
+ * Sequences are hashed incrementally per caller activation and kept in a
+ * table that is pruned back to the leaders whenever it outgrows its bound,
+ * so counts for rare sequences are approximate.
+ */
+/* also forgets what the previous capture saw */
+__API__ void hot_paths_init(int max_sequence_len);
+__API__ void visit_hot_path_call(int tid, const void* path, const void* parent_path, const char* name,
+				 uint64_t call_time, uint64_t return_time);
+
+/* Ranks the top @n paths by self time and sequences by time and count. */
+__API__ void prepare_hot_paths(int n);
+
+__API__ int get_hot_path_len(void);
+__API__ const char* get_hot_path_name(int idx);	/* "outer -> ... -> inner" */
+__API__ uint64_t get_hot_path_self(int idx);
+__API__ uint64_t get_hot_path_inclusive(int idx);
+__API__ uint64_t get_hot_path_calls(int idx);
+
+/* by_count selects the ranking by number of occurrences instead of time */
+__API__ int get_hot_sequence_len(int by_count);
+__API__ const char* get_hot_sequence_name(int by_count, int idx);	/* "first, second, ..." */
+__API__ uint64_t get_hot_sequence_time(int by_count, int idx);
+__API__ uint64_t get_hot_sequence_count(int by_count, int idx);
+
+#endif
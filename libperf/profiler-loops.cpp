@@ -0,0 +1,331 @@
+#include <cstring>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "profiler-loops.hpp"
+
+namespace {
+    // longer straight-line spans mean the trace skipped something
+    const uint64_t MAX_BLOCK_SIZE = 4096;
+    // loops left on the stack by calls that never returned are dropped
+    const size_t MAX_NESTED_LOOPS = 64;
+    const size_t MAX_BRANCHES_PER_METHOD = 16;
+
+    struct cstr_hash {
+	size_t operator() (const char* s) const noexcept {
+	    size_t h = 14695981039346656037ULL;
+	    for (; *s; ++s) {
+		h = (h ^ (unsigned char) *s) * 1099511628211ULL;
+	    }
+	    return h;
+	}
+    };
+
+    struct cstr_equal {
+	bool operator() (const char* s1, const char* s2) const {
+	    return !strcmp(s1, s2);
+	}
+    };
+
+    std::deque<std::string> names;
+    std::unordered_map<const char*, int, cstr_hash, cstr_equal> name_ids;
+
+    int intern_name(const char* name) {
+	auto it = name_ids.find(name);
+	if (it != std::end(name_ids)) {
+	    return it->second;
+	}
+	int id = names.size();
+	names.emplace_back(name);
+	name_ids.emplace(names.back().c_str(), id);
+	return id;
+    }
+
+    struct loop_stats {
+	uint64_t head;
+	uint64_t back_edge;
+	int method;
+	uint64_t runs = 0;
+	uint64_t iterations = 0;
+	uint64_t histogram[LOOP_HISTOGRAM_BUCKETS] = {};
+    };
+
+    struct branch_stats {
+	int method;
+	uint64_t taken = 0;
+    };
+
+    // ordered by back-edge address to find the ones a block falls through
+    std::map<uint64_t, int> loops_by_back_edge;
+    std::vector<loop_stats> loops;
+    std::unordered_map<uint64_t, branch_stats> branches;
+
+    struct active_loop {
+	int loop;
+	int depth;
+	uint64_t trips;
+    };
+
+    struct thread_state {
+	bool valid = false;
+	uint64_t last_target = 0;
+	int depth = 0;
+	std::vector<active_loop> loops;
+    };
+
+    std::unordered_map<int, thread_state> threads;
+
+    int histogram_bucket(uint64_t trips) {
+	int bucket = 0;
+	while (trips > 1 && bucket < LOOP_HISTOGRAM_BUCKETS - 1) {
+	    trips >>= 1;
+	    ++bucket;
+	}
+	return bucket;
+    }
+
+    void finish_run(int loop, uint64_t trips) {
+	auto& stats = loops[loop];
+	stats.runs += 1;
+	stats.iterations += trips;
+	stats.histogram[histogram_bucket(trips)] += 1;
+    }
+
+    // ends the runs nested inside @ts.loops[idx] and that one too
+    void finish_from(thread_state& ts, size_t idx) {
+	for (size_t i = idx; i < ts.loops.size(); ++i) {
+	    finish_run(ts.loops[i].loop, ts.loops[i].trips);
+	}
+	ts.loops.resize(idx);
+    }
+
+    // the innermost run of @loop in the current frame
+    int find_active(const thread_state& ts, int loop) {
+	for (int i = ts.loops.size() - 1; i >= 0 && ts.loops[i].depth == ts.depth; --i) {
+	    if (ts.loops[i].loop == loop) {
+		return i;
+	    }
+	}
+	return -1;
+    }
+
+    int loop_id(uint64_t head, uint64_t back_edge, const char* function) {
+	auto it = loops_by_back_edge.find(back_edge);
+	if (it != std::end(loops_by_back_edge)) {
+	    return it->second;
+	}
+	int id = loops.size();
+	loops.emplace_back();
+	loops.back().head = head;
+	loops.back().back_edge = back_edge;
+	loops.back().method = intern_name(function);
+	loops_by_back_edge.emplace(back_edge, id);
+	return id;
+    }
+
+    // back-edges inside [start, end) were not taken
+    void fall_through(thread_state& ts, uint64_t start, uint64_t end) {
+	for (auto it = loops_by_back_edge.lower_bound(start); it != std::end(loops_by_back_edge) && it->first < end; ++it) {
+	    int active = find_active(ts, it->second);
+	    if (active >= 0) {
+		finish_from(ts, active);
+	    } else {
+		// the body ran once without looping
+		finish_run(it->second, 1);
+	    }
+	}
+    }
+
+    void jump(thread_state& ts, uint64_t from, uint64_t to, const char* function) {
+	// leaving the [head, back-edge] range ends the run
+	while (!ts.loops.empty() && ts.loops.back().depth == ts.depth) {
+	    auto& stats = loops[ts.loops.back().loop];
+	    if (to >= stats.head && to <= stats.back_edge) {
+		break;
+	    }
+	    finish_from(ts, ts.loops.size() - 1);
+	}
+
+	if (to > from) {
+	    return;
+	}
+
+	int loop = loop_id(to, from, function);
+	int active = find_active(ts, loop);
+	if (active >= 0) {
+	    finish_from(ts, active + 1);
+	    ts.loops[active].trips += 1;
+	    return;
+	}
+
+	if (ts.loops.size() == MAX_NESTED_LOOPS) {
+	    ts.loops.erase(std::begin(ts.loops));
+	}
+	ts.loops.push_back({ loop, ts.depth, 2 });
+    }
+
+    struct method_row {
+	int method;
+	uint64_t weight = 0;
+	std::vector<int> loops;
+	std::vector<uint64_t> branch_ips;
+	std::vector<uint64_t> branch_taken;
+	std::vector<uint64_t> branch_not_taken;
+    };
+
+    std::vector<method_row> methods;
+}
+
+int loop_stats_visit_branch(int tid, uint64_t from, uint64_t to, int kind, const char* function, uint64_t* block_start) {
+    auto& ts = threads[tid];
+
+    if (kind == BRANCH_OTHER) {
+	// runs cut by a gap in the trace have unknown trip counts
+	ts.valid = false;
+	ts.loops.clear();
+	return 0;
+    }
+
+    bool has_block = ts.valid && ts.last_target <= from && from - ts.last_target < MAX_BLOCK_SIZE;
+    if (has_block) {
+	*block_start = ts.last_target;
+	fall_through(ts, ts.last_target, from);
+    }
+
+    switch (kind) {
+    case BRANCH_CALL:
+	ts.depth += 1;
+	break;
+    case BRANCH_RETURN:
+	while (!ts.loops.empty() && ts.loops.back().depth >= ts.depth) {
+	    finish_from(ts, ts.loops.size() - 1);
+	}
+	ts.depth -= 1;
+	break;
+    case BRANCH_CONDITIONAL: {
+	auto it = branches.find(from);
+	if (it == std::end(branches)) {
+	    it = branches.emplace(from, branch_stats()).first;
+	    it->second.method = intern_name(function);
+	}
+	it->second.taken += 1;
+	jump(ts, from, to, function);
+	break;
+    }
+    default:
+	jump(ts, from, to, function);
+	break;
+    }
+
+    ts.valid = true;
+    ts.last_target = to;
+    return has_block;
+}
+
+void reset_loop_stats() {
+    loops_by_back_edge.clear();
+    loops.clear();
+    branches.clear();
+    threads.clear();
+    methods.clear();
+}
+
+void prepare_loop_stats(int n, uint64_t (*executions)(uint64_t ip, void* data), void* data) {
+    std::unordered_map<int, method_row> rows;
+
+    for (size_t i = 0; i < loops.size(); ++i) {
+	auto& row = rows[loops[i].method];
+	row.method = loops[i].method;
+	row.weight += loops[i].iterations;
+	row.loops.push_back(i);
+    }
+
+    std::unordered_map<int, std::vector<std::pair<uint64_t, uint64_t>>> method_branches;
+    for (auto& branch : branches) {
+	uint64_t runs = std::max(executions(branch.first, data), branch.second.taken);
+	auto& row = rows[branch.second.method];
+	row.method = branch.second.method;
+	row.weight += runs;
+	method_branches[branch.second.method].emplace_back(runs, branch.first);
+    }
+
+    methods.clear();
+    for (auto& entry : rows) {
+	methods.push_back(std::move(entry.second));
+    }
+    size_t len = n > 0 ? std::min<size_t>(n, methods.size()) : methods.size();
+    std::partial_sort(std::begin(methods), std::begin(methods) + len, std::end(methods), [] (const method_row& m1, const method_row& m2) {
+	    return m1.weight > m2.weight;
+	});
+    methods.resize(len);
+
+    for (auto& row : methods) {
+	std::sort(std::begin(row.loops), std::end(row.loops), [] (int l1, int l2) {
+		return loops[l1].iterations > loops[l2].iterations;
+	    });
+
+	auto& sites = method_branches[row.method];
+	size_t sites_len = std::min(MAX_BRANCHES_PER_METHOD, sites.size());
+	std::partial_sort(std::begin(sites), std::begin(sites) + sites_len, std::end(sites), [] (const std::pair<uint64_t, uint64_t>& s1, const std::pair<uint64_t, uint64_t>& s2) {
+		return s1.first > s2.first;
+	    });
+	for (size_t i = 0; i < sites_len; ++i) {
+	    uint64_t taken = branches[sites[i].second].taken;
+	    row.branch_ips.push_back(sites[i].second);
+	    row.branch_taken.push_back(taken);
+	    row.branch_not_taken.push_back(sites[i].first - taken);
+	}
+    }
+}
+
+int get_loop_method_len() {
+    return methods.size();
+}
+
+const char* get_loop_method_name(int method) {
+    return names[methods[method].method].c_str();
+}
+
+int get_method_loop_len(int method) {
+    return methods[method].loops.size();
+}
+
+uint64_t get_method_loop_head(int method, int idx) {
+    return loops[methods[method].loops[idx]].head;
+}
+
+uint64_t get_method_loop_back_edge(int method, int idx) {
+    return loops[methods[method].loops[idx]].back_edge;
+}
+
+uint64_t get_method_loop_runs(int method, int idx) {
+    return loops[methods[method].loops[idx]].runs;
+}
+
+uint64_t get_method_loop_iterations(int method, int idx) {
+    return loops[methods[method].loops[idx]].iterations;
+}
+
+uint64_t get_method_loop_histogram(int method, int idx, int bucket) {
+    return loops[methods[method].loops[idx]].histogram[bucket];
+}
+
+int get_method_branch_len(int method) {
+    return methods[method].branch_ips.size();
+}
+
+uint64_t get_method_branch_ip(int method, int idx) {
+    return methods[method].branch_ips[idx];
+}
+
+uint64_t get_method_branch_taken(int method, int idx) {
+    return methods[method].branch_taken[idx];
+}
+
+uint64_t get_method_branch_not_taken(int method, int idx) {
+    return methods[method].branch_not_taken[idx];
+}
@@ -0,0 +1,64 @@
+#ifndef __PROFILER_LOOPS_HEADER__
+#define __PROFILER_LOOPS_HEADER__
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+#define __API__ extern "C"
+#else
+#define __API__
+#endif
+
+enum branch_kind {
+    BRANCH_JUMP,
+    BRANCH_CONDITIONAL,
+    BRANCH_CALL,
+    BRANCH_RETURN,
+    BRANCH_OTHER,	/* interrupts, syscalls and trace gaps */
+};
+
+/* trip count histogram buckets: [1], [2, 3], [4, 7], ... the last is open */
+#define LOOP_HISTOGRAM_BUCKETS 16
+
+/*
+ * Branch direction and loop trip count statistics from the taken branches
+ * of the PT trace.
+ *
+ * Loops are found from back-edges, taken jumps to a lower address. A run of
+ * a loop ends when its back-edge falls through, when it jumps out of the
+ * [head, back-edge] range or when its function returns, so every run adds
+ * one trip count to the histogram. Runs before the back-edge was first seen
+ * taken are not counted.
+ *
+ * Returns 1 and stores the start of the straight-line code that ran right
+ * before this branch in @block_start, so that the caller can account the
+ * block [*block_start, from] in block-range, 0 after a gap in the trace.
+ */
+__API__ int loop_stats_visit_branch(int tid, uint64_t from, uint64_t to, int kind,
+				    const char* function, uint64_t* block_start);
+
+__API__ void reset_loop_stats(void);
+
+/*
+ * Ranks the @n methods with the most branch executions and loop iterations.
+ * @executions tells how many times the branch at @ip ran, either way.
+ */
+__API__ void prepare_loop_stats(int n, uint64_t (*executions)(uint64_t ip, void* data), void* data);
+
+__API__ int get_loop_method_len(void);
+__API__ const char* get_loop_method_name(int method);
+
+__API__ int get_method_loop_len(int method);
+__API__ uint64_t get_method_loop_head(int method, int idx);
+__API__ uint64_t get_method_loop_back_edge(int method, int idx);
+__API__ uint64_t get_method_loop_runs(int method, int idx);
+__API__ uint64_t get_method_loop_iterations(int method, int idx);
+__API__ uint64_t get_method_loop_histogram(int method, int idx, int bucket);
+
+/* the most executed conditional branches of the method */
+__API__ int get_method_branch_len(int method);
+__API__ uint64_t get_method_branch_ip(int method, int idx);
+__API__ uint64_t get_method_branch_taken(int method, int idx);
+__API__ uint64_t get_method_branch_not_taken(int method, int idx);
+
+#endif
@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <cpuid.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "profiler-markers.hpp"
+
+namespace {
+    const int MAX_LOGGED_MARKERS = 1 << 16;
+    const char* PTW_FORMAT = "/sys/bus/event_source/devices/intel_pt/format/ptw";
+
+    bool detect_ptwrite() {
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid_max(0, nullptr) < 0x14) {
+	    return false;
+	}
+	// CPUID.(EAX=14H, ECX=0):EBX[4] is PTWRITE
+	__cpuid_count(0x14, 0, eax, ebx, ecx, edx);
+	return (ebx & (1 << 4)) && !access(PTW_FORMAT, F_OK);
+    }
+
+    const bool ptwrite_supported = detect_ptwrite();
+
+    struct logged_marker {
+	uint64_t tsc;
+	int tid;
+	uint64_t id;
+    };
+
+    logged_marker marker_log[MAX_LOGGED_MARKERS];
+    std::atomic<int> marker_log_len(0);
+    std::atomic<bool> marker_log_on(false);
+
+    std::mutex names_mutex;
+    std::map<uint64_t, std::string> names;
+
+    int current_tid() {
+	thread_local int tid = syscall(SYS_gettid);
+	return tid;
+    }
+
+    void log_marker(uint64_t id) {
+	int idx = marker_log_len.fetch_add(1, std::memory_order_relaxed);
+	if (idx < MAX_LOGGED_MARKERS) {
+	    marker_log[idx] = { __builtin_ia32_rdtsc(), current_tid(), id };
+	}
+    }
+}
+
+void mark(uint64_t id) {
+    if (ptwrite_supported) {
+	// ptwrite %rax, spelled out for assemblers that don't know it
+	asm volatile(".byte 0xf3, 0x48, 0x0f, 0xae, 0xe0" : : "a" (id));
+    } else if (marker_log_on.load(std::memory_order_relaxed)) {
+	log_marker(id);
+    }
+}
+
+void name_marker(uint64_t id, const char* name) {
+    std::lock_guard<std::mutex> lock(names_mutex);
+    names[id] = name;
+}
+
+const char* get_marker_name(uint64_t id) {
+    std::lock_guard<std::mutex> lock(names_mutex);
+    auto it = names.find(id);
+    // map nodes stay put, the name is only replaced by name_marker()
+    return it != std::end(names) ? it->second.c_str() : nullptr;
+}
+
+int markers_use_ptwrite() {
+    return ptwrite_supported;
+}
+
+void marker_log_begin() {
+    marker_log_len.store(0, std::memory_order_relaxed);
+    marker_log_on.store(true, std::memory_order_release);
+}
+
+void marker_log_end() {
+    marker_log_on.store(false, std::memory_order_release);
+}
+
+int get_logged_marker_count() {
+    return std::min(marker_log_len.load(std::memory_order_acquire), MAX_LOGGED_MARKERS);
+}
+
+uint64_t get_logged_marker_tsc(int idx) {
+    return marker_log[idx].tsc;
+}
+
+int get_logged_marker_tid(int idx) {
+    return marker_log[idx].tid;
+}
+
+uint64_t get_logged_marker_id(int idx) {
+    return marker_log[idx].id;
+}
@@ -0,0 +1,41 @@
+#ifndef __PROFILER_MARKERS_HEADER__
+#define __PROFILER_MARKERS_HEADER__
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+#define __API__ extern "C"
+#else
+#define __API__
+#endif
+
+/*
+ * Phase markers put into the trace by the profiled code.
+ *
+ * mark() executes PTWRITE with the marker id when both the CPU and the
+ * intel_pt PMU support it, which costs a few cycles and shows up in the
+ * trace as a ptwrite packet. Otherwise markers go to a TSC-stamped log that
+ * is merged with the trace when it is decoded; the log is only on while a
+ * capture is recorded, outside of it mark() is a load and a branch.
+ */
+__API__ void mark(uint64_t id);
+
+/* Names the phase started by marker @id in the reports. */
+__API__ void name_marker(uint64_t id, const char* name);
+/* NULL for markers without a name */
+__API__ const char* get_marker_name(uint64_t id);
+
+/* 1 if markers are PTWRITE packets, the event must be recorded with ptw */
+__API__ int markers_use_ptwrite(void);
+
+/* Clears the fallback log and turns it on for the next recording. */
+__API__ void marker_log_begin(void);
+__API__ void marker_log_end(void);
+
+/* the fallback log of the last recording, in the order of mark() calls */
+__API__ int get_logged_marker_count(void);
+__API__ uint64_t get_logged_marker_tsc(int idx);
+__API__ int get_logged_marker_tid(int idx);
+__API__ uint64_t get_logged_marker_id(int idx);
+
+#endif
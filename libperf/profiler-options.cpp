@@ -0,0 +1,108 @@
+#include "profiler-options.hpp"
+#include "profiler-timeline.hpp"
+#include "profiler-report.hpp"
+
+#include <cstdlib>
+#include <string>
+#include <sstream>
+
+namespace {
+    profiler_options options = {
+	0,	/* call_tree */
+	1.0,	/* call_tree_min_pct */
+	100,	/* top */
+	nullptr,	/* timeline */
+	TIMELINE_CHROME,	/* timeline_format */
+	nullptr,	/* profile */
+	nullptr,	/* folded */
+	0,	/* folded_cycles */
+	0,	/* text_dump */
+	nullptr,	/* decoded */
+	nullptr,	/* report_dir */
+	REPORT_JSON | REPORT_CSV,	/* report_formats */
+	0,	/* hot_paths */
+	3,	/* hot_sequence_len */
+	0,	/* loops */
+	1000,	/* warmup_quiet_ms */
+	0,	/* warmup_compiles */
+	1000,	/* carry_timeout_ms */
+    };
+    std::string timeline_path;
+    std::string profile_path;
+    std::string folded_path;
+    std::string decoded_path;
+    std::string report_dir;
+
+    bool ends_with(const std::string& str, const std::string& suffix) {
+	return str.size() >= suffix.size() && !str.compare(str.size() - suffix.size(), suffix.size(), suffix);
+    }
+
+    void set_option(const std::string& key, const std::string& value) {
+	if (key == "calltree") {
+	    options.call_tree = 1;
+	} else if (key == "calltree_min_pct") {
+	    options.call_tree_min_pct = atof(value.c_str());
+	} else if (key == "top") {
+	    options.top = atoi(value.c_str());
+	} else if (key == "timeline") {
+	    timeline_path = value;
+	    options.timeline = timeline_path.c_str();
+	    if (ends_with(value, ".pftrace") || ends_with(value, ".perfetto-trace")) {
+		options.timeline_format = TIMELINE_PERFETTO;
+	    }
+	} else if (key == "timeline_format") {
+	    options.timeline_format = value == "perfetto" ? TIMELINE_PERFETTO : TIMELINE_CHROME;
+	} else if (key == "profile") {
+	    profile_path = value;
+	    options.profile = profile_path.c_str();
+	} else if (key == "folded") {
+	    folded_path = value;
+	    options.folded = folded_path.c_str();
+	} else if (key == "folded_weight") {
+	    options.folded_cycles = value == "cycles";
+	} else if (key == "textdump") {
+	    options.text_dump = 1;
+	} else if (key == "decoded") {
+	    decoded_path = value;
+	    options.decoded = decoded_path.c_str();
+	} else if (key == "report_dir") {
+	    report_dir = value;
+	    options.report_dir = report_dir.c_str();
+	} else if (key == "report_format") {
+	    options.report_formats = value == "json" ? REPORT_JSON : value == "csv" ? REPORT_CSV : REPORT_JSON | REPORT_CSV;
+	} else if (key == "hotpaths") {
+	    options.hot_paths = value.empty() ? 20 : atoi(value.c_str());
+	} else if (key == "hotpaths_seq") {
+	    options.hot_sequence_len = atoi(value.c_str());
+	} else if (key == "loops") {
+	    options.loops = value.empty() ? 10 : atoi(value.c_str());
+	} else if (key == "warmup_quiet_ms") {
+	    options.warmup_quiet_ms = atoi(value.c_str());
+	} else if (key == "warmup_compiles") {
+	    options.warmup_compiles = atoi(value.c_str());
+	} else if (key == "carry_timeout_ms") {
+	    options.carry_timeout_ms = atoi(value.c_str());
+	}
+    }
+}
+
+void parse_profiler_options(const char* opts) {
+    if (!opts) {
+	return;
+    }
+
+    std::istringstream tokens(opts);
+    std::string token;
+    while (std::getline(tokens, token, ',')) {
+	auto eq = token.find('=');
+	if (eq == std::string::npos) {
+	    set_option(token, "");
+	} else {
+	    set_option(token.substr(0, eq), token.substr(eq + 1));
+	}
+    }
+}
+
+const profiler_options* get_profiler_options() {
+    return &options;
+}
@@ -0,0 +1,39 @@
+#if !defined(__PROFILER_OPTIONS_HPP__)
+#define __PROFILER_OPTIONS_HPP__
+
+#if defined(__cplusplus)
+#define __API__ extern "C"
+#else
+#define __API__
+#endif
+
+/*
+ * Profiler settings passed along with the JVMTI agent options, e.g.
+ * -agentlib:perf=unfoldall,calltree,calltree_min_pct=0.5,timeline=/tmp/run.pftrace
+ * Keys the profiler does not know about belong to the agent and are skipped.
+ */
+struct profiler_options {
+    int call_tree;		/* calltree: build a call tree from the call/return stream */
+    double call_tree_min_pct;	/* calltree_min_pct=: hide subtrees below this share of the total */
+    int top;			/* top=: routines to report, 0 for all of them */
+    const char* timeline;	/* timeline=: file to stream every call to, NULL if off */
+    int timeline_format;	/* timeline_format=chrome|perfetto, see profiler-timeline.hpp */
+    const char* profile;	/* profile=: file to save the aggregated profile to, NULL if off */
+    const char* folded;		/* folded=: file to write folded stacks to, NULL if off */
+    int folded_cycles;		/* folded_weight=ns|cycles: weight stacks by TSC cycles instead of ns */
+    int text_dump;		/* textdump: also format every sample into perf.data.log */
+    const char* decoded;	/* decoded=: file to keep the decoded branches in, NULL if off */
+    const char* report_dir;	/* report_dir=: directory for JSON/CSV reports, NULL if off */
+    int report_formats;		/* report_format=json|csv|all, see profiler-report.hpp */
+    int hot_paths;		/* hotpaths=: hot call paths and sequences to report, 0 if off */
+    int hot_sequence_len;	/* hotpaths_seq=: longest call sequence to mine, 2 to 8 */
+    int loops;			/* loops=: methods to report loop and branch statistics for, 0 if off */
+    int warmup_quiet_ms;	/* warmup_quiet_ms=: compilation must be quiet this long to arm countdown=auto triggers */
+    int warmup_compiles;	/* warmup_compiles=: compilations of a method up to the top tier, 0 to tell from the JVM flags */
+    int carry_timeout_ms;	/* carry_timeout_ms=: longest wait for carried work after the capturing invocation ends */
+};
+
+__API__ void parse_profiler_options(const char* options);
+__API__ const struct profiler_options* get_profiler_options(void);
+
+#endif
@@ -0,0 +1,392 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <time.h>
+
+#include "profiler-policy.hpp"
+
+namespace {
+    const int MAX_COUNTDOWN = 1 << 24;
+
+    enum exit_filter {
+	EXIT_ANY,
+	EXIT_THREW,
+	EXIT_RETURNED,
+    };
+
+    enum policy_kind {
+	POLICY_EVERY,
+	POLICY_POISSON,
+	POLICY_RESERVOIR,
+    };
+
+    struct policy {
+	policy_kind kind = POLICY_EVERY;
+	int every = 1;
+	double mean_ms = 0;
+	int reservoir_size = 0;
+	int64_t window_ms = 0;
+	int max_captures = 1;		// 0 for no limit
+	double max_cpu_pct = 0;		// 0 for no limit
+	exit_filter exit = EXIT_ANY;
+	bool carry = false;
+
+	int captures = 0;
+	int skipped = 0;
+	uint64_t spent_ns = 0;
+	int64_t since_ms = 0;
+
+	// the countdown the instrumented code is running, and since when
+	int handed = 0;
+	int64_t handed_ms = 0;
+	double calls_per_ms = 0;
+
+	// poisson
+	int64_t next_ms = 0;
+
+	// reservoir: invocations seen in this window, the count of the last one
+	int64_t window_end_ms = 0;
+	int64_t seen = 0;
+	int64_t window_count = -1;
+	std::vector<int64_t> picks;
+	size_t next_pick = 0;
+
+	std::mt19937_64 rng;
+    };
+
+    std::mutex policies_mutex;
+    std::map<int, policy> policies;
+
+    int64_t now_ms() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    // 500ms, 30s, 5m, 1h; a bare number is ms. -1 if malformed
+    int64_t parse_duration(const std::string& value) {
+	char* unit;
+	double n = strtod(value.c_str(), &unit);
+	std::string u(unit);
+	double scale = u == "" || u == "ms" ? 1 : u == "s" ? 1000 : u == "m" ? 60000 : u == "h" ? 3600000 : -1;
+	if (unit == value.c_str() || scale < 0 || n <= 0) {
+	    return -1;
+	}
+	return (int64_t)(n * scale);
+    }
+
+    bool parse_int(const std::string& value, int* n) {
+	char* end;
+	long v = strtol(value.c_str(), &end, 10);
+	if (end == value.c_str() || *end || v < 0 || v > MAX_COUNTDOWN) {
+	    return false;
+	}
+	*n = (int)v;
+	return true;
+    }
+
+    bool parse_policy(policy& p, const char* spec) {
+	std::istringstream tokens(spec);
+	std::string token;
+	bool has_policy = false;
+	bool has_captures = false;
+	bool has_max_cpu = false;
+	bool has_exit = false;
+
+	while (tokens >> token) {
+	    if (token == "carry") {
+		p.carry = true;
+		continue;
+	    }
+	    auto eq = token.find('=');
+	    if (eq == std::string::npos) {
+		return false;
+	    }
+	    std::string key = token.substr(0, eq);
+	    std::string value = token.substr(eq + 1);
+
+	    if (key == "every") {
+		if (!parse_int(value, &p.every) || p.every < 1) {
+		    return false;
+		}
+		p.kind = POLICY_EVERY;
+		has_policy = true;
+	    } else if (key == "poisson") {
+		int64_t mean = parse_duration(value);
+		if (mean < 0) {
+		    return false;
+		}
+		p.mean_ms = mean;
+		p.kind = POLICY_POISSON;
+		has_policy = true;
+	    } else if (key == "reservoir") {
+		auto slash = value.find('/');
+		if (slash == std::string::npos || !parse_int(value.substr(0, slash), &p.reservoir_size)
+		    || p.reservoir_size < 1 || (p.window_ms = parse_duration(value.substr(slash + 1))) < 0) {
+		    return false;
+		}
+		p.kind = POLICY_RESERVOIR;
+		has_policy = true;
+	    } else if (key == "captures") {
+		if (!parse_int(value, &p.max_captures)) {
+		    return false;
+		}
+		has_captures = true;
+	    } else if (key == "exit") {
+		if (value == "threw") {
+		    p.exit = EXIT_THREW;
+		} else if (value == "returned") {
+		    p.exit = EXIT_RETURNED;
+		} else if (value == "any") {
+		    p.exit = EXIT_ANY;
+		} else {
+		    return false;
+		}
+		has_exit = true;
+	    } else if (key == "max_cpu") {
+		p.max_cpu_pct = atof(value.c_str());
+		if (p.max_cpu_pct < 0) {
+		    return false;
+		}
+		has_max_cpu = true;
+	    } else {
+		return false;
+	    }
+	}
+
+	if (has_policy && !has_captures) {
+	    p.max_captures = 0;
+	}
+	// dropped captures cost as much as the kept ones
+	if ((has_policy || has_exit) && !has_max_cpu) {
+	    p.max_cpu_pct = 1;
+	}
+	return true;
+    }
+
+    // the countdown that ran out ended with this invocation
+    void account(policy& p, int64_t now) {
+	if (p.handed > 0) {
+	    double rate = p.handed / (double)std::max<int64_t>(now - p.handed_ms, 1);
+	    p.calls_per_ms = p.calls_per_ms > 0 ? (p.calls_per_ms + rate) / 2 : rate;
+	    p.seen += p.handed;
+	}
+	p.handed = 0;
+    }
+
+    int hand_out(policy& p, int64_t now, int64_t countdown) {
+	p.handed = (int)std::min<int64_t>(std::max<int64_t>(countdown, 1), MAX_COUNTDOWN);
+	p.handed_ms = now;
+	return p.handed;
+    }
+
+    // half of the invocations expected until @when, so that it's not overshot by much
+    int64_t countdown_until(const policy& p, int64_t now, int64_t when) {
+	return (int64_t)(p.calls_per_ms * (when - now) / 2);
+    }
+
+    void draw_poisson(policy& p, int64_t now) {
+	std::exponential_distribution<double> interval(1.0 / p.mean_ms);
+	p.next_ms = now + (int64_t)interval(p.rng);
+    }
+
+    // K distinct invocations of the last window's count, Floyd's sampling
+    void draw_reservoir(policy& p) {
+	std::set<int64_t> picks;
+	int64_t n = p.window_count;
+	for (int64_t j = std::max<int64_t>(n - p.reservoir_size, 0) + 1; j <= n; ++j) {
+	    int64_t pick = std::uniform_int_distribution<int64_t>(1, j)(p.rng);
+	    picks.insert(picks.count(pick) ? j : pick);
+	}
+	p.picks.assign(picks.begin(), picks.end());
+	p.next_pick = 0;
+    }
+
+    void roll_window(policy& p, int64_t now) {
+	// the first window has nothing to draw from, it only counts
+	p.window_count = p.window_end_ms ? p.seen : -1;
+	p.seen = 0;
+	p.window_end_ms = now + p.window_ms;
+	p.picks.clear();
+	p.next_pick = 0;
+	if (p.window_count > 0) {
+	    draw_reservoir(p);
+	}
+    }
+
+    bool exhausted(const policy& p) {
+	return p.max_captures && p.captures >= p.max_captures;
+    }
+
+    bool over_budget(const policy& p, int64_t now) {
+	if (p.max_cpu_pct <= 0) {
+	    return false;
+	}
+	double allowance_ns = (now - p.since_ms) * 1e6 * p.max_cpu_pct / 100;
+	return p.spent_ns > allowance_ns;
+    }
+}
+
+int set_capture_policy(int id, int countdown, const char* spec) {
+    policy p;
+    int err = 0;
+    if (spec && !parse_policy(p, spec)) {
+	printf("Bad capture policy '%s' for trigger %d, taking one capture\n", spec, id);
+	p = policy();
+	err = -EINVAL;
+    }
+
+    int64_t now = now_ms();
+    p.rng.seed(std::random_device()() ^ (uint64_t)id);
+    p.since_ms = now;
+    hand_out(p, now, countdown);
+    if (p.kind == POLICY_POISSON) {
+	draw_poisson(p, now);
+    } else if (p.kind == POLICY_RESERVOIR) {
+	roll_window(p, now);
+    }
+
+    std::lock_guard<std::mutex> lock(policies_mutex);
+    policies[id] = p;
+    return err;
+}
+
+int capture_due(int id) {
+    std::lock_guard<std::mutex> lock(policies_mutex);
+    auto it = policies.find(id);
+    if (it == policies.end()) {
+	return 0;
+    }
+    policy& p = it->second;
+    int64_t now = now_ms();
+    account(p, now);
+    if (exhausted(p)) {
+	return 0;
+    }
+
+    switch (p.kind) {
+    case POLICY_EVERY:
+	break;
+    case POLICY_POISSON:
+	if (now < p.next_ms) {
+	    return 0;
+	}
+	draw_poisson(p, now);
+	break;
+    case POLICY_RESERVOIR:
+	if (now >= p.window_end_ms) {
+	    roll_window(p, now);
+	}
+	if (p.next_pick == p.picks.size() || p.seen < p.picks[p.next_pick]) {
+	    return 0;
+	}
+	++p.next_pick;
+	break;
+    }
+
+    if (over_budget(p, now)) {
+	++p.skipped;
+	return 0;
+    }
+
+    ++p.captures;
+    if (p.skipped) {
+	printf("Trigger %d: capture %d, %d skipped over max_cpu=%g\n", id, p.captures, p.skipped, p.max_cpu_pct);
+    }
+    return 1;
+}
+
+int capture_hold(int id, int countdown) {
+    std::lock_guard<std::mutex> lock(policies_mutex);
+    auto it = policies.find(id);
+    if (it == policies.end()) {
+	return countdown;
+    }
+    int64_t now = now_ms();
+    account(it->second, now);
+    return hand_out(it->second, now, countdown);
+}
+
+int capture_next_countdown(int id) {
+    std::lock_guard<std::mutex> lock(policies_mutex);
+    auto it = policies.find(id);
+    if (it == policies.end()) {
+	return 0;
+    }
+    policy& p = it->second;
+    if (exhausted(p)) {
+	return 0;
+    }
+
+    int64_t now = now_ms();
+    switch (p.kind) {
+    case POLICY_EVERY:
+	return hand_out(p, now, p.every);
+    case POLICY_POISSON:
+	return hand_out(p, now, countdown_until(p, now, p.next_ms));
+    case POLICY_RESERVOIR:
+    default:
+	int64_t countdown = countdown_until(p, now, p.window_end_ms);
+	if (p.next_pick < p.picks.size()) {
+	    countdown = std::min(countdown, p.picks[p.next_pick] - p.seen);
+	}
+	return hand_out(p, now, countdown);
+    }
+}
+
+int capture_exit_wanted(int id, int threw) {
+    std::lock_guard<std::mutex> lock(policies_mutex);
+    auto it = policies.find(id);
+    if (it == policies.end()) {
+	return 1;
+    }
+    policy& p = it->second;
+    if (p.exit == EXIT_ANY || (p.exit == EXIT_THREW) == !!threw) {
+	return 1;
+    }
+    --p.captures;
+    return 0;
+}
+
+int capture_carries(int id) {
+    std::lock_guard<std::mutex> lock(policies_mutex);
+    auto it = policies.find(id);
+    return it != policies.end() && it->second.carry;
+}
+
+int capture_exhausted(int id) {
+    std::lock_guard<std::mutex> lock(policies_mutex);
+    auto it = policies.find(id);
+    return it == policies.end() || exhausted(it->second);
+}
+
+void capture_cost(int id, uint64_t cpu_ns) {
+    std::lock_guard<std::mutex> lock(policies_mutex);
+    auto it = policies.find(id);
+    if (it != policies.end()) {
+	it->second.spent_ns += cpu_ns;
+    }
+}
+
+int get_capture_number(int id) {
+    std::lock_guard<std::mutex> lock(policies_mutex);
+    auto it = policies.find(id);
+    if (it == policies.end() || it->second.max_captures == 1) {
+	return 0;
+    }
+    return it->second.captures;
+}
+
+void reset_capture_policies() {
+    std::lock_guard<std::mutex> lock(policies_mutex);
+    policies.clear();
+}
@@ -0,0 +1,69 @@
+#ifndef __PROFILER_POLICY_HEADER__
+#define __PROFILER_POLICY_HEADER__
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+#define __API__ extern "C"
+#else
+#define __API__
+#endif
+
+/*
+ * When a trigger takes its captures, from the policy of its line in the
+ * triggers file:
+ *
+ *   (none)          one capture, on the countdown-th invocation
+ *   every=N         every N-th invocation, the first on the countdown-th
+ *   poisson=T       at the first invocation after random moments T apart
+ *                   on average (a Poisson process), T as 500ms, 30s, 5m, 1h
+ *   reservoir=K/W   K invocations drawn uniformly from every window W; the
+ *                   draw needs the number of invocations per window, which
+ *                   is taken from the window before, so the first window
+ *                   only counts
+ *   captures=M      stop after M captures, unlimited by default with a
+ *                   policy
+ *   max_cpu=P       skip the captures that would take the recorder above
+ *                   P% of one CPU since the trigger was registered, 1 by
+ *                   default with a policy or exit=, 0 for no limit
+ *   exit=threw      only keep captures of invocations that threw, or that
+ *   exit=returned   returned; the exit is only known at the end, so the
+ *                   others are recorded, then dropped before decoding and
+ *                   don't count as captures
+ *   carry           follow the invocation's work to the threads it hands
+ *                   it to, see profiler-carry.hpp; records the whole
+ *                   process
+ *
+ * The instrumented code counts invocations down and only calls start() once
+ * the countdown is over, so the time based policies hand out countdowns
+ * from the invocation rate: half of the invocations expected until the
+ * moment is due, then half of the rest, and so on.
+ */
+
+/* @countdown is the first countdown, @spec the policy, NULL for none; 0 or -EINVAL */
+__API__ int set_capture_policy(int id, int countdown, const char* spec);
+/*
+ * Called once the countdown of @id is over and the recorder is free:
+ * returns 1 if this invocation is to be captured, which counts as a capture.
+ */
+__API__ int capture_due(int id);
+/* Hands out a countdown of @countdown invocations regardless of the policy. */
+__API__ int capture_hold(int id, int countdown);
+/* Hands out the countdown to the next capture_due(), 0 once the policy is done. */
+__API__ int capture_next_countdown(int id);
+/*
+ * The captured invocation @threw or returned: 1 if the policy keeps the
+ * capture, 0 if it's to be dropped, which takes it back from the count.
+ */
+__API__ int capture_exit_wanted(int id, int threw);
+/* 1 if the captures of @id follow their work across threads */
+__API__ int capture_carries(int id);
+/* 1 once the trigger has taken all of its captures */
+__API__ int capture_exhausted(int id);
+/* The recorder spent @cpu_ns on a capture of @id. */
+__API__ void capture_cost(int id, uint64_t cpu_ns);
+/* the number of the last capture of @id, 0 if the trigger only takes one */
+__API__ int get_capture_number(int id);
+__API__ void reset_capture_policies(void);
+
+#endif
@@ -0,0 +1,408 @@
+#include <cctype>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "profiler-profile.hpp"
+#include "profiler-backend.hpp"
+#include "profiler-calltree.hpp"
+
+namespace {
+    const char PROFILE_MAGIC[8] = { 'R', 'P', 'P', 'R', 'O', 'F', '0', '1' };
+
+    /*
+     * Layout, every integer is an unsigned LEB128 varint and every string is
+     * its length followed by the bytes:
+     *
+     *   magic, total_time, first_timestamp, last_timestamp
+     *   nr_categories, { name, time }
+     *   nr_routines, { name, self_time, invoke_count, category }
+     *   nr_call_tree_nodes, { depth, name, inclusive, exclusive, calls }  (depth-first)
+     */
+    struct profile_routine {
+	std::string name;
+	uint64_t self_time;
+	uint64_t invoke_count;
+	uint64_t category;
+    };
+
+    struct profile_call_node {
+	uint64_t depth;
+	std::string name;
+	uint64_t inclusive;
+	uint64_t exclusive;
+	uint64_t calls;
+    };
+
+    struct profile {
+	uint64_t total_time;
+	uint64_t first_timestamp;
+	uint64_t last_timestamp;
+	std::vector<std::pair<std::string, uint64_t>> categories;
+	std::vector<profile_routine> routines;
+	std::vector<profile_call_node> call_tree;
+    };
+
+    void put_varint(std::string& out, uint64_t value) {
+	while (value >= 0x80) {
+	    out += (char) (value | 0x80);
+	    value >>= 7;
+	}
+	out += (char) value;
+    }
+
+    void put_string(std::string& out, const std::string& str) {
+	put_varint(out, str.size());
+	out += str;
+    }
+
+    class profile_reader {
+	const std::string& data;
+	size_t pos;
+
+    public:
+	bool failed = false;
+
+	profile_reader(const std::string& data_, size_t pos_): data(data_), pos(pos_) {}
+
+	uint64_t varint() {
+	    uint64_t value = 0;
+	    for (int shift = 0; shift < 64; shift += 7) {
+		if (pos >= data.size()) {
+		    break;
+		}
+		unsigned char c = data[pos++];
+		value |= (uint64_t) (c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+		    return value;
+		}
+	    }
+	    failed = true;
+	    return 0;
+	}
+
+	std::string string() {
+	    uint64_t len = varint();
+	    if (failed || len > data.size() - pos) {
+		failed = true;
+		return std::string();
+	    }
+	    pos += len;
+	    return data.substr(pos - len, len);
+	}
+
+	// guards the element counts against truncated or foreign files
+	uint64_t count() {
+	    uint64_t n = varint();
+	    if (n > data.size() - pos) {
+		failed = true;
+		return 0;
+	    }
+	    return n;
+	}
+    };
+
+    /*
+     * Code cache addresses resolve against perf-<pid>.map and hidden classes
+     * carry their address, neither of which survives a restart.
+     */
+    std::string portable_name(const char* name) {
+	std::string result(name);
+
+	auto at = result.rfind("@perf-");
+	if (at == std::string::npos) {
+	    at = result.rfind("@/tmp/perf-");
+	}
+	if (at != std::string::npos && result.size() > 4 && !result.compare(result.size() - 4, 4, ".map")) {
+	    result.replace(at + 1, std::string::npos, "[jit]");
+	}
+
+	for (auto hidden = result.find("/0x"); hidden != std::string::npos; hidden = result.find("/0x", hidden)) {
+	    auto end = hidden + 3;
+	    while (end < result.size() && isxdigit((unsigned char) result[end])) {
+		++end;
+	    }
+	    result.erase(hidden, end - hidden);
+	}
+	return result;
+    }
+
+    int write_file(const char* path, const std::string& data) {
+	std::string tmp_path(path);
+	tmp_path += ".tmp";
+
+	FILE* file = fopen(tmp_path.c_str(), "w");
+	if (!file) {
+	    return -errno;
+	}
+	int err = 0;
+	if (fwrite(data.data(), 1, data.size(), file) != data.size()) {
+	    err = -EIO;
+	}
+	if (fclose(file) && !err) {
+	    err = -errno;
+	}
+	// readers never see a partially written profile
+	if (!err && rename(tmp_path.c_str(), path)) {
+	    err = -errno;
+	}
+	if (err) {
+	    unlink(tmp_path.c_str());
+	}
+	return err;
+    }
+
+    int read_file(const char* path, std::string& data) {
+	FILE* file = fopen(path, "r");
+	if (!file) {
+	    return -errno;
+	}
+	char buf[64 * 1024];
+	size_t len;
+	while ((len = fread(buf, 1, sizeof(buf), file)) > 0) {
+	    data.append(buf, len);
+	}
+	int err = ferror(file) ? -EIO : 0;
+	fclose(file);
+	return err;
+    }
+
+    int load_profile(const char* path, profile& prof) {
+	std::string data;
+	int err = read_file(path, data);
+	if (err) {
+	    return err;
+	}
+	if (data.size() < sizeof(PROFILE_MAGIC) || memcmp(data.data(), PROFILE_MAGIC, sizeof(PROFILE_MAGIC))) {
+	    return -EINVAL;
+	}
+
+	profile_reader in(data, sizeof(PROFILE_MAGIC));
+	prof.total_time = in.varint();
+	prof.first_timestamp = in.varint();
+	prof.last_timestamp = in.varint();
+
+	for (uint64_t n = in.count(); n && !in.failed; --n) {
+	    auto name = in.string();
+	    prof.categories.emplace_back(name, in.varint());
+	}
+	for (uint64_t n = in.count(); n && !in.failed; --n) {
+	    profile_routine r;
+	    r.name = in.string();
+	    r.self_time = in.varint();
+	    r.invoke_count = in.varint();
+	    r.category = in.varint();
+	    prof.routines.push_back(std::move(r));
+	}
+	for (uint64_t n = in.count(); n && !in.failed; --n) {
+	    profile_call_node node;
+	    node.depth = in.varint();
+	    node.name = in.string();
+	    node.inclusive = in.varint();
+	    node.exclusive = in.varint();
+	    node.calls = in.varint();
+	    prof.call_tree.push_back(std::move(node));
+	}
+	return in.failed ? -EINVAL : 0;
+    }
+
+    struct function_stats {
+	uint64_t self_time = 0;
+	uint64_t inclusive_time = 0;
+	uint64_t calls = 0;
+	bool present = false;
+    };
+
+    struct function_diff {
+	std::string name;
+	function_stats base;
+	function_stats current;
+
+	int64_t self_delta() const {
+	    return (int64_t) (current.self_time - base.self_time);
+	}
+
+	int64_t inclusive_delta() const {
+	    return (int64_t) (current.inclusive_time - base.inclusive_time);
+	}
+
+	int64_t calls_delta() const {
+	    return (int64_t) (current.calls - base.calls);
+	}
+
+	uint64_t impact() const {
+	    return std::max(std::abs(self_delta()), std::abs(inclusive_delta()));
+	}
+    };
+
+    typedef std::map<std::string, function_stats> function_table;
+
+    // call tree nodes are named by symbol only, routines carry their dso too
+    std::string function_name(const std::string& routine_name) {
+	auto at = routine_name.rfind('@');
+	if (at == std::string::npos || !routine_name.compare(0, at, "unknown")) {
+	    return routine_name;
+	}
+	return routine_name.substr(0, at);
+    }
+
+    void collect_functions(const profile& prof, function_table& functions) {
+	for (auto& r : prof.routines) {
+	    auto& stats = functions[function_name(r.name)];
+	    stats.self_time += r.self_time;
+	    stats.calls += r.invoke_count;
+	    stats.present = true;
+	}
+
+	if (prof.call_tree.empty()) {
+	    return;
+	}
+
+	// real calls replace control transfers once there is a call tree;
+	// recursive frames only count towards inclusive time once
+	for (auto& entry : functions) {
+	    entry.second.calls = 0;
+	}
+	std::vector<const std::string*> stack;
+	for (auto& node : prof.call_tree) {
+	    stack.resize(std::min<size_t>(node.depth, stack.size()));
+	    bool recursive = std::any_of(std::begin(stack), std::end(stack), [&node] (const std::string* name) {
+		    return *name == node.name;
+		});
+	    stack.push_back(&node.name);
+
+	    auto& stats = functions[node.name];
+	    stats.present = true;
+	    stats.calls += node.calls;
+	    if (!recursive) {
+		stats.inclusive_time += node.inclusive;
+	    }
+	}
+    }
+
+    double share_change(uint64_t base, uint64_t base_total, uint64_t current, uint64_t current_total) {
+	double base_share = base_total ? 100.0 * base / base_total : 0.0;
+	double current_share = current_total ? 100.0 * current / current_total : 0.0;
+	return current_share - base_share;
+    }
+}
+
+int save_profile(const char* path) {
+    std::string out(PROFILE_MAGIC, sizeof(PROFILE_MAGIC));
+
+    put_varint(out, get_total_time());
+    put_varint(out, get_first_timestamp());
+    put_varint(out, get_last_timestamp());
+
+    put_varint(out, CATEGORY_MAX);
+    for (int i = 0; i < CATEGORY_MAX; ++i) {
+	put_string(out, get_category_name(i));
+	put_varint(out, get_category_time(i));
+    }
+
+    put_varint(out, get_routine_count());
+    for (int id = 0; id < get_routine_count(); ++id) {
+	put_string(out, portable_name(get_routine_name(id)));
+	put_varint(out, get_routine_time(id));
+	put_varint(out, get_routine_invoke_count(id));
+	put_varint(out, get_routine_category(id));
+    }
+
+    put_varint(out, get_call_tree_len());
+    for (int i = 0; i < get_call_tree_len(); ++i) {
+	put_varint(out, get_call_tree_depth(i));
+	put_string(out, portable_name(get_call_tree_name(i)));
+	put_varint(out, get_call_tree_inclusive(i));
+	put_varint(out, get_call_tree_exclusive(i));
+	put_varint(out, get_call_tree_calls(i));
+    }
+
+    return write_file(path, out);
+}
+
+int diff_profiles(const char* base_path, const char* current_path, int max_len) {
+    profile base, current;
+    int err = load_profile(base_path, base);
+    if (!err) {
+	err = load_profile(current_path, current);
+    }
+    if (err) {
+	return err;
+    }
+
+    printf("Base:    %s\t%'" PRIu64 "ns\n", base_path, base.total_time);
+    printf("Current: %s\t%'" PRIu64 "ns\t%+.2f%%\n", current_path, current.total_time,
+	   base.total_time ? 100.0 * ((double) current.total_time - base.total_time) / base.total_time : 0.0);
+
+    std::map<std::string, std::pair<uint64_t, uint64_t>> categories;
+    for (auto& c : base.categories) {
+	categories[c.first].first = c.second;
+    }
+    for (auto& c : current.categories) {
+	categories[c.first].second = c.second;
+    }
+    printf("Categories (base / current / share change):\n");
+    for (auto& c : categories) {
+	if (!c.second.first && !c.second.second) {
+	    continue;
+	}
+	printf("\t%-16s\t%'16" PRIu64 "ns %'16" PRIu64 "ns\t%+6.2f%%\n", c.first.c_str(),
+	       c.second.first, c.second.second,
+	       share_change(c.second.first, base.total_time, c.second.second, current.total_time));
+    }
+
+    function_table base_functions, current_functions;
+    collect_functions(base, base_functions);
+    collect_functions(current, current_functions);
+
+    std::vector<function_diff> diffs;
+    for (auto& f : base_functions) {
+	diffs.push_back({ f.first, f.second, current_functions[f.first] });
+    }
+    for (auto& f : current_functions) {
+	if (!base_functions.count(f.first)) {
+	    diffs.push_back({ f.first, function_stats(), f.second });
+	}
+    }
+
+    int new_functions = 0, vanished_functions = 0;
+    for (auto& d : diffs) {
+	new_functions += !d.base.present && d.current.present;
+	vanished_functions += d.base.present && !d.current.present;
+    }
+
+    // changes in calls alone come after every change in time, before no change at all
+    auto by_impact = [] (const function_diff& d1, const function_diff& d2) {
+	if (d1.impact() != d2.impact()) {
+	    return d1.impact() > d2.impact();
+	}
+	return std::abs(d1.calls_delta()) > std::abs(d2.calls_delta());
+    };
+    size_t len = diffs.size();
+    if (max_len > 0 && (size_t) max_len < len) {
+	len = max_len;
+	std::partial_sort(std::begin(diffs), std::begin(diffs) + len, std::end(diffs), by_impact);
+    } else {
+	std::sort(std::begin(diffs), std::end(diffs), by_impact);
+    }
+
+    printf("Functions by impact (self delta / inclusive delta / calls delta):\n");
+    for (size_t i = 0; i < len; ++i) {
+	auto& d = diffs[i];
+	if (!d.impact() && !d.calls_delta()) {
+	    break;
+	}
+	const char* status = !d.base.present ? " [new]" : !d.current.present ? " [gone]" : "";
+	printf("\t%d\t%+'16" PRId64 "ns %+'16" PRId64 "ns %+'10" PRId64 "\t%s%s\n",
+	       (int) i + 1, d.self_delta(), d.inclusive_delta(), d.calls_delta(), d.name.c_str(), status);
+    }
+    printf("New functions: %d, vanished functions: %d\n", new_functions, vanished_functions);
+    return 0;
+}
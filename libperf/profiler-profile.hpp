@@ -0,0 +1,27 @@
+#ifndef __PROFILER_PROFILE_HEADER__
+#define __PROFILER_PROFILE_HEADER__
+
+#if defined(__cplusplus)
+#define __API__ extern "C"
+#else
+#define __API__
+#endif
+
+/*
+ * Aggregated profile of one capture: the routine table, the call tree as
+ * flattened by prepare_call_tree() and the category totals. JIT names are
+ * stored without the pid of the process they came from, so profiles of
+ * different runs can be compared.
+ */
+
+/* Returns 0 or a negative errno. */
+__API__ int save_profile(const char* path);
+
+/*
+ * Prints per-function self/inclusive time and call count changes between two
+ * saved profiles, the @max_len with the largest impact first (all if 0).
+ * Returns 0 or a negative errno.
+ */
+__API__ int diff_profiles(const char* base_path, const char* current_path, int max_len);
+
+#endif
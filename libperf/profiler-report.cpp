@@ -0,0 +1,337 @@
+#include <cctype>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "profiler-report.hpp"
+#include "profiler-backend.hpp"
+#include "profiler-calltree.hpp"
+
+namespace {
+    const char* REPORT_SCHEMA = "rperf-report/1";
+
+    struct report_row {
+	std::string symbol;
+	std::string dso;
+	int category;
+	uint64_t self_time;
+	uint64_t inclusive_time;
+	bool has_inclusive;
+	uint64_t calls;
+	uint64_t transfers;	// control transfers into the routine
+    };
+
+    struct report_data {
+	std::string dir;
+	std::string label;
+	std::string exception;	// empty if the invocation returned
+	int formats;
+	std::string basename;
+	time_t captured_at;
+	uint64_t first_timestamp;
+	uint64_t last_timestamp;
+	uint64_t total_time;
+	uint64_t category_time[CATEGORY_MAX];
+	std::vector<report_row> rows;
+    };
+
+    /*
+     * One writer thread, started with the first report, writes them in
+     * order. Never destroyed: the thread waits on it until the process is
+     * gone.
+     */
+    struct report_writer {
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	std::condition_variable idle;
+	std::deque<std::unique_ptr<report_data>> pending;
+	bool busy = false;
+	bool started = false;
+    };
+    report_writer& writer = *new report_writer;
+    int reports_started = 0;
+
+    struct function_totals {
+	uint64_t inclusive_time = 0;
+	uint64_t calls = 0;
+    };
+
+    // per symbol, recursive frames only count once
+    std::map<std::string, function_totals> call_tree_totals() {
+	std::map<std::string, function_totals> totals;
+	std::vector<const char*> stack;
+
+	prepare_call_tree(0.0);
+	for (int i = 0; i < get_call_tree_len(); ++i) {
+	    const char* name = get_call_tree_name(i);
+	    stack.resize(std::min<size_t>(get_call_tree_depth(i), stack.size()));
+	    bool recursive = std::any_of(std::begin(stack), std::end(stack), [name] (const char* caller) {
+		    return !strcmp(caller, name);
+		});
+	    stack.push_back(name);
+
+	    auto& t = totals[name];
+	    t.calls += get_call_tree_calls(i);
+	    if (!recursive) {
+		t.inclusive_time += get_call_tree_inclusive(i);
+	    }
+	}
+	return totals;
+    }
+
+    // trigger labels are free text, file names are not
+    std::string file_label(const std::string& label) {
+	std::string name;
+	for (char c : label) {
+	    name += isalnum((unsigned char) c) || c == '-' || c == '_' || c == '.' ? c : '_';
+	}
+	return name;
+    }
+
+    std::unique_ptr<report_data> snapshot(const char* dir, const char* label, const char* exception, int formats) {
+	std::unique_ptr<report_data> data(new report_data());
+	data->dir = dir;
+	data->label = label ? label : "";
+	data->exception = exception ? exception : "";
+	data->formats = formats;
+	data->captured_at = time(nullptr);
+	data->first_timestamp = get_first_timestamp();
+	data->last_timestamp = get_last_timestamp();
+	data->total_time = get_total_time();
+	for (int i = 0; i < CATEGORY_MAX; ++i) {
+	    data->category_time[i] = get_category_time(i);
+	}
+
+	char suffix[16];
+	snprintf(suffix, sizeof(suffix), "-%d", reports_started++);
+	data->basename = "rperf-" + std::to_string(getpid());
+	if (!data->label.empty()) {
+	    data->basename += "-" + file_label(data->label);
+	}
+	data->basename += suffix;
+
+	auto totals = call_tree_totals();
+	data->rows.reserve(get_routine_count());
+	for (int id = 0; id < get_routine_count(); ++id) {
+	    report_row row;
+	    std::string name = get_routine_name(id);
+	    row.dso = get_routine_dso(id);
+	    row.symbol = name.substr(0, name.size() - row.dso.size() - 1);
+	    row.category = get_routine_category(id);
+	    row.self_time = get_routine_time(id);
+	    row.transfers = get_routine_invoke_count(id);
+
+	    auto it = totals.find(row.symbol);
+	    row.has_inclusive = it != std::end(totals);
+	    row.inclusive_time = row.has_inclusive ? it->second.inclusive_time : 0;
+	    row.calls = row.has_inclusive ? it->second.calls : row.transfers;
+	    data->rows.push_back(std::move(row));
+	}
+	std::sort(std::begin(data->rows), std::end(data->rows), [] (const report_row& r1, const report_row& r2) {
+		return r1.self_time > r2.self_time;
+	    });
+	return data;
+    }
+
+    void append_uint(std::string& out, uint64_t value) {
+	char buf[24];
+	snprintf(buf, sizeof(buf), "%" PRIu64, value);
+	out += buf;
+    }
+
+    void append_json_string(std::string& out, const std::string& str) {
+	out += '"';
+	for (unsigned char c : str) {
+	    if (c == '"' || c == '\\') {
+		out += '\\';
+		out += c;
+	    } else if (c < 0x20) {
+		char buf[8];
+		snprintf(buf, sizeof(buf), "\\u%04x", c);
+		out += buf;
+	    } else {
+		out += c;
+	    }
+	}
+	out += '"';
+    }
+
+    void append_csv_field(std::string& out, const std::string& str) {
+	if (str.find_first_of(",\"\n\r") == std::string::npos) {
+	    out += str;
+	    return;
+	}
+	out += '"';
+	for (char c : str) {
+	    if (c == '"') {
+		out += '"';
+	    }
+	    out += c;
+	}
+	out += '"';
+    }
+
+    std::string format_json(const report_data& data) {
+	std::string out = "{\n  \"schema\": ";
+	append_json_string(out, REPORT_SCHEMA);
+	out += ",\n  \"pid\": ";
+	append_uint(out, getpid());
+	if (!data.label.empty()) {
+	    out += ",\n  \"trigger\": ";
+	    append_json_string(out, data.label);
+	}
+	out += ",\n  \"exit\": ";
+	append_json_string(out, data.exception.empty() ? "returned" : "threw");
+	if (!data.exception.empty()) {
+	    out += ",\n  \"exception\": ";
+	    append_json_string(out, data.exception);
+	}
+	out += ",\n  \"captured_at\": ";
+	append_uint(out, data.captured_at);
+	out += ",\n  \"first_timestamp_ns\": ";
+	append_uint(out, data.first_timestamp);
+	out += ",\n  \"last_timestamp_ns\": ";
+	append_uint(out, data.last_timestamp);
+	out += ",\n  \"total_ns\": ";
+	append_uint(out, data.total_time);
+
+	out += ",\n  \"categories\": [";
+	bool first = true;
+	for (int i = 0; i < CATEGORY_MAX; ++i) {
+	    out += first ? "\n    {\"name\": " : ",\n    {\"name\": ";
+	    first = false;
+	    append_json_string(out, get_category_name(i));
+	    out += ", \"ns\": ";
+	    append_uint(out, data.category_time[i]);
+	    out += "}";
+	}
+
+	out += "\n  ],\n  \"routines\": [";
+	first = true;
+	for (auto& row : data.rows) {
+	    out += first ? "\n    {\"symbol\": " : ",\n    {\"symbol\": ";
+	    first = false;
+	    append_json_string(out, row.symbol);
+	    out += ", \"dso\": ";
+	    append_json_string(out, row.dso);
+	    out += ", \"category\": ";
+	    append_json_string(out, get_category_name(row.category));
+	    out += ", \"self_ns\": ";
+	    append_uint(out, row.self_time);
+	    out += ", \"inclusive_ns\": ";
+	    if (row.has_inclusive) {
+		append_uint(out, row.inclusive_time);
+	    } else {
+		out += "null";
+	    }
+	    out += ", \"calls\": ";
+	    append_uint(out, row.calls);
+	    out += ", \"transfers\": ";
+	    append_uint(out, row.transfers);
+	    out += "}";
+	}
+	out += "\n  ]\n}\n";
+	return out;
+    }
+
+    std::string format_csv(const report_data& data) {
+	std::string out = "symbol,dso,category,self_ns,inclusive_ns,calls,transfers\n";
+	for (auto& row : data.rows) {
+	    append_csv_field(out, row.symbol);
+	    out += ',';
+	    append_csv_field(out, row.dso);
+	    out += ',';
+	    out += get_category_name(row.category);
+	    out += ',';
+	    append_uint(out, row.self_time);
+	    out += ',';
+	    if (row.has_inclusive) {
+		append_uint(out, row.inclusive_time);
+	    }
+	    out += ',';
+	    append_uint(out, row.calls);
+	    out += ',';
+	    append_uint(out, row.transfers);
+	    out += '\n';
+	}
+	return out;
+    }
+
+    // the harness polls the directory, so files only appear once complete
+    void write_atomically(const std::string& path, const std::string& contents) {
+	std::string tmp_path = path + ".tmp";
+	FILE* file = fopen(tmp_path.c_str(), "w");
+	if (!file) {
+	    fprintf(stderr, "Couldn't write report %s: %s\n", tmp_path.c_str(), strerror(errno));
+	    return;
+	}
+	bool ok = fwrite(contents.data(), 1, contents.size(), file) == contents.size();
+	ok = !fclose(file) && ok;
+	if (!ok || rename(tmp_path.c_str(), path.c_str())) {
+	    fprintf(stderr, "Couldn't write report %s\n", path.c_str());
+	    unlink(tmp_path.c_str());
+	}
+    }
+
+    void write_files(std::unique_ptr<report_data> data) {
+	std::string base = data->dir + "/" + data->basename;
+	if (data->formats & REPORT_JSON) {
+	    write_atomically(base + ".json", format_json(*data));
+	}
+	if (data->formats & REPORT_CSV) {
+	    write_atomically(base + ".csv", format_csv(*data));
+	}
+    }
+
+    void write_pending_reports() {
+	std::unique_lock<std::mutex> lock(writer.mutex);
+	for (;;) {
+	    writer.wakeup.wait(lock, [] { return !writer.pending.empty(); });
+	    std::unique_ptr<report_data> data = std::move(writer.pending.front());
+	    writer.pending.pop_front();
+	    writer.busy = true;
+	    lock.unlock();
+	    write_files(std::move(data));
+	    lock.lock();
+	    writer.busy = false;
+	    if (writer.pending.empty()) {
+		writer.idle.notify_all();
+	    }
+	}
+    }
+}
+
+int write_report(const char* dir, const char* label, const char* exception, int formats) {
+    std::unique_ptr<report_data> data = snapshot(dir, label, exception, formats);
+    std::lock_guard<std::mutex> lock(writer.mutex);
+    if (!writer.started) {
+	try {
+	    std::thread(write_pending_reports).detach();
+	} catch (const std::system_error& e) {
+	    return -e.code().value();
+	}
+	writer.started = true;
+    }
+    writer.pending.push_back(std::move(data));
+    writer.wakeup.notify_one();
+    return 0;
+}
+
+void wait_for_reports() {
+    std::unique_lock<std::mutex> lock(writer.mutex);
+    writer.idle.wait(lock, [] { return writer.pending.empty() && !writer.busy; });
+}
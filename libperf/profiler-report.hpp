@@ -0,0 +1,31 @@
+#ifndef __PROFILER_REPORT_HEADER__
+#define __PROFILER_REPORT_HEADER__
+
+#if defined(__cplusplus)
+#define __API__ extern "C"
+#else
+#define __API__
+#endif
+
+enum report_format {
+    REPORT_JSON = 1,
+    REPORT_CSV = 2,
+};
+
+/*
+ * Machine-readable report of the capture: one row per routine with self and
+ * inclusive time, calls, category and dso, plus the category totals.
+ *
+ * The aggregated data is copied right away, formatting and writing happen
+ * on a background thread. Files are named rperf-<pid>-<n>.json/.csv in @dir,
+ * rperf-<pid>-<label>-<n> when the capture has a trigger @label, and appear
+ * atomically. @exception is the class the captured invocation threw, NULL
+ * if it returned. @formats is a mask of report_format.
+ * Returns 0 or a negative errno if the writer could not be started.
+ */
+__API__ int write_report(const char* dir, const char* label, const char* exception, int formats);
+
+/* Waits until reports started so far are on disk. */
+__API__ void wait_for_reports(void);
+
+#endif
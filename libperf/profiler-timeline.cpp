@@ -0,0 +1,445 @@
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "profiler-timeline.hpp"
+
+namespace {
+    const size_t OUTPUT_BUFFER_SIZE = 1 << 20;
+    // Perfetto events held back to be written closer to timestamp order
+    const size_t REORDER_WINDOW = 1 << 16;
+    const uint32_t PERFETTO_SEQUENCE_ID = 1;
+
+    // field numbers from perfetto/trace/*.proto
+    enum {
+	TRACE_PACKET = 1,
+
+	PACKET_TIMESTAMP = 8,
+	PACKET_SEQUENCE_ID = 10,
+	PACKET_TRACK_EVENT = 11,
+	PACKET_TRACK_DESCRIPTOR = 60,
+
+	TRACK_EVENT_TYPE = 9,
+	TRACK_EVENT_TRACK_UUID = 11,
+	TRACK_EVENT_NAME = 23,
+	TRACK_EVENT_FLOW_IDS = 47,
+	TRACK_EVENT_TERMINATING_FLOW_IDS = 48,
+
+	TRACK_DESCRIPTOR_UUID = 1,
+	TRACK_DESCRIPTOR_THREAD = 4,
+
+	THREAD_DESCRIPTOR_PID = 1,
+	THREAD_DESCRIPTOR_TID = 2,
+	THREAD_DESCRIPTOR_NAME = 5,
+
+	SLICE_BEGIN = 1,
+	SLICE_END = 2,
+	INSTANT = 3,
+    };
+
+    enum wire_type {
+	WIRE_VARINT = 0,
+	WIRE_FIXED64 = 1,
+	WIRE_LENGTH_DELIMITED = 2,
+    };
+
+    class output_file {
+	FILE* file = nullptr;
+	std::vector<char> buffer;
+	int error = 0;
+
+    public:
+	int open(const char* path) {
+	    file = fopen(path, "w");
+	    if (!file) {
+		return -errno;
+	    }
+	    buffer.reserve(OUTPUT_BUFFER_SIZE);
+	    error = 0;
+	    return 0;
+	}
+
+	bool is_open() const {
+	    return file != nullptr;
+	}
+
+	void write(const char* data, size_t len) {
+	    if (buffer.size() + len > OUTPUT_BUFFER_SIZE) {
+		flush();
+	    }
+	    if (len > OUTPUT_BUFFER_SIZE) {
+		if (fwrite(data, 1, len, file) != len) {
+		    error = -EIO;
+		}
+		return;
+	    }
+	    buffer.insert(std::end(buffer), data, data + len);
+	}
+
+	void write(const std::string& data) {
+	    write(data.data(), data.size());
+	}
+
+	void flush() {
+	    if (!buffer.empty() && fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size()) {
+		error = -EIO;
+	    }
+	    buffer.clear();
+	}
+
+	int close() {
+	    flush();
+	    if (fclose(file) && !error) {
+		error = -errno;
+	    }
+	    file = nullptr;
+	    return error;
+	}
+    };
+
+    // protobuf encoding of the few messages a track event trace needs
+    void put_varint(std::string& out, uint64_t value) {
+	while (value >= 0x80) {
+	    out += (char) (value | 0x80);
+	    value >>= 7;
+	}
+	out += (char) value;
+    }
+
+    void put_tag(std::string& out, int field, wire_type type) {
+	put_varint(out, (uint64_t) field << 3 | type);
+    }
+
+    void put_uint(std::string& out, int field, uint64_t value) {
+	put_tag(out, field, WIRE_VARINT);
+	put_varint(out, value);
+    }
+
+    void put_fixed64(std::string& out, int field, uint64_t value) {
+	put_tag(out, field, WIRE_FIXED64);
+	for (int i = 0; i < 8; ++i) {
+	    out += (char) (value >> 8 * i);
+	}
+    }
+
+    void put_bytes(std::string& out, int field, const char* data, size_t len) {
+	put_tag(out, field, WIRE_LENGTH_DELIMITED);
+	put_varint(out, len);
+	out.append(data, len);
+    }
+
+    void put_bytes(std::string& out, int field, const std::string& data) {
+	put_bytes(out, field, data.data(), data.size());
+    }
+
+    void put_string(std::string& out, int field, const char* str) {
+	put_bytes(out, field, str, strlen(str));
+    }
+
+    struct cstr_hash {
+	size_t operator() (const char* s) const noexcept {
+	    size_t h = 14695981039346656037ULL;
+	    for (; *s; ++s) {
+		h = (h ^ (unsigned char) *s) * 1099511628211ULL;
+	    }
+	    return h;
+	}
+    };
+
+    struct cstr_equal {
+	bool operator() (const char* s1, const char* s2) const {
+	    return !strcmp(s1, s2);
+	}
+    };
+
+    // names of pending events, kept once per distinct name
+    std::deque<std::string> names;
+    std::unordered_map<const char*, int, cstr_hash, cstr_equal> name_ids;
+
+    int intern_name(const char* name) {
+	auto it = name_ids.find(name);
+	if (it != std::end(name_ids)) {
+	    return it->second;
+	}
+	int id = names.size();
+	names.emplace_back(name);
+	name_ids.emplace(names.back().c_str(), id);
+	return id;
+    }
+
+    /*
+     * Calls are reported when they return, so a caller comes after its
+     * callees. Slice begin/end events are sorted within REORDER_WINDOW
+     * events; at equal timestamps ends go first, innermost first, and begins
+     * go outermost first, which keeps the slices properly nested. The begin
+     * of a call spanning more events than that, the trigger method's always,
+     * is written late: the file is not in timestamp order, Perfetto's trace
+     * processor sorts it on import.
+     */
+    struct slice_event {
+	uint64_t timestamp;
+	uint64_t track;
+	int type;
+	int depth;
+	int name;
+	// a flow the event starts or ends, by its field
+	int flow_field;
+	uint64_t flow;
+
+	int order() const {
+	    return type == SLICE_END ? -depth : depth;
+	}
+    };
+
+    struct later_slice_event {
+	bool operator() (const slice_event& e1, const slice_event& e2) const {
+	    if (e1.timestamp != e2.timestamp) {
+		return e1.timestamp > e2.timestamp;
+	    }
+	    if (e1.type != e2.type) {
+		return e1.type != SLICE_END;
+	    }
+	    return e1.order() > e2.order();
+	}
+    };
+
+    output_file output;
+    int output_format = TIMELINE_CHROME;
+    bool first_json_event = true;
+    std::unordered_set<uint64_t> known_threads;
+    std::priority_queue<slice_event, std::vector<slice_event>, later_slice_event> reorder_window;
+    // reused for every record to avoid allocations
+    std::string scratch;
+    std::string nested;
+
+    uint64_t thread_uuid(int pid, int tid) {
+	return (uint64_t) (uint32_t) pid << 32 | (uint32_t) tid;
+    }
+
+    void write_packet(const std::string& packet) {
+	scratch.clear();
+	put_bytes(scratch, TRACE_PACKET, packet);
+	output.write(scratch);
+    }
+
+    void write_perfetto_thread(int pid, int tid, const char* comm) {
+	std::string thread;
+	put_uint(thread, THREAD_DESCRIPTOR_PID, pid);
+	put_uint(thread, THREAD_DESCRIPTOR_TID, tid);
+	put_string(thread, THREAD_DESCRIPTOR_NAME, comm);
+
+	std::string track;
+	put_uint(track, TRACK_DESCRIPTOR_UUID, thread_uuid(pid, tid));
+	put_bytes(track, TRACK_DESCRIPTOR_THREAD, thread);
+
+	std::string packet;
+	put_uint(packet, PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+	put_bytes(packet, PACKET_TRACK_DESCRIPTOR, track);
+	write_packet(packet);
+    }
+
+    void write_perfetto_slice_event(const slice_event& ev) {
+	nested.clear();
+	put_uint(nested, TRACK_EVENT_TYPE, ev.type);
+	put_uint(nested, TRACK_EVENT_TRACK_UUID, ev.track);
+	if (ev.type != SLICE_END) {
+	    put_bytes(nested, TRACK_EVENT_NAME, names[ev.name]);
+	}
+	if (ev.flow_field) {
+	    put_fixed64(nested, ev.flow_field, ev.flow);
+	}
+
+	std::string& packet = scratch;
+	packet.clear();
+	put_uint(packet, PACKET_TIMESTAMP, ev.timestamp);
+	put_uint(packet, PACKET_SEQUENCE_ID, PERFETTO_SEQUENCE_ID);
+	put_bytes(packet, PACKET_TRACK_EVENT, nested);
+
+	nested.clear();
+	put_bytes(nested, TRACE_PACKET, packet);
+	output.write(nested);
+    }
+
+    void push_perfetto_slice_event(const slice_event& ev) {
+	reorder_window.push(ev);
+	if (reorder_window.size() > REORDER_WINDOW) {
+	    write_perfetto_slice_event(reorder_window.top());
+	    reorder_window.pop();
+	}
+    }
+
+    void drain_reorder_window() {
+	while (!reorder_window.empty()) {
+	    write_perfetto_slice_event(reorder_window.top());
+	    reorder_window.pop();
+	}
+    }
+
+    void put_json_string(std::string& out, const char* str) {
+	out += '"';
+	for (; *str; ++str) {
+	    unsigned char c = *str;
+	    if (c == '"' || c == '\\') {
+		out += '\\';
+		out += c;
+	    } else if (c < 0x20) {
+		char buf[8];
+		snprintf(buf, sizeof(buf), "\\u%04x", c);
+		out += buf;
+	    } else {
+		out += c;
+	    }
+	}
+	out += '"';
+    }
+
+    void begin_json_event() {
+	output.write(first_json_event ? "\n" : ",\n", first_json_event ? 1 : 2);
+	first_json_event = false;
+    }
+
+    void write_json_thread(int pid, int tid, const char* comm) {
+	char buf[96];
+	begin_json_event();
+	snprintf(buf, sizeof(buf), "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", pid, tid);
+	scratch = buf;
+	put_json_string(scratch, comm);
+	scratch += "}}";
+	output.write(scratch);
+    }
+
+    // timestamps are in microseconds, the fraction keeps nanoseconds
+    void write_json_slice(int pid, int tid, const char* name, uint64_t call_time, uint64_t return_time) {
+	char buf[128];
+	uint64_t duration = return_time - call_time;
+	begin_json_event();
+	scratch = "{\"ph\":\"X\",\"name\":";
+	put_json_string(scratch, name);
+	snprintf(buf, sizeof(buf), ",\"pid\":%d,\"tid\":%d,\"ts\":%" PRIu64 ".%03" PRIu64 ",\"dur\":%" PRIu64 ".%03" PRIu64 "}",
+		 pid, tid, call_time / 1000, call_time % 1000, duration / 1000, duration % 1000);
+	scratch += buf;
+	output.write(scratch);
+    }
+
+    void write_json_instant(int pid, int tid, const char* name, uint64_t time) {
+	char buf[96];
+	begin_json_event();
+	scratch = "{\"ph\":\"i\",\"s\":\"t\",\"name\":";
+	put_json_string(scratch, name);
+	snprintf(buf, sizeof(buf), ",\"pid\":%d,\"tid\":%d,\"ts\":%" PRIu64 ".%03" PRIu64 "}",
+		 pid, tid, time / 1000, time % 1000);
+	scratch += buf;
+	output.write(scratch);
+    }
+
+    // binds to the enclosing slice, the end to the one around it at @time
+    void write_json_flow(int pid, int tid, bool end, uint64_t id, uint64_t time) {
+	char buf[160];
+	begin_json_event();
+	snprintf(buf, sizeof(buf), "{\"ph\":\"%s\",\"cat\":\"carry\",\"name\":\"handoff\",\"id\":%" PRIu64
+		 ",\"pid\":%d,\"tid\":%d,\"ts\":%" PRIu64 ".%03" PRIu64 "%s}",
+		 end ? "f" : "s", id, pid, tid, time / 1000, time % 1000, end ? ",\"bp\":\"e\"" : "");
+	output.write(buf, strlen(buf));
+    }
+
+    void add_thread(int pid, int tid, const char* comm) {
+	if (known_threads.insert(thread_uuid(pid, tid)).second) {
+	    if (output_format == TIMELINE_PERFETTO) {
+		write_perfetto_thread(pid, tid, comm);
+	    } else {
+		write_json_thread(pid, tid, comm);
+	    }
+	}
+    }
+}
+
+int timeline_open(const char* path, int format) {
+    int err = output.open(path);
+    if (err) {
+	return err;
+    }
+
+    output_format = format;
+    first_json_event = true;
+    known_threads.clear();
+    if (output_format == TIMELINE_CHROME) {
+	const char header[] = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+	output.write(header, sizeof(header) - 1);
+    }
+    return 0;
+}
+
+void timeline_visit_call_return(int pid, int tid, const char* comm, const char* name, int depth, uint64_t call_time, uint64_t return_time) {
+    if (!output.is_open()) {
+	return;
+    }
+
+    uint64_t track = thread_uuid(pid, tid);
+    add_thread(pid, tid, comm);
+
+    if (output_format == TIMELINE_PERFETTO) {
+	int name_id = intern_name(name);
+	push_perfetto_slice_event({ call_time, track, SLICE_BEGIN, depth, name_id, 0, 0 });
+	push_perfetto_slice_event({ return_time, track, SLICE_END, depth, name_id, 0, 0 });
+    } else {
+	// complete events carry their duration, viewers nest them on load
+	write_json_slice(pid, tid, name, call_time, return_time);
+    }
+}
+
+void timeline_visit_marker(int pid, int tid, const char* comm, const char* name, uint64_t time) {
+    if (!output.is_open()) {
+	return;
+    }
+
+    add_thread(pid, tid, comm);
+    if (output_format == TIMELINE_PERFETTO) {
+	push_perfetto_slice_event({ time, thread_uuid(pid, tid), INSTANT, 0, intern_name(name), 0, 0 });
+    } else {
+	write_json_instant(pid, tid, name, time);
+    }
+}
+
+void timeline_visit_handoff(int pid, int from_tid, const char* from_comm, uint64_t from_time,
+			    int to_tid, const char* to_comm, uint64_t to_time, uint64_t id) {
+    if (!output.is_open()) {
+	return;
+    }
+
+    std::string from_name = "carry #" + std::to_string(id);
+    std::string to_name = "join #" + std::to_string(id);
+    add_thread(pid, from_tid, from_comm);
+    add_thread(pid, to_tid, to_comm);
+    if (output_format == TIMELINE_PERFETTO) {
+	push_perfetto_slice_event({ from_time, thread_uuid(pid, from_tid), INSTANT, 0, intern_name(from_name.c_str()),
+				    TRACK_EVENT_FLOW_IDS, id });
+	push_perfetto_slice_event({ to_time, thread_uuid(pid, to_tid), INSTANT, 0, intern_name(to_name.c_str()),
+				    TRACK_EVENT_TERMINATING_FLOW_IDS, id });
+    } else {
+	write_json_instant(pid, from_tid, from_name.c_str(), from_time);
+	write_json_flow(pid, from_tid, false, id, from_time);
+	write_json_instant(pid, to_tid, to_name.c_str(), to_time);
+	write_json_flow(pid, to_tid, true, id, to_time);
+    }
+}
+
+int timeline_close() {
+    if (!output.is_open()) {
+	return 0;
+    }
+
+    if (output_format == TIMELINE_PERFETTO) {
+	drain_reorder_window();
+    } else {
+	const char footer[] = "\n]}\n";
+	output.write(footer, sizeof(footer) - 1);
+    }
+    return output.close();
+}
@@ -0,0 +1,43 @@
+#ifndef __PROFILER_TIMELINE_HEADER__
+#define __PROFILER_TIMELINE_HEADER__
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+#define __API__ extern "C"
+#else
+#define __API__
+#endif
+
+/*
+ * Streams every call seen in the call/return stream to a trace viewer file.
+ * Memory use does not depend on the trace length: output goes through a
+ * fixed-size buffer and Perfetto events are reordered within a bounded window,
+ * so the longest calls may still be written out of timestamp order.
+ */
+enum timeline_format {
+    TIMELINE_CHROME,	/* Chrome trace-event JSON */
+    TIMELINE_PERFETTO,	/* Perfetto protobuf trace */
+};
+
+/* Returns 0 or a negative errno. */
+__API__ int timeline_open(const char* path, int format);
+
+/* @depth is the nesting level of the call on its thread, 0 for outermost. */
+__API__ void timeline_visit_call_return(int pid, int tid, const char* comm, const char* name, int depth,
+					uint64_t call_time, uint64_t return_time);
+
+/* A phase marker, an instant event on the thread's track. */
+__API__ void timeline_visit_marker(int pid, int tid, const char* comm, const char* name, uint64_t time);
+
+/*
+ * Work handed from @from_tid to @to_tid, which picked it up at @to_time: an
+ * instant on both threads and a flow arrow between them, @id numbers it.
+ */
+__API__ void timeline_visit_handoff(int pid, int from_tid, const char* from_comm, uint64_t from_time,
+				    int to_tid, const char* to_comm, uint64_t to_time, uint64_t id);
+
+/* Flushes pending events and closes the file. Returns 0 or a negative errno. */
+__API__ int timeline_close(void);
+
+#endif
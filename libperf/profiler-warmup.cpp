@@ -0,0 +1,146 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <time.h>
+
+#include "profiler-warmup.hpp"
+#include "profiler-options.hpp"
+
+namespace {
+    struct watch {
+	int id;
+	std::string class_sig;
+	std::string method;
+	std::string desc;	// empty for any overload
+	int compiles;
+	// compiles as of the last warm-up check, and the checks in a row that found them
+	int stable_compiles;
+	int stable_checks;
+	bool warm;
+    };
+
+    /*
+     * OSR compiles and recompiles after a deopt count as tier steps too, so
+     * the compile count alone can reach the top tier while C1 or interpreted
+     * code still runs. The count must then hold for this many checks, which
+     * start() makes every 1024 invocations: 16K invocations are more than C2
+     * waits for (Tier4CompileThreshold and CompileThreshold are 15000 and 10000).
+     */
+    const int STABLE_CHECKS = 16;
+
+    std::mutex watches_mutex;
+    std::vector<watch> watches;
+    std::atomic<bool> watching(false);
+    // CLOCK_MONOTONIC ms of the last compilation, or of the last watch_warmup()
+    std::atomic<int64_t> last_compile_ms(0);
+
+    int64_t now_ms() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    // -XX flags of the JVM we run in, NUL separated
+    std::string jvm_command_line() {
+	std::ifstream cmdline("/proc/self/cmdline");
+	return std::string(std::istreambuf_iterator<char>(cmdline), std::istreambuf_iterator<char>());
+    }
+
+    bool has_arg(const std::string& args, const char* arg) {
+	std::string needle = std::string(1, '\0') + arg;
+	return args.find(needle) != std::string::npos;
+    }
+
+    int compiles_to_top_tier() {
+	int compiles = get_profiler_options()->warmup_compiles;
+	if (compiles > 0) {
+	    return compiles;
+	}
+
+	std::string args = jvm_command_line();
+	if (has_arg(args, "-XX:-TieredCompilation")) {
+	    return 1;
+	}
+	// the last one given wins, like in the JVM
+	auto level = args.rfind(std::string(1, '\0') + "-XX:TieredStopAtLevel=");
+	if (level != std::string::npos && atoi(args.c_str() + level + strlen("-XX:TieredStopAtLevel=") + 1) < 4) {
+	    return 1;
+	}
+	return 2;
+    }
+
+    bool is_warm(watch& w) {
+	if (w.warm) {
+	    return true;
+	}
+
+	static const int top_tier = compiles_to_top_tier();
+	if (w.compiles < top_tier) {
+	    return false;
+	}
+	if (w.compiles != w.stable_compiles) {
+	    w.stable_compiles = w.compiles;
+	    w.stable_checks = 0;
+	}
+	int64_t quiet_ms = now_ms() - last_compile_ms.load(std::memory_order_relaxed);
+	if (++w.stable_checks < STABLE_CHECKS || quiet_ms < get_profiler_options()->warmup_quiet_ms) {
+	    return false;
+	}
+
+	w.warm = true;
+	printf("Trigger %d warmed up: %s::%s compiled %d times, no compilation for %lld ms\n",
+	       w.id, w.class_sig.c_str(), w.method.c_str(), w.compiles, (long long)quiet_ms);
+	fflush(stdout);
+	return true;
+    }
+}
+
+void watch_warmup(int id, const char* class_name, const char* method, const char* desc) {
+    std::lock_guard<std::mutex> lock(watches_mutex);
+    watches.push_back({ id, std::string("L") + class_name + ";", method, desc ? desc : "", 0, 0, 0, false });
+    last_compile_ms.store(now_ms(), std::memory_order_relaxed);
+    watching.store(true, std::memory_order_release);
+}
+
+int warmup_watching() {
+    return watching.load(std::memory_order_acquire);
+}
+
+void warmup_compiled(const char* class_sig, const char* method, const char* desc) {
+    last_compile_ms.store(now_ms(), std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(watches_mutex);
+    for (auto& w : watches) {
+	if (w.class_sig == class_sig && w.method == method && (w.desc.empty() || w.desc == desc)) {
+	    ++w.compiles;
+	}
+    }
+}
+
+int warmup_pending(int id) {
+    if (!watching.load(std::memory_order_acquire)) {
+	return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(watches_mutex);
+    bool pending = false;
+    for (auto& w : watches) {
+	if (w.id == id && !is_warm(w)) {
+	    pending = true;
+	}
+    }
+    return pending;
+}
+
+void reset_warmup() {
+    std::lock_guard<std::mutex> lock(watches_mutex);
+    watches.clear();
+    watching.store(false, std::memory_order_release);
+}
@@ -0,0 +1,42 @@
+#ifndef __PROFILER_WARMUP_HEADER__
+#define __PROFILER_WARMUP_HEADER__
+
+#if defined(__cplusplus)
+#define __API__ extern "C"
+#else
+#define __API__
+#endif
+
+/*
+ * Warm-up detection for triggers without a fixed countdown.
+ *
+ * Such a trigger is armed once its method has reached the top compilation
+ * tier and no method at all has been compiled for warmup_quiet_ms. The call
+ * tree of the trigger isn't known before its capture, so any compilation
+ * restarts the quiet interval. JVMTI doesn't report the tier of compiled
+ * code: the top tier is the n-th CompiledMethodLoad of the method, 2 with
+ * tiered compilation (C1, then C2), 1 without it or with TieredStopAtLevel
+ * below 4, unless warmup_compiles= says otherwise. OSR compiles and
+ * recompiles count as well, so the count must also stay the same over 16
+ * warm-up checks, longer than the method would run before C2 takes it.
+ */
+
+/*
+ * Holds trigger @id back until @method of @class_name (com/acme/Foo) with
+ * @desc, any overload if NULL, is warmed up. Compiled code of the method
+ * from before the call doesn't count, retransforming the class throws it
+ * away anyway.
+ */
+__API__ void watch_warmup(int id, const char* class_name, const char* method, const char* desc);
+/* 1 while the JVMTI agent has to report compilations */
+__API__ int warmup_watching(void);
+/* Reports a CompiledMethodLoad, @class_sig is the JVM signature (Lcom/acme/Foo;). */
+__API__ void warmup_compiled(const char* class_sig, const char* method, const char* desc);
+/*
+ * 1 if trigger @id has to wait for warm-up, 0 if it's warm or not watched.
+ * Each call is a warm-up check, made every 1024 invocations of the trigger.
+ */
+__API__ int warmup_pending(int id);
+__API__ void reset_warmup(void);
+
+#endif
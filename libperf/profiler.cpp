@@ -1,5 +1,12 @@
 #include "profiler.hpp"
 #include "profiler-backend.hpp"
+#include "profiler-report.hpp"
+#include "profiler-markers.hpp"
+#include "profiler-warmup.hpp"
+#include "profiler-policy.hpp"
+#include "profiler-carry.hpp"
+#include "profiler-options.hpp"
+#include "jit-methods.hpp"
 #include <stdlib.h> // I have no idea why it clashes with perf.h ;-(
 #include "perf.h"
 #include <stdio.h>
@@ -7,91 +14,306 @@
 #include <locale.h>
 
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <map>
+#include <string>
 
 pthread_mutex_t __wait_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t __wait_condition = PTHREAD_COND_INITIALIZER;
+// signalled with __wait_mutex each time the recorder is free again
+pthread_cond_t __done_condition = PTHREAD_COND_INITIALIZER;
+
+const int MAX_TRIGGERS = 256;
+const int NO_TRIGGER = -1;
+// invocations between two warm-up checks of a countdown=auto trigger
+const int WARMUP_CHECK_INTERVAL = 1024;
+
+struct trigger {
+    bool registered;
+    // has taken every capture of its policy
+    bool done;
+    std::string label;
+    // how the captured invocations ended, discarded ones included
+    int returned;
+    std::map<std::string, int> thrown;
+};
+
+trigger triggers[MAX_TRIGGERS];
+// registered triggers that have not taken all of their captures yet
+int triggers_pending = 0;
+// owns the recorder from its start() until its report is out
+int capturing_trigger = NO_TRIGGER;
+bool exit_when_done = true;
+
+// how the invocation being captured ended, set by stop() before the record ends
+std::string capture_exception;
+bool capture_threw = false;
+bool capture_discarded = false;
+// the capturing invocation is over, its carried work may not be
+int capture_ending = 0;
 
 int start_happens = 0;
-int stop_happens = 0;
+int record_done = 0;
 volatile int should_start = 0;
 volatile pid_t tid_to_profile = -1;
 volatile int __once_start = 0;
 
-int countdown_counter;
-
 extern "C" int is_near_to_poll(); // from builtin-record.h
 extern "C" void set_stop_record(); // from builtin-record.h
 
 extern "C" void dump_perf_file(); // from jvmti-agent.cpp
 
-static void* __thread_func(void* arg) {
-    pthread_mutex_lock(&__wait_mutex);
-    while (!should_start) {
-	pthread_cond_wait(&__wait_condition, &__wait_mutex);
+static void print_exits(int id) {
+    const trigger& t = triggers[id];
+    ::printf("Exits of %s captures: %d returned", t.label.c_str(), t.returned);
+    for (auto& e : t.thrown) {
+	::printf(", %d threw %s", e.second, e.first.c_str());
     }
-    should_start = 0;
-    pthread_mutex_unlock(&__wait_mutex);
+    ::printf("\n");
+    ::fflush(stdout);
+}
 
-    __atomic_store_n(&start_happens, 1, __ATOMIC_SEQ_CST);
+static void* __thread_func(void* arg) {
+    for (;;) {
+	pthread_mutex_lock(&__wait_mutex);
+	while (!should_start) {
+	    pthread_cond_wait(&__wait_condition, &__wait_mutex);
+	}
+	should_start = 0;
+	pthread_mutex_unlock(&__wait_mutex);
 
-    ::do_perf_record(tid_to_profile);
+	int id = __atomic_load_n(&capturing_trigger, __ATOMIC_SEQ_CST);
 
-    ::printf("Record done\n");
-    ::fflush(stdout);
-    
-    ::printf("Dumping symbols\n");
-    ::dump_perf_file();
-    
-    ::printf("Processing top\n");
-    ::do_perf_top();
-    __atomic_store_n(&stop_happens, 1, __ATOMIC_SEQ_CST);
+	// keep every JIT blob that is unloaded from now on until decoding is done
+	int registry_slot = jit_registry_pin(jit_registry_now());
+
+	// the recorder's CPU time is what max_cpu= limits
+	timespec cpu_begin, cpu_end;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_begin);
+
+	__atomic_store_n(&start_happens, 1, __ATOMIC_SEQ_CST);
+
+	marker_log_begin();
+	::do_perf_record(tid_to_profile, capture_carries(id));
+	marker_log_end();
+
+	::printf("Record done\n");
+	::fflush(stdout);
+
+	// the profiled thread goes on while we decode
+	__atomic_store_n(&record_done, 1, __ATOMIC_SEQ_CST);
+
+	// JVMTI callbacks keep queueing events while we own the registry
+	jit_registry_begin_read();
+
+	// repeated captures get their own reports and files
+	std::string label = triggers[id].label;
+	int capture_number = get_capture_number(id);
+	if (capture_number) {
+	    label += "." + std::to_string(capture_number);
+	}
+
+	if (capture_discarded) {
+	    ::printf("Capture for %s discarded, the invocation %s\n", label.c_str(),
+		     capture_threw ? "threw" : "returned");
+	} else {
+	    ::printf("Dumping symbols\n");
+	    ::dump_perf_file();
+
+	    ::printf("Processing top for %s\n", label.c_str());
+	    ::do_perf_top(label.c_str(), capture_threw ? capture_exception.c_str() : NULL);
+	}
+	print_exits(id);
+
+	jit_registry_end_read();
+	jit_registry_unpin(registry_slot);
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+	capture_cost(id, (cpu_end.tv_sec - cpu_begin.tv_sec) * 1000000000ull + cpu_end.tv_nsec - cpu_begin.tv_nsec);
+
+	// the recorder is free for the next trigger
+	__atomic_store_n(&capturing_trigger, NO_TRIGGER, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&__wait_mutex);
+	pthread_cond_broadcast(&__done_condition);
+	pthread_mutex_unlock(&__wait_mutex);
+    }
 
     return NULL;
 }
 
-void init(int cntr) {
+void add_trigger(int id, const char* label, int countdown, const char* policy) {
+    if (id < 0 || id >= MAX_TRIGGERS || triggers[id].registered) {
+	printf("Bad or duplicate trigger id %d, skipping %s!\n", id, label);
+	return;
+    }
+
     int prev_value = __atomic_exchange_n(&__once_start, 1, __ATOMIC_SEQ_CST);
     if (prev_value == 0) {
 	setlocale(LC_NUMERIC, "");
 
 	pthread_t thread;
 	pthread_create(&thread, NULL, __thread_func, NULL);
-	countdown_counter = cntr;
 
 	printf("------------------------------------------\n");
 	printf("-------LIBPERF PROFILER INITIALIZED-------\n");
-	printf("Init countdown: %d\n", countdown_counter);
 	printf("------------------------------------------\n");
+    }
+
+    triggers[id].label = label;
+    triggers[id].done = false;
+    triggers[id].returned = 0;
+    triggers[id].thrown.clear();
+    set_capture_policy(id, countdown, policy);
+    __atomic_add_fetch(&triggers_pending, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&triggers[id].registered, true, __ATOMIC_SEQ_CST);
+
+    printf("Trigger %d: %s, countdown: %d%s%s\n", id, label, countdown, policy && *policy ? ", " : "", policy ? policy : "");
+}
+
+int start(int id, int* countdown) {
+    if (id < 0 || id >= MAX_TRIGGERS || !__atomic_load_n(&triggers[id].registered, __ATOMIC_SEQ_CST)) {
+	return -1;
+    }
+    if (__atomic_load_n(&triggers[id].done, __ATOMIC_SEQ_CST)) {
+	return -1;
+    }
+    // countdown=auto: not before the JIT is done with the trigger
+    if (warmup_pending(id)) {
+	*countdown = capture_hold(id, WARMUP_CHECK_INTERVAL);
+	return 0;
+    }
+
+    int no_trigger = NO_TRIGGER;
+    if (!__atomic_compare_exchange_n(&capturing_trigger, &no_trigger, id, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+	// another capture is running, try again on the next call
+	*countdown = capture_hold(id, 1);
+	return 0;
+    }
+
+    if (!capture_due(id)) {
+	__atomic_store_n(&capturing_trigger, NO_TRIGGER, __ATOMIC_SEQ_CST);
+	*countdown = capture_next_countdown(id);
+	return *countdown ? 0 : -1;
+    }
+
+    __atomic_store_n(&capture_ending, 0, __ATOMIC_SEQ_CST);
+    carry_begin(syscall(SYS_gettid), capture_carries(id));
+
+    pthread_mutex_lock(&__wait_mutex);
+    should_start = 1;
+    tid_to_profile = syscall (SYS_gettid);
+    pthread_cond_signal(&__wait_condition);
+    pthread_mutex_unlock(&__wait_mutex);
+
+    while (! __atomic_load_n(&start_happens, __ATOMIC_SEQ_CST));
+    while (!is_near_to_poll());
+    return 1;
+}
+
+// ends the record, on the capturing thread or once its carried work is done
+static void finish_capture(int id) {
+    carry_end();
+    set_stop_record();
+    __atomic_store_n(&start_happens, 0, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&record_done, __ATOMIC_SEQ_CST)) ;
+    __atomic_store_n(&record_done, 0, __ATOMIC_SEQ_CST);
+
+    // decided by the policy, the countdowns handed out since may be anything
+    if (!capture_exhausted(id)) {
+	return;
+    }
+
+    __atomic_store_n(&triggers[id].done, true, __ATOMIC_SEQ_CST);
+    // await_captures() may have seen the recorder's broadcast before this
+    pthread_mutex_lock(&__wait_mutex);
+    int pending = __atomic_sub_fetch(&triggers_pending, 1, __ATOMIC_SEQ_CST);
+    if (pending == 0) {
+	pthread_cond_broadcast(&__done_condition);
+    }
+    pthread_mutex_unlock(&__wait_mutex);
+    if (pending == 0 && exit_when_done) {
+	// every trigger has its captures, leave once the last report is out
+	while (__atomic_load_n(&capturing_trigger, __ATOMIC_SEQ_CST) != NO_TRIGGER) ;
+	wait_for_reports();
+	::exit(1);
+    }
+}
+
+static void* __carry_func(void* arg) {
+    int id = (int)(intptr_t)arg;
+    int left = carry_wait(get_profiler_options()->carry_timeout_ms);
+    if (left) {
+	::printf("Capture for %s: %d carried tasks not done after %d ms, ending it\n",
+		 triggers[id].label.c_str(), left, get_profiler_options()->carry_timeout_ms);
+	::fflush(stdout);
+    }
+    finish_capture(id);
+    return NULL;
+}
+
+static int end_capture(int id, const char* exception, int* countdown) {
+    if (!start_happens || __atomic_load_n(&capturing_trigger, __ATOMIC_SEQ_CST) != id) {
+	return 0;
+    }
+    auto current_tid = syscall(SYS_gettid);
+    if (current_tid != tid_to_profile || __atomic_exchange_n(&capture_ending, 1, __ATOMIC_SEQ_CST)) {
+	return 0;
+    }
+
+    // read by the recorder once the record is over
+    capture_threw = exception != NULL;
+    capture_exception = exception ? exception : "";
+    capture_discarded = !capture_exit_wanted(id, capture_threw);
+    if (capture_threw) {
+	++triggers[id].thrown[capture_exception];
     } else {
-	printf("Already initialized! skipping this initialization!\n");
+	++triggers[id].returned;
+    }
+    *countdown = capture_next_countdown(id);
+
+    if (carry_origin_end()) {
+	// the record goes on until the work handed to other threads is done
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_create(&thread, &attr, __carry_func, (void*)(intptr_t)id);
+	pthread_attr_destroy(&attr);
+	return 1;
     }
+    finish_capture(id);
+    return 1;
 }
 
-void start() {
-    int prev_value = __atomic_fetch_sub(&countdown_counter, 1, __ATOMIC_SEQ_CST);
+int stop(int id, int* countdown) {
+    return end_capture(id, NULL, countdown);
+}
 
-    if (prev_value == 1) {
-	pthread_mutex_lock(&__wait_mutex);
-	should_start = 1;
-	tid_to_profile = syscall (SYS_gettid);
-	pthread_cond_signal(&__wait_condition);
-	pthread_mutex_unlock(&__wait_mutex);
+int stop_thrown(int id, const char* exception, int* countdown) {
+    return end_capture(id, exception ? exception : "?", countdown);
+}
 
-	while (! __atomic_load_n(&start_happens, __ATOMIC_SEQ_CST));
-	while (!is_near_to_poll());
+void keep_jvm_running() {
+    exit_when_done = false;
+}
+
+void await_captures() {
+    pthread_mutex_lock(&__wait_mutex);
+    while (__atomic_load_n(&triggers_pending, __ATOMIC_SEQ_CST) > 0
+	   || __atomic_load_n(&capturing_trigger, __ATOMIC_SEQ_CST) != NO_TRIGGER) {
+	pthread_cond_wait(&__done_condition, &__wait_mutex);
     }
+    pthread_mutex_unlock(&__wait_mutex);
+    wait_for_reports();
 }
 
-void stop() {
-    if (start_happens) {
-	auto current_tid = syscall(SYS_gettid);
-	if (current_tid == tid_to_profile) {
-	    set_stop_record();
-	    __atomic_store_n(&start_happens, 0, __ATOMIC_SEQ_CST);
-	    while (!__atomic_load_n(&stop_happens, __ATOMIC_SEQ_CST)) ;
-	    __atomic_store_n(&stop_happens, 0, __ATOMIC_SEQ_CST);
-	    
-	    ::exit(1);
-	}
+void detach_triggers() {
+    for (auto& t : triggers) {
+	__atomic_store_n(&t.registered, false, __ATOMIC_SEQ_CST);
     }
+    __atomic_store_n(&triggers_pending, 0, __ATOMIC_SEQ_CST);
+    reset_warmup();
+    reset_capture_policies();
 }
@@ -7,8 +7,44 @@
 #define __API__
 #endif
 
-__API__ void init(int cntr);
-__API__ void start();
-__API__ void stop();
+/*
+ * Registers trigger @id: the instrumented code calls start() after
+ * @countdown invocations, the capture @policy (see profiler-policy.hpp,
+ * NULL for one capture) decides which calls capture, and the reports are
+ * labelled with @label. Ids are small and dense, one capture runs at a
+ * time and the JVM exits once every trigger has taken all of its captures.
+ */
+__API__ void add_trigger(int id, const char* label, int countdown, const char* policy);
+
+/*
+ * Returns 1 if this call started a capture, 0 if a later call may still
+ * start one (the trigger is warming up, its policy doesn't want this
+ * invocation or another capture is running) and -1 if the trigger won't
+ * capture anymore. On 0, *@countdown is the invocations until the next
+ * start().
+ */
+__API__ int start(int id, int* countdown);
+/*
+ * Returns 1 if this call ended the capture of @id, *@countdown is then the
+ * invocations until the next start(), 0 once the trigger is done. With the
+ * carry policy the record goes on until the work handed to other threads is
+ * done, see profiler-carry.hpp.
+ */
+__API__ int stop(int id, int* countdown);
+/*
+ * Same as stop() for an invocation that ended with an exception of class
+ * @exception. The report says how the captured invocation ended, and the
+ * policy may discard captures by it (exit= in profiler-policy.hpp).
+ */
+__API__ int stop_thrown(int id, const char* exception, int* countdown);
+
+/*
+ * For agents attached to a running JVM: the JVM keeps running after the
+ * captures, await_captures() returns once every trigger has its report out
+ * and detach_triggers() forgets them, so that the next attach starts over.
+ */
+__API__ void keep_jvm_running(void);
+__API__ void await_captures(void);
+__API__ void detach_triggers(void);
 
 #endif
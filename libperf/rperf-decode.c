@@ -0,0 +1,894 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * rperf report generation: aggregates decoded Intel PT branches into the
+ * top, call tree, hot path, loop, timeline, profile, folded stack and
+ * decoded trace outputs.
+ *
+ * rperf__decode() runs the decoder with a perf_tool of its own that only
+ * synthesizes branch samples and hands them straight to the aggregator.
+ * 'perf script' uses the same hooks when the text dump is wanted as well.
+ */
+#include "perf.h"
+#include "util/debug.h"
+#include "util/session.h"
+#include "util/tool.h"
+#include "util/symbol.h"
+#include "util/thread.h"
+#include "util/evsel.h"
+#include "util/data.h"
+#include "util/auxtrace.h"
+#include "util/thread-stack.h"
+#include "util/call-path.h"
+#include "util/intel-pt.h"
+#include "util/block-range.h"
+#include <linux/kernel.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rperf-decode.h"
+#include "profiler-backend.hpp"
+#include "profiler-calltree.hpp"
+#include "profiler-options.hpp"
+#include "profiler-timeline.hpp"
+#include "profiler-profile.hpp"
+#include "profiler-report.hpp"
+#include "profiler-hotpaths.hpp"
+#include "profiler-loops.hpp"
+#include "profiler-markers.hpp"
+#include "profiler-carry.hpp"
+#include "jit-methods.hpp"
+#include "decoded-trace.hpp"
+
+static struct call_return_processor *rperf_crp;
+
+/* trigger the capture was taken for, NULL outside of triggered captures */
+static const char *rperf_label;
+/* what the captured invocation threw, NULL if it returned */
+static const char *rperf_exception;
+
+/*
+ * The fallback marker log by time, threads interleaved, and the next entry
+ * of it to merge with the trace.
+ */
+static int *rperf_marker_order;
+static int rperf_logged_marker;
+static int rperf_logged_marker_count;
+
+/* output files of the current capture */
+static struct {
+	char timeline[PATH_MAX];
+	char profile[PATH_MAX];
+	char folded[PATH_MAX];
+	char decoded[PATH_MAX];
+} rperf_paths;
+
+void rperf__set_capture_label(const char *label)
+{
+	rperf_label = label;
+}
+
+void rperf__set_capture_exit(const char *exception)
+{
+	rperf_exception = exception;
+}
+
+static void rperf__marker_name(u64 marker, char *buf, size_t size)
+{
+	const char *name = get_marker_name(marker);
+
+	if (name)
+		scnprintf(buf, size, "%s", name);
+	else
+		scnprintf(buf, size, "marker %" PRIu64, marker);
+}
+
+static void rperf__mark(struct thread *thread, u64 time, u64 marker)
+{
+	char name[128];
+
+	visit_marker(time, marker);
+	if (get_profiler_options()->timeline) {
+		rperf__marker_name(marker, name, sizeof(name));
+		timeline_visit_marker(thread->pid_, thread->tid, thread__comm_str(thread),
+				      name, time);
+	}
+}
+
+static int rperf__logged_marker_cmp(const void *a, const void *b)
+{
+	u64 tsc_a = get_logged_marker_tsc(*(const int *)a);
+	u64 tsc_b = get_logged_marker_tsc(*(const int *)b);
+
+	return tsc_a < tsc_b ? -1 : tsc_a > tsc_b;
+}
+
+static void rperf__sort_logged_markers(void)
+{
+	int i;
+
+	free(rperf_marker_order);
+	rperf_marker_order = NULL;
+	rperf_logged_marker_count = get_logged_marker_count();
+	if (!rperf_logged_marker_count)
+		return;
+
+	rperf_marker_order = malloc(rperf_logged_marker_count * sizeof(*rperf_marker_order));
+	if (!rperf_marker_order) {
+		pr_err("No memory for %d logged markers, skipping them\n", rperf_logged_marker_count);
+		rperf_logged_marker_count = 0;
+		return;
+	}
+	for (i = 0; i < rperf_logged_marker_count; ++i)
+		rperf_marker_order[i] = i;
+	qsort(rperf_marker_order, rperf_logged_marker_count, sizeof(*rperf_marker_order),
+	      rperf__logged_marker_cmp);
+}
+
+/*
+ * Markers logged without PTWRITE up to the time of @sample, of the threads
+ * taking part in the capture: the sampled one, or those of a carried capture.
+ */
+static void rperf__merge_logged_markers(struct perf_session *session,
+					struct perf_sample *sample)
+{
+	struct thread *thread;
+	int idx, tid;
+	u64 tsc, time;
+
+	for (; rperf_logged_marker < rperf_logged_marker_count; ++rperf_logged_marker) {
+		idx = rperf_marker_order[rperf_logged_marker];
+		tsc = get_logged_marker_tsc(idx);
+		time = intel_pt_tsc_to_perf_time(session, tsc);
+		if (time > sample->time)
+			break;
+
+		tid = get_logged_marker_tid(idx);
+		if (carry_enabled() ? !carry_includes(tid, tsc) : tid != (int)sample->tid)
+			continue;
+		thread = machine__findnew_thread(&session->machines.host, sample->pid, tid);
+		if (!thread)
+			continue;
+		if (carry_enabled())
+			visit_thread(time, tid);
+		rperf__mark(thread, time, get_logged_marker_id(idx));
+		thread__put(thread);
+	}
+}
+
+void rperf__visit_marker(struct perf_session *session, struct perf_sample *sample,
+			 struct perf_evsel *evsel, struct thread *thread)
+{
+	struct perf_synth_intel_ptwrite *data;
+
+	if (evsel->attr.type != PERF_TYPE_SYNTH ||
+	    evsel->attr.config != PERF_SYNTH_INTEL_PTWRITE)
+		return;
+
+	if (carry_enabled()) {
+		if (!carry_includes(sample->tid, intel_pt_perf_time_to_tsc(session, sample->time)))
+			return;
+		visit_thread(sample->time, sample->tid);
+	}
+
+	data = perf_sample__synth_ptr(sample);
+	if (perf_sample__bad_synth_size(sample, *data))
+		return;
+	rperf__mark(thread, sample->time, le64_to_cpu(data->payload));
+}
+
+/*
+ * Every capture gets its own files: the label goes in front of the extension,
+ * so /tmp/run.json becomes /tmp/run.order-entry.json.
+ */
+static void rperf__capture_path(char *buf, size_t size, const char *path)
+{
+	const char *base, *ext;
+	size_t len, i;
+
+	if (!path || !rperf_label) {
+		scnprintf(buf, size, "%s", path ?: "");
+		return;
+	}
+
+	base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+	ext = strrchr(base, '.');
+	if (!ext || ext == base)
+		ext = path + strlen(path);
+
+	len = scnprintf(buf, size, "%.*s.", (int)(ext - path), path);
+	for (i = 0; rperf_label[i] && len + 1 < size; ++i)
+		buf[len++] = isalnum(rperf_label[i]) || strchr("-_.", rperf_label[i]) ? rperf_label[i] : '_';
+	scnprintf(buf + len, size - len, "%s", ext);
+}
+
+/* folded stacks are generated from the call tree, saved profiles keep it */
+static bool rperf__wants_call_tree(void)
+{
+	return get_profiler_options()->call_tree || get_profiler_options()->folded ||
+	       get_profiler_options()->profile;
+}
+
+static int rperf__call_path_depth(struct call_path *cp)
+{
+	int depth = 0;
+
+	/* the root call path is not a function */
+	while (cp->parent && cp->parent->parent) {
+		cp = cp->parent;
+		depth++;
+	}
+	return depth;
+}
+
+static int rperf__process_call_return(struct call_return *cr, void *data)
+{
+	struct perf_session *session = data;
+	struct call_path *cp = cr->cp;
+	/* the root call path is not a function */
+	struct call_path *parent = cp->parent && cp->parent->parent ? cp->parent : NULL;
+	struct jit_code_info jit;
+	char buf[32];
+	const char *name;
+
+	if (cp->sym) {
+		name = cp->sym->name;
+	} else if (jit_registry_lookup(cp->ip, intel_pt_perf_time_to_tsc(session, cr->call_time), &jit)) {
+		name = jit.name;
+	} else {
+		scnprintf(buf, sizeof(buf), "[%#" PRIx64 "]", cp->ip);
+		name = buf;
+	}
+
+	if (rperf__wants_call_tree())
+		visit_call_return(cp, parent, name, cr->call_time, cr->return_time);
+	if (get_profiler_options()->hot_paths)
+		visit_hot_path_call(cr->thread->tid, cp, parent, name,
+				    cr->call_time, cr->return_time);
+	if (get_profiler_options()->timeline)
+		timeline_visit_call_return(cr->thread->pid_, cr->thread->tid,
+					   thread__comm_str(cr->thread), name,
+					   rperf__call_path_depth(cp),
+					   cr->call_time, cr->return_time);
+	return 0;
+}
+
+static int rperf__flush_thread_stack(struct thread *thread, void *data __maybe_unused)
+{
+	return thread_stack__flush(thread);
+}
+
+static void rperf__print_call_tree(void)
+{
+	int i;
+
+	prepare_call_tree(get_profiler_options()->call_tree_min_pct);
+
+	printf("Call tree (inclusive / exclusive / calls):\n");
+	for (i = 0; i < get_call_tree_len(); ++i) {
+		printf("\t%'16lluns %'16lluns %'10llu\t%*s%s\n",
+		       get_call_tree_inclusive(i), get_call_tree_exclusive(i),
+		       get_call_tree_calls(i), 2 * get_call_tree_depth(i), "",
+		       get_call_tree_name(i));
+	}
+}
+
+static void rperf__print_hot_sequences(int by_count)
+{
+	int i;
+
+	for (i = 0; i < get_hot_sequence_len(by_count); ++i) {
+		printf("\t%'16lluns %'10llu\t%s\n",
+		       get_hot_sequence_time(by_count, i),
+		       get_hot_sequence_count(by_count, i),
+		       get_hot_sequence_name(by_count, i));
+	}
+}
+
+static void rperf__print_hot_paths(void)
+{
+	int i;
+
+	prepare_hot_paths(get_profiler_options()->hot_paths);
+
+	printf("Hot call paths (self / inclusive / calls):\n");
+	for (i = 0; i < get_hot_path_len(); ++i) {
+		printf("\t%'16lluns %'16lluns %'10llu\t%s\n",
+		       get_hot_path_self(i), get_hot_path_inclusive(i),
+		       get_hot_path_calls(i), get_hot_path_name(i));
+	}
+
+	printf("Repeated call sequences by time (time / occurrences):\n");
+	rperf__print_hot_sequences(0);
+	printf("Repeated call sequences by occurrences (time / occurrences):\n");
+	rperf__print_hot_sequences(1);
+}
+
+static void rperf__write_folded_stacks(struct perf_session *session)
+{
+	const char *path = rperf_paths.folded;
+	u64 first = get_first_timestamp();
+	u64 last = get_last_timestamp();
+	double scale = 1.0;
+	int err;
+
+	/* TSC runs at a constant rate, so the whole capture gives the ratio */
+	if (get_profiler_options()->folded_cycles && last > first)
+		scale = (double)(intel_pt_perf_time_to_tsc(session, last) -
+				 intel_pt_perf_time_to_tsc(session, first)) / (last - first);
+
+	err = write_folded_stacks(path, scale);
+	if (err)
+		pr_err("Couldn't write folded stacks to %s: %s\n", path, strerror(-err));
+}
+
+static int rperf__branch_kind(u32 flags)
+{
+	if (flags & (PERF_IP_FLAG_SYSCALLRET | PERF_IP_FLAG_ASYNC |
+		     PERF_IP_FLAG_INTERRUPT | PERF_IP_FLAG_TX_ABORT |
+		     PERF_IP_FLAG_TRACE_BEGIN | PERF_IP_FLAG_TRACE_END))
+		return BRANCH_OTHER;
+	if (flags & PERF_IP_FLAG_CALL)
+		return BRANCH_CALL;
+	if (flags & PERF_IP_FLAG_RETURN)
+		return BRANCH_RETURN;
+	if (flags & PERF_IP_FLAG_CONDITIONAL)
+		return BRANCH_CONDITIONAL;
+	return BRANCH_JUMP;
+}
+
+/*
+ * Loop statistics plus block-range coverage of the straight-line code that
+ * led to the branch, the same accounting 'perf annotate' does for LBR.
+ */
+static void rperf__visit_loop_branch(struct perf_sample *sample, const char *sym_name)
+{
+	struct block_range_iter iter;
+	struct block_range *entry;
+	uint64_t start;
+
+	if (!loop_stats_visit_branch(sample->tid, sample->ip, sample->addr,
+				     rperf__branch_kind(sample->flags), sym_name, &start))
+		return;
+
+	iter = block_range__create(start, sample->ip);
+	if (!block_range_iter__valid(&iter))
+		return;
+
+	block_range_iter(&iter)->entry++;
+	do {
+		entry = block_range_iter(&iter);
+		entry->coverage++;
+	} while (block_range_iter__next(&iter));
+
+	block_range_iter(&iter)->taken++;
+}
+
+/* how many times the branch at @ip was reached, taken or not */
+static uint64_t rperf__branch_executions(uint64_t ip, void *data __maybe_unused)
+{
+	struct block_range *br = block_range__find(ip);
+
+	return br && br->is_branch && br->end == ip ? br->coverage : 0;
+}
+
+static void rperf__print_loop_stats(void)
+{
+	int m, i, b;
+
+	prepare_loop_stats(get_profiler_options()->loops, rperf__branch_executions, NULL);
+
+	printf("Loops and branches in hot methods:\n");
+	for (m = 0; m < get_loop_method_len(); ++m) {
+		printf("\t%s\n", get_loop_method_name(m));
+
+		for (i = 0; i < get_method_loop_len(m); ++i) {
+			printf("\t\tloop %#llx-%#llx\t%'10llu runs %'14llu iterations\ttrips:",
+			       get_method_loop_head(m, i), get_method_loop_back_edge(m, i),
+			       get_method_loop_runs(m, i), get_method_loop_iterations(m, i));
+			for (b = 0; b < LOOP_HISTOGRAM_BUCKETS; ++b) {
+				u64 runs = get_method_loop_histogram(m, i, b);
+
+				if (!runs)
+					continue;
+				if (b == LOOP_HISTOGRAM_BUCKETS - 1)
+					printf(" [%llu+] %'llu", 1ULL << b, runs);
+				else if (b == 0)
+					printf(" [1] %'llu", runs);
+				else
+					printf(" [%llu-%llu] %'llu", 1ULL << b, (2ULL << b) - 1, runs);
+			}
+			printf("\n");
+		}
+
+		for (i = 0; i < get_method_branch_len(m); ++i) {
+			u64 taken = get_method_branch_taken(m, i);
+			u64 not_taken = get_method_branch_not_taken(m, i);
+
+			printf("\t\tbranch %#llx\t%'14llu taken %'14llu not taken\t%6.2f%%\n",
+			       get_method_branch_ip(m, i), taken, not_taken,
+			       100.0 * taken / (taken + not_taken));
+		}
+	}
+}
+
+/*
+ * Feeds the branch target into the rperf aggregator. JIT code is resolved
+ * against the time-versioned registry first: the perf map only describes
+ * the code cache as it was when the capture finished.
+ */
+void rperf__visit_branch(struct perf_session *session,
+			 struct perf_sample *sample,
+			 struct thread *thread,
+			 struct addr_location *from_al)
+{
+	struct addr_location al;
+	struct jit_code_info jit;
+	const char *sym_name = "unknown";
+	const char *dso_name = "unknown";
+	const void *key = NULL;
+	int code_kind = JIT_CODE_NONE;
+	u64 offset = sample->addr;
+	u64 tsc = intel_pt_perf_time_to_tsc(session, sample->time);
+
+	if (rperf_logged_marker < rperf_logged_marker_count)
+		rperf__merge_logged_markers(session, sample);
+
+	/* carried captures record every thread, only those taking part count */
+	if (carry_enabled()) {
+		if (!carry_includes(sample->tid, tsc))
+			return;
+		visit_thread(sample->time, sample->tid);
+	}
+
+	thread__resolve(thread, &al, sample);
+
+	if (al.map && al.map->dso) {
+		key = al.map->dso;
+		offset = al.addr;
+		if (al.map->dso->short_name)
+			dso_name = al.map->dso->short_name;
+	}
+	if (al.sym) {
+		key = al.sym;
+		offset = al.addr - al.sym->start;
+		if (al.sym->name)
+			sym_name = al.sym->name;
+	}
+
+	if (jit_registry_lookup(sample->addr, tsc, &jit)) {
+		key = jit.id;
+		sym_name = jit.name;
+		code_kind = jit.kind;
+		offset = sample->addr - jit.start_addr;
+	}
+
+	if (rperf_crp) {
+		/* key JIT call paths by address so that they resolve by time */
+		if (code_kind != JIT_CODE_NONE)
+			al.sym = NULL;
+		thread_stack__process(thread, thread__comm(thread), sample,
+				      from_al, &al, 0, rperf_crp);
+	}
+
+	visit_sample(sample->time, key, sym_name, dso_name, code_kind);
+	if (get_profiler_options()->loops)
+		rperf__visit_loop_branch(sample, sym_name);
+	if (get_profiler_options()->decoded)
+		decoded_trace_write_branch(sample->time, sample->pid, sample->tid,
+					   key, sym_name, dso_name, offset);
+}
+
+/* off-CPU slices nest inside whatever call the thread was switched out in */
+#define RPERF_OFF_CPU_DEPTH	(1 << 20)
+
+void rperf__visit_switch(struct perf_session *session, union perf_event *event,
+			 struct perf_sample *sample, struct thread *thread)
+{
+	bool out = event->header.misc & PERF_RECORD_MISC_SWITCH_OUT;
+	uint64_t off_cpu_begin;
+
+	if (!carry_visit_switch(sample->tid, intel_pt_perf_time_to_tsc(session, sample->time),
+				out, &off_cpu_begin))
+		return;
+
+	if (get_profiler_options()->timeline)
+		timeline_visit_call_return(thread->pid_, thread->tid, thread__comm_str(thread),
+					   "off-cpu", RPERF_OFF_CPU_DEPTH,
+					   intel_pt_tsc_to_perf_time(session, off_cpu_begin),
+					   sample->time);
+}
+
+static u64 rperf__tsc_ns(struct perf_session *session, u64 begin, u64 end)
+{
+	return intel_pt_tsc_to_perf_time(session, end) - intel_pt_tsc_to_perf_time(session, begin);
+}
+
+static const char *rperf__thread_comm(struct perf_session *session, int tid)
+{
+	struct thread *thread = machine__find_thread(&session->machines.host, getpid(), tid);
+	const char *comm = thread ? thread__comm_str(thread) : ":?";
+
+	thread__put(thread);
+	return comm;
+}
+
+/* arrows from where work was handed over to where it was picked up */
+static void rperf__visit_handoffs(struct perf_session *session)
+{
+	int i, handoff;
+
+	for (i = 0; i < get_carry_span_count(); ++i) {
+		handoff = get_carry_span_handoff(i);
+		if (handoff < 0)
+			continue;
+		timeline_visit_handoff(getpid(),
+				       get_carry_handoff_tid(handoff),
+				       rperf__thread_comm(session, get_carry_handoff_tid(handoff)),
+				       intel_pt_tsc_to_perf_time(session, get_carry_handoff_tsc(handoff)),
+				       get_carry_span_tid(i),
+				       rperf__thread_comm(session, get_carry_span_tid(i)),
+				       intel_pt_tsc_to_perf_time(session, get_carry_span_begin(i)),
+				       handoff + 1);
+	}
+}
+
+/*
+ * Where a carried capture spent its time: per thread, from joining to
+ * leaving, how long it waited in the queue since the handoff and how long
+ * it was switched out; end to end is from the start of the capture to the
+ * last thread leaving.
+ */
+static void rperf__print_carry(struct perf_session *session)
+{
+	u64 begin = get_carry_span_begin(0), end = get_carry_span_end(0);
+	int i, handoff;
+
+	for (i = 1; i < get_carry_span_count(); ++i)
+		if (get_carry_span_end(i) > end)
+			end = get_carry_span_end(i);
+
+	printf("Carried across %d handoffs, end to end %'lluns:\n",
+	       get_carry_span_count() - 1, rperf__tsc_ns(session, begin, end));
+	for (i = 0; i < get_carry_span_count(); ++i) {
+		u64 span_begin = get_carry_span_begin(i);
+		u64 ran = rperf__tsc_ns(session, span_begin, get_carry_span_end(i));
+		u64 off_cpu = rperf__tsc_ns(session, span_begin, span_begin + get_carry_span_off_cpu(i));
+		int tid = get_carry_span_tid(i);
+
+		handoff = get_carry_span_handoff(i);
+		if (handoff < 0)
+			printf("\tstart\t%d %s\t", tid, rperf__thread_comm(session, tid));
+		else
+			printf("\t#%d\t%d -> %d %s\tqueued %'lluns\t", handoff + 1,
+			       get_carry_handoff_tid(handoff), tid, rperf__thread_comm(session, tid),
+			       rperf__tsc_ns(session, get_carry_handoff_tsc(handoff), span_begin));
+		printf("+%'lluns\tran %'lluns\toff-cpu %'lluns\n",
+		       rperf__tsc_ns(session, begin, span_begin), ran, off_cpu);
+	}
+}
+
+/* the top split by the phase markers the profiled code put into the trace */
+static void rperf__print_phases(void)
+{
+	uint64_t total_ns = get_total_time();
+	char name[128];
+	int i, j;
+
+	prepare_phases(get_profiler_options()->top);
+
+	printf("Phases:\n");
+	for (i = 0; i < get_phase_count(); ++i) {
+		rperf__marker_name(get_phase_marker(i), name, sizeof(name));
+		printf("\t%s\tx%'" PRIu64 "\t->\t%'" PRIu64 "ns\t%6.2f%%\n", name,
+		       get_phase_occurrences(i), get_phase_time(i),
+		       total_ns ? 100.0 * get_phase_time(i) / total_ns : 0.0);
+		for (j = 0; j < get_phase_top_len(i); ++j)
+			printf("\t\t%d\t%s\t->\t%'" PRIu64 "ns\n", j + 1,
+			       get_routine_name(get_phase_top_routine(i, j)),
+			       get_phase_top_time(i, j));
+	}
+}
+
+static void rperf__print_jit_event(const struct jit_event *event, void *data)
+{
+	static const char * const kinds[] = {
+		[JIT_EVENT_LOAD]	= "compiled",
+		[JIT_EVENT_RECOMPILE]	= "recompiled",
+		[JIT_EVENT_UNLOAD]	= "unloaded",
+	};
+	struct perf_session *session = data;
+	u64 t = intel_pt_tsc_to_perf_time(session, event->tsc);
+
+	printf("\t+%'lluns\t%-10s\t%s (version %d)\n",
+	       t - get_first_timestamp(), kinds[event->kind], event->name, event->version);
+}
+
+/*
+ * Code cache changes recorded by the JVMTI agent and deoptimizations seen in
+ * the trace, relative to the first sample.
+ */
+static void rperf__print_jit_timeline(struct perf_session *session)
+{
+	u64 first = get_first_timestamp();
+	u64 last = get_last_timestamp();
+	int i;
+
+	printf("JIT events during capture:\n");
+	jit_registry_for_each_event(intel_pt_perf_time_to_tsc(session, first),
+				    intel_pt_perf_time_to_tsc(session, last) + 1,
+				    rperf__print_jit_event, session);
+
+	printf("Deoptimizations:\n");
+	for (i = 0; i < get_deopt_count(); ++i) {
+		printf("\t+%'lluns\t%s\t->\tslow path %'lluns\n",
+		       get_deopt_timestamp(i) - first, get_deopt_method(i),
+		       get_deopt_slow_path_time(i));
+	}
+}
+
+int rperf__report_begin(struct perf_session *session)
+{
+	const struct profiler_options *opts = get_profiler_options();
+	int err;
+
+	/* keys of the previous capture died with its session */
+	reset_samples();
+	reset_call_tree();
+	reset_loop_stats();
+	block_range__free_all();
+	rperf_logged_marker = 0;
+	rperf__sort_logged_markers();
+
+	rperf__capture_path(rperf_paths.timeline, sizeof(rperf_paths.timeline), opts->timeline);
+	rperf__capture_path(rperf_paths.profile, sizeof(rperf_paths.profile), opts->profile);
+	rperf__capture_path(rperf_paths.folded, sizeof(rperf_paths.folded), opts->folded);
+	rperf__capture_path(rperf_paths.decoded, sizeof(rperf_paths.decoded), opts->decoded);
+
+	if (rperf__wants_call_tree() || get_profiler_options()->hot_paths ||
+	    get_profiler_options()->timeline) {
+		rperf_crp = call_return_processor__new(rperf__process_call_return, session);
+		if (!rperf_crp)
+			return -ENOMEM;
+	}
+
+	if (get_profiler_options()->hot_paths)
+		hot_paths_init(get_profiler_options()->hot_sequence_len);
+
+	if (get_profiler_options()->timeline) {
+		err = timeline_open(rperf_paths.timeline, opts->timeline_format);
+		if (err) {
+			pr_err("Couldn't open timeline %s: %s\n",
+			       rperf_paths.timeline, strerror(-err));
+			return err;
+		}
+	}
+
+	if (get_profiler_options()->decoded) {
+		err = decoded_trace_open(rperf_paths.decoded);
+		if (err) {
+			pr_err("Couldn't open decoded trace %s: %s\n",
+			       rperf_paths.decoded, strerror(-err));
+			return err;
+		}
+	}
+	return 0;
+}
+
+void rperf__report_end(struct perf_session *session)
+{
+	if (rperf_crp) {
+		/* calls still on the stack are reported as not returning */
+		machine__for_each_thread(&session->machines.host, rperf__flush_thread_stack, NULL);
+	}
+	/* the threads' names are only known once the events are processed */
+	if (carry_enabled() && get_profiler_options()->timeline)
+		rperf__visit_handoffs(session);
+	if (timeline_close())
+		pr_err("Couldn't write timeline %s\n", rperf_paths.timeline);
+	if (decoded_trace_close())
+		pr_err("Couldn't write decoded trace %s\n", rperf_paths.decoded);
+
+	if (rperf_label && rperf_exception)
+		printf("Capture for trigger %s, threw %s:\n", rperf_label, rperf_exception);
+	else if (rperf_label)
+		printf("Capture for trigger %s, returned:\n", rperf_label);
+
+	prepare_top(get_profiler_options()->top);
+
+	int top_len = get_top_len();
+	uint64_t total_ns = get_total_time();
+	for (int i = 0; i < top_len; ++i) {
+	    const char* func = get_top_by_idx(i);
+	    uint64_t ns = get_counters_by_idx(i);
+	    int invoked = get_invoke_count_by_idx(i);
+	    const char* category = get_category_name(get_category_by_idx(i));
+	    printf("\t%d\t[%d]: %s\t->\t%'lluns\t(%s)\n", i+1, invoked, func, ns, category);
+	}
+	if (top_len < get_routine_count())
+		printf("\t... %d more\n", get_routine_count() - top_len);
+	printf("Total for all functions: %'lldns\n", total_ns);
+
+	printf("Breakdown by category:\n");
+	for (int i = 0; i < CATEGORY_MAX; ++i) {
+	    uint64_t ns = get_category_time(i);
+	    if (!ns)
+		continue;
+	    printf("\t%-16s\t->\t%'lluns\t%6.2f%%\n", get_category_name(i), ns,
+		   total_ns ? 100.0 * ns / total_ns : 0.0);
+	}
+
+	if (get_phase_count())
+		rperf__print_phases();
+
+	if (carry_enabled())
+		rperf__print_carry(session);
+
+	rperf__print_jit_timeline(session);
+
+	if (get_profiler_options()->call_tree)
+		rperf__print_call_tree();
+
+	if (get_profiler_options()->hot_paths)
+		rperf__print_hot_paths();
+
+	if (get_profiler_options()->loops)
+		rperf__print_loop_stats();
+
+	if (get_profiler_options()->profile) {
+		/* the saved tree is not pruned, diffs need the small nodes too */
+		prepare_call_tree(0.0);
+		if (save_profile(rperf_paths.profile))
+			pr_err("Couldn't save profile %s\n", rperf_paths.profile);
+	}
+
+	if (get_profiler_options()->folded)
+		rperf__write_folded_stacks(session);
+
+	if (get_profiler_options()->report_dir &&
+	    write_report(get_profiler_options()->report_dir, rperf_label, rperf_exception,
+			 get_profiler_options()->report_formats))
+		pr_err("Couldn't start the report writer\n");
+	fflush(stdout);
+}
+
+void rperf__report_free(void)
+{
+	/* thread stacks hold on to it until the session is gone */
+	call_return_processor__free(rperf_crp);
+	rperf_crp = NULL;
+	free(rperf_marker_order);
+	rperf_marker_order = NULL;
+	rperf_logged_marker_count = 0;
+}
+
+struct rperf_decode {
+	struct perf_tool	tool;
+	struct perf_session	*session;
+};
+
+static int rperf_decode__sample(struct perf_tool *tool,
+				union perf_event *event,
+				struct perf_sample *sample,
+				struct perf_evsel *evsel,
+				struct machine *machine)
+{
+	struct rperf_decode *decode = container_of(tool, struct rperf_decode, tool);
+	struct addr_location al;
+	struct thread *thread;
+
+	if (evsel->attr.type == PERF_TYPE_SYNTH) {
+		thread = machine__findnew_thread(machine, sample->pid, sample->tid);
+		if (!thread)
+			return -1;
+		rperf__visit_marker(decode->session, sample, evsel, thread);
+		thread__put(thread);
+		return 0;
+	}
+
+	if (!is_bts_event(&evsel->attr))
+		return 0;
+
+	/* the branch source is only needed to track calls and returns */
+	if (rperf_crp) {
+		if (machine__resolve(machine, &al, sample) < 0) {
+			pr_err("problem processing %d event, skipping it.\n",
+			       event->header.type);
+			return -1;
+		}
+		rperf__visit_branch(decode->session, sample, al.thread, &al);
+		addr_location__put(&al);
+		return 0;
+	}
+
+	thread = machine__findnew_thread(machine, sample->pid, sample->tid);
+	if (!thread)
+		return -1;
+	rperf__visit_branch(decode->session, sample, thread, NULL);
+	thread__put(thread);
+	return 0;
+}
+
+static int rperf_decode__switch(struct perf_tool *tool,
+				union perf_event *event,
+				struct perf_sample *sample,
+				struct machine *machine)
+{
+	struct rperf_decode *decode = container_of(tool, struct rperf_decode, tool);
+	struct thread *thread;
+
+	if (perf_event__process_switch(tool, event, sample, machine) < 0)
+		return -1;
+
+	thread = machine__findnew_thread(machine, sample->pid, sample->tid);
+	if (!thread)
+		return -1;
+	rperf__visit_switch(decode->session, event, sample, thread);
+	thread__put(thread);
+	return 0;
+}
+
+int rperf__decode(const char *input_name)
+{
+	struct itrace_synth_opts itrace_synth_opts = { .set = true, };
+	struct rperf_decode decode = {
+		.tool = {
+			.sample		 = rperf_decode__sample,
+			.mmap		 = perf_event__process_mmap,
+			.mmap2		 = perf_event__process_mmap2,
+			.comm		 = perf_event__process_comm,
+			.exit		 = perf_event__process_exit,
+			.fork		 = perf_event__process_fork,
+			.context_switch	 = rperf_decode__switch,
+			.attr		 = perf_event__process_attr,
+			.id_index	 = perf_event__process_id_index,
+			.auxtrace_info	 = perf_event__process_auxtrace_info,
+			.auxtrace	 = perf_event__process_auxtrace,
+			.auxtrace_error	 = perf_event__process_auxtrace_error,
+			.ordered_events	 = true,
+			.ordering_requires_timestamps = true,
+		},
+	};
+	struct perf_data data = {
+		.file.path	= input_name,
+		.mode		= PERF_DATA_MODE_READ,
+	};
+	struct perf_session *session;
+	int err;
+
+	/* branches and the phase markers are all the aggregator looks at */
+	itrace_synth_opts__set_default(&itrace_synth_opts);
+	itrace_synth_opts.instructions = false;
+	itrace_synth_opts.transactions = false;
+	itrace_synth_opts.pwr_events = false;
+
+	session = perf_session__new(&data, false, &decode.tool);
+	if (session == NULL)
+		return -1;
+	decode.session = session;
+
+	err = symbol__init(&session->header.env);
+	if (err < 0)
+		goto out_delete;
+
+	session->itrace_synth_opts = &itrace_synth_opts;
+
+	err = rperf__report_begin(session);
+	if (err)
+		goto out_delete;
+
+	err = perf_session__process_events(session);
+
+	rperf__report_end(session);
+
+out_delete:
+	perf_session__delete(session);
+	rperf__report_free();
+	return err;
+}
@@ -0,0 +1,39 @@
+#ifndef __RPERF_DECODE_H
+#define __RPERF_DECODE_H
+
+struct perf_session;
+struct perf_sample;
+struct thread;
+struct addr_location;
+struct perf_evsel;
+union perf_event;
+
+/* Decodes a recording straight into the rperf report, without a text dump. */
+int rperf__decode(const char *input_name);
+
+/*
+ * Labels the reports of the next decodes with the trigger that took the
+ * capture and gives each capture its own output files. NULL for none.
+ */
+void rperf__set_capture_label(const char *label);
+/* The class of the exception the captured invocation threw, NULL if it returned. */
+void rperf__set_capture_exit(const char *exception);
+
+/*
+ * Hooks for tools that walk the samples themselves: begin before processing
+ * events, visit every branch, end prints the report, free once the session
+ * is deleted. @from_al may be NULL unless calls are tracked.
+ */
+int rperf__report_begin(struct perf_session *session);
+void rperf__visit_branch(struct perf_session *session, struct perf_sample *sample,
+			 struct thread *thread, struct addr_location *from_al);
+/* a synthesized ptwrite sample is a phase marker, anything else is ignored */
+void rperf__visit_marker(struct perf_session *session, struct perf_sample *sample,
+			 struct perf_evsel *evsel, struct thread *thread);
+/* context switches split the threads of carried captures into on and off CPU */
+void rperf__visit_switch(struct perf_session *session, union perf_event *event,
+			 struct perf_sample *sample, struct thread *thread);
+void rperf__report_end(struct perf_session *session);
+void rperf__report_free(void);
+
+#endif /* __RPERF_DECODE_H */
@@ -7,30 +7,104 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+#undef ru_raiffeisen_PerfPtProf_MAX_TRIGGERS
+#define ru_raiffeisen_PerfPtProf_MAX_TRIGGERS 256L
 /*
  * Class:     ru_raiffeisen_PerfPtProf
- * Method:    init
- * Signature: (I)V
+ * Method:    registerTrigger
+ * Signature: (ILjava/lang/String;ILjava/lang/String;)V
  */
-JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_init
-  (JNIEnv *, jclass, jint);
+JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_registerTrigger
+  (JNIEnv *, jclass, jint, jstring, jint, jstring);
+
+/*
+ * Class:     ru_raiffeisen_PerfPtProf
+ * Method:    watchWarmup
+ * Signature: (ILjava/lang/String;Ljava/lang/String;Ljava/lang/String;)V
+ */
+JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_watchWarmup
+  (JNIEnv *, jclass, jint, jstring, jstring, jstring);
 
 /*
  * Class:     ru_raiffeisen_PerfPtProf
  * Method:    start
+ * Signature: (I)I
+ */
+JNIEXPORT jint JNICALL Java_ru_raiffeisen_PerfPtProf_start
+  (JNIEnv *, jclass, jint);
+
+/*
+ * Class:     ru_raiffeisen_PerfPtProf
+ * Method:    stop
+ * Signature: (I)I
+ */
+JNIEXPORT jint JNICALL Java_ru_raiffeisen_PerfPtProf_stop
+  (JNIEnv *, jclass, jint);
+
+/*
+ * Class:     ru_raiffeisen_PerfPtProf
+ * Method:    stopThrown
+ * Signature: (ILjava/lang/String;)I
+ */
+JNIEXPORT jint JNICALL Java_ru_raiffeisen_PerfPtProf_stopThrown
+  (JNIEnv *, jclass, jint, jstring);
+
+/*
+ * Class:     ru_raiffeisen_PerfPtProf
+ * Method:    awaitCaptures
  * Signature: ()V
  */
-JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_start
+JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_awaitCaptures
   (JNIEnv *, jclass);
 
 /*
  * Class:     ru_raiffeisen_PerfPtProf
- * Method:    stop
+ * Method:    detach
  * Signature: ()V
  */
-JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_stop
+JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_detach
   (JNIEnv *, jclass);
 
+/*
+ * Class:     ru_raiffeisen_PerfPtProf
+ * Method:    mark
+ * Signature: (J)V
+ */
+JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_mark
+  (JNIEnv *, jclass, jlong);
+
+/*
+ * Class:     ru_raiffeisen_PerfPtProf
+ * Method:    nameMarker
+ * Signature: (JLjava/lang/String;)V
+ */
+JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_nameMarker
+  (JNIEnv *, jclass, jlong, jstring);
+
+/*
+ * Class:     ru_raiffeisen_PerfPtProf
+ * Method:    carry
+ * Signature: ()J
+ */
+JNIEXPORT jlong JNICALL Java_ru_raiffeisen_PerfPtProf_carry
+  (JNIEnv *, jclass);
+
+/*
+ * Class:     ru_raiffeisen_PerfPtProf
+ * Method:    join
+ * Signature: (J)V
+ */
+JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_join
+  (JNIEnv *, jclass, jlong);
+
+/*
+ * Class:     ru_raiffeisen_PerfPtProf
+ * Method:    leave
+ * Signature: (J)V
+ */
+JNIEXPORT void JNICALL Java_ru_raiffeisen_PerfPtProf_leave
+  (JNIEnv *, jclass, jlong);
+
 #ifdef __cplusplus
 }
 #endif
@@ -298,6 +298,23 @@ done:
 	return iter;
 }
 
+/*
+ * Forget all ranges, for tools that account more than one trace in the
+ * same process.
+ */
+void block_range__free_all(void)
+{
+	struct rb_node *rb;
+
+	while ((rb = rb_first(&block_ranges.root))) {
+		struct block_range *entry = rb_entry(rb, struct block_range, node);
+
+		rb_erase(rb, &block_ranges.root);
+		free(entry);
+	}
+
+	block_ranges.blocks = 0;
+}
 
 /*
  * Compute coverage as:
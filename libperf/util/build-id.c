@@ -10,7 +10,10 @@
 #include "util.h"
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include "build-id.h"
@@ -808,6 +811,215 @@ out_free:
 	return err;
 }
 
+/*
+ * Symbol table cache: the symbols dso__load() resolved for a user space DSO
+ * are stored as "symtab.func" or "symtab.var", by map type, in its build-id
+ * cache directory, so that later sessions map them in instead of parsing the
+ * ELF symbol tables again.
+ *
+ * Layout: header, nr_syms entries sorted by address, string table.
+ */
+#define SYMTAB_CACHE_MAGIC	0x3142545359535052ULL	/* "RPSYSTB1" */
+
+/* dso__load_sym() only keeps the symbols of the map's type */
+static const char *symtab_cache_name[MAP__NR_TYPES] = {
+	[MAP__FUNCTION] = "symtab.func",
+	[MAP__VARIABLE] = "symtab.var",
+};
+
+struct symtab_cache_header {
+	u64	magic;
+	u32	nr_syms;
+	u32	symtab_type;
+	u32	adjust_symbols;
+	u32	reserved;
+	u64	strtab_size;
+};
+
+struct symtab_cache_entry {
+	u64	start;
+	u64	end;
+	u32	name_off;
+	u8	binding;
+	u8	arch_sym;
+	u16	reserved;
+};
+
+static char *dso__symtab_cache_filename(struct dso *dso, enum map_type type)
+{
+	char sbuild_id[SBUILD_ID_SIZE];
+	char *linkname, *filename = NULL;
+	struct stat st;
+
+	build_id__sprintf(dso->build_id, sizeof(dso->build_id), sbuild_id);
+	linkname = build_id_cache__linkname(sbuild_id, NULL, 0);
+	if (!linkname)
+		return NULL;
+
+	/* old style cache entries are plain files, there is no room for us */
+	if (!stat(linkname, &st) && S_ISDIR(st.st_mode) &&
+	    asprintf(&filename, "%s/%s", linkname, symtab_cache_name[type]) < 0)
+		filename = NULL;
+
+	free(linkname);
+	return filename;
+}
+
+int dso__load_symtab_cache(struct dso *dso, struct map *map)
+{
+	struct symtab_cache_header *hdr;
+	struct symtab_cache_entry *entries;
+	const char *strtab;
+	char *filename;
+	struct stat st;
+	void *addr;
+	u32 i;
+	int fd, ret = -1;
+
+	if (no_buildid_cache || !dso->has_build_id)
+		return -1;
+
+	filename = dso__symtab_cache_filename(dso, map->type);
+	if (!filename)
+		return -1;
+
+	fd = open(filename, O_RDONLY);
+	free(filename);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr))
+		goto out_close;
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED)
+		goto out_close;
+
+	hdr = addr;
+	entries = addr + sizeof(*hdr);
+	strtab = (const char *)(entries + hdr->nr_syms);
+
+	if (hdr->magic != SYMTAB_CACHE_MAGIC || !hdr->nr_syms ||
+	    sizeof(*hdr) + hdr->nr_syms * sizeof(*entries) + hdr->strtab_size != (u64)st.st_size ||
+	    strtab[hdr->strtab_size - 1] != '\0')
+		goto out_unmap;
+
+	for (i = 0; i < hdr->nr_syms; i++) {
+		struct symbol *sym;
+
+		if (entries[i].name_off >= hdr->strtab_size)
+			goto out_delete;
+
+		sym = symbol__new(entries[i].start, entries[i].end - entries[i].start,
+				  entries[i].binding, strtab + entries[i].name_off);
+		if (!sym)
+			goto out_delete;
+
+		sym->arch_sym = entries[i].arch_sym;
+		dso__insert_symbol(dso, map->type, sym);
+	}
+
+	dso->symtab_type = hdr->symtab_type;
+	dso->adjust_symbols = hdr->adjust_symbols;
+	ret = hdr->nr_syms;
+	pr_debug("loaded %d cached symbols for %s\n", ret, dso->long_name);
+	goto out_unmap;
+
+out_delete:
+	symbols__delete(&dso->symbols[map->type]);
+out_unmap:
+	munmap(addr, st.st_size);
+out_close:
+	close(fd);
+	return ret;
+}
+
+int dso__save_symtab_cache(struct dso *dso, struct map *map)
+{
+	struct rb_root *symbols = &dso->symbols[map->type];
+	struct symtab_cache_header hdr = { .magic = SYMTAB_CACHE_MAGIC, };
+	char sbuild_id[SBUILD_ID_SIZE];
+	char *filename, *tmpname = NULL;
+	struct symbol *pos;
+	struct rb_node *nd;
+	u32 name_off = 0;
+	FILE *fp;
+	int fd, err = -1;
+
+	if (no_buildid_cache || !dso->has_build_id)
+		return -1;
+
+	build_id__sprintf(dso->build_id, sizeof(dso->build_id), sbuild_id);
+	if (!build_id_cache__cached(sbuild_id) &&
+	    build_id_cache__add_s(sbuild_id, dso->long_name, dso->nsinfo,
+				  false, false))
+		return -1;
+
+	filename = dso__symtab_cache_filename(dso, map->type);
+	if (!filename)
+		return -1;
+
+	if (asprintf(&tmpname, "%s.XXXXXX", filename) < 0) {
+		tmpname = NULL;
+		goto out_free;
+	}
+
+	fd = mkstemp(tmpname);
+	if (fd < 0)
+		goto out_free;
+
+	fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		goto out_unlink;
+	}
+
+	symbols__for_each_entry(symbols, pos, nd) {
+		hdr.nr_syms++;
+		hdr.strtab_size += pos->namelen + 1;
+	}
+	hdr.symtab_type = dso->symtab_type;
+	hdr.adjust_symbols = dso->adjust_symbols;
+
+	if (!hdr.nr_syms || hdr.strtab_size > UINT_MAX) {
+		fclose(fp);
+		goto out_unlink;
+	}
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	symbols__for_each_entry(symbols, pos, nd) {
+		struct symtab_cache_entry entry = {
+			.start	  = pos->start,
+			.end	  = pos->end,
+			.name_off = name_off,
+			.binding  = pos->binding,
+			.arch_sym = pos->arch_sym,
+		};
+
+		fwrite(&entry, sizeof(entry), 1, fp);
+		name_off += pos->namelen + 1;
+	}
+
+	symbols__for_each_entry(symbols, pos, nd)
+		fwrite(pos->name, pos->namelen + 1, 1, fp);
+
+	/* readers only ever see a complete file */
+	if (ferror(fp) | fclose(fp))
+		goto out_unlink;
+
+	if (!rename(tmpname, filename))
+		err = 0;
+
+out_unlink:
+	if (err)
+		unlink(tmpname);
+out_free:
+	free(tmpname);
+	free(filename);
+	return err;
+}
+
 static int dso__cache_build_id(struct dso *dso, struct machine *machine)
 {
 	bool is_kallsyms = dso__is_kallsyms(dso);
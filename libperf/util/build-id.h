@@ -51,6 +51,11 @@ int build_id_cache__add_s(const char *sbuild_id,
 			  bool is_kallsyms, bool is_vdso);
 int build_id_cache__remove_s(const char *sbuild_id);
 
+struct map;
+
+int dso__load_symtab_cache(struct dso *dso, struct map *map);
+int dso__save_symtab_cache(struct dso *dso, struct map *map);
+
 extern char buildid_dir[];
 
 void set_buildid_dir(const char *dir);
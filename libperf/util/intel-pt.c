@@ -784,6 +784,40 @@ static u64 intel_pt_ns_to_ticks(const struct intel_pt *pt, u64 ns)
 		pt->tc.time_mult;
 }
 
+static void intel_pt_free(struct perf_session *session);
+
+/*
+ * Convert between sample timestamps and the TSC domain so that samples can be
+ * matched against TSC values collected in-process (e.g. by the JVMTI agent).
+ */
+u64 intel_pt_perf_time_to_tsc(struct perf_session *session, u64 ns)
+{
+	struct intel_pt *pt;
+
+	if (!session->auxtrace || session->auxtrace->free != intel_pt_free)
+		return ns;
+
+	pt = container_of(session->auxtrace, struct intel_pt, auxtrace);
+	if (!pt->tc.time_mult)
+		return ns;
+
+	return perf_time_to_tsc(ns, &pt->tc);
+}
+
+u64 intel_pt_tsc_to_perf_time(struct perf_session *session, u64 tsc)
+{
+	struct intel_pt *pt;
+
+	if (!session->auxtrace || session->auxtrace->free != intel_pt_free)
+		return tsc;
+
+	pt = container_of(session->auxtrace, struct intel_pt, auxtrace);
+	if (!pt->tc.time_mult)
+		return tsc;
+
+	return tsc_to_perf_time(tsc, &pt->tc);
+}
+
 static struct intel_pt_queue *intel_pt_alloc_queue(struct intel_pt *pt,
 						   unsigned int queue_nr)
 {
@@ -16,6 +16,8 @@
 #ifndef INCLUDE__PERF_INTEL_PT_H__
 #define INCLUDE__PERF_INTEL_PT_H__
 
+#include <linux/types.h>
+
 #define INTEL_PT_PMU_NAME "intel_pt"
 
 enum {
@@ -53,4 +55,7 @@ int intel_pt_process_auxtrace_info(union perf_event *event,
 
 struct perf_event_attr *intel_pt_pmu_default_config(struct perf_pmu *pmu);
 
+u64 intel_pt_perf_time_to_tsc(struct perf_session *session, u64 ns);
+u64 intel_pt_tsc_to_perf_time(struct perf_session *session, u64 tsc);
+
 #endif
@@ -22,6 +22,7 @@
 #include "namespaces.h"
 #include "header.h"
 #include "path.h"
+#include "vdso.h"
 #include "sane_ctype.h"
 
 #include <elf.h>
@@ -1567,6 +1568,13 @@ int dso__load(struct dso *dso, struct map *map)
 		dso__set_build_id(dso, build_id);
 	}
 
+	/* a previous session may have left the parsed symbols behind */
+	if (!kmod && !dso__is_vdso(dso)) {
+		ret = dso__load_symtab_cache(dso, map);
+		if (ret > 0)
+			goto out_free;
+	}
+
 	/*
 	 * Iterate over candidate debug images.
 	 * Keep track of "interesting" ones (those which have a symtab, dynsym,
@@ -1651,6 +1659,9 @@ int dso__load(struct dso *dso, struct map *map)
 		nr_plt = dso__synthesize_plt_symbols(dso, runtime_ss, map);
 		if (nr_plt > 0)
 			ret += nr_plt;
+
+		if (!kmod && !dso__is_vdso(dso))
+			dso__save_symtab_cache(dso, map);
 	}
 
 	for (; ss_pos > 0; ss_pos--)